@@ -0,0 +1,603 @@
+// Every download engine against a loopback server, across a grid of file sizes and parallelism levels; run it with
+// --help for the options. Each run downloads in a forked child and prints one JSON object:
+// - engine, tls, size, parallel, zero_copy (splicing in effect), run, ok, seconds, mib_per_s
+// - requests, connections, injected_errors, corrupted, stalled, source_mib (body MiB each server sent)
+// - chunk_p50_ms, chunk_p99_ms: server-side time per range response
+// - peak_rss_kib, cpu_user_s, cpu_system_s, cpu_ms_per_gib, allocations (operator new calls of the download)
+// - cycles_per_gib: from the hardware counter, null where the kernel does not expose it
+
+#include "LocalHttpServer.h"
+
+#include <include/Crc32c.h>
+#include <include/DownloadVerifier.h>
+#include <include/Downloader.h>
+
+#include <openssl/evp.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// How long a finished run waits for the server threads still writing into its closed connections; a stalled response
+// only notices the client is gone once its stall is over
+static constexpr std::chrono::milliseconds DRAIN_TIMEOUT{2000};
+
+// Every operator new in the process, so a run can tell how much its receive path allocates. All forms are replaced,
+// so that each delete frees what its new allocated
+static std::atomic<uint64_t> heapAllocations = 0;
+
+static void* countedAllocation(size_t size, size_t alignment = 0)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    size = size ? size : 1;
+    // aligned_alloc takes only sizes that are a multiple of the alignment
+    return alignment ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+                     : std::malloc(size);
+}
+
+static void* countedNew(size_t size, size_t alignment = 0)
+{
+    if (void* memory = countedAllocation(size, alignment))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size)
+{
+    return countedNew(size);
+}
+
+void* operator new[](size_t size)
+{
+    return countedNew(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return countedNew(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return countedNew(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return countedAllocation(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return countedAllocation(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return countedAllocation(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return countedAllocation(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+struct BenchmarkConfig
+{
+    std::vector<Engine> engines = {Engine::Boost, Engine::CurlMulti, Engine::CurlThreads};
+    std::vector<uint64_t> sizesMiB = {1, 16, 128};
+    std::vector<int> parallel = {1, 4, 16};
+    int repeat = 1;
+    int threads = 1;
+    bool verify = false;
+    bool adaptive = false;
+    bool fastStart = false;
+    double hedgeBudget = DownloadOptions{}.hedgeBudget;
+    // Zero-copy settings the Boost engine runs with; the curl engines have no splice path
+    std::vector<bool> zeroCopy = {true};
+    ServerOptions server;
+    // Bytes per second of each mirror
+    std::vector<uint64_t> mirrorBandwidth;
+    std::string cacheDir;
+    // Bytes of the reorder window; with one the file goes through the engines' ordered output, as into a pipe
+    uint64_t reorderWindow = 0;
+    std::string outputFile = (std::filesystem::temp_directory_path() / "file_downloader_bench.bin").string();
+};
+
+template <class T> std::vector<T> parseList(const std::string& text)
+{
+    std::vector<T> values;
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ','))
+        values.push_back(static_cast<T>(std::stoull(item)));
+    return values;
+}
+
+bool parseArguments(int argc, char* argv[], BenchmarkConfig& config)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string name = argv[i];
+        if (name == "--tls")
+        {
+            config.server.tls = true;
+            continue;
+        }
+        if (name == "--verify")
+        {
+            config.verify = true;
+            continue;
+        }
+        if (name == "--adaptive")
+        {
+            config.adaptive = true;
+            continue;
+        }
+        if (name == "--fast-start")
+        {
+            config.fastStart = true;
+            continue;
+        }
+        if (name == "--no-ranges")
+        {
+            config.server.ranges = false;
+            continue;
+        }
+        if (name == "--chunked")
+        {
+            config.server.chunked = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+
+        const std::string value = argv[++i];
+        if (name == "--engines")
+        {
+            config.engines.clear();
+            std::istringstream in(value);
+            std::string item;
+            while (std::getline(in, item, ','))
+            {
+                const auto engine = parseEngine(item);
+                if (!engine)
+                    return false;
+                config.engines.push_back(*engine);
+            }
+        }
+        else if (name == "--sizes-mib")
+            config.sizesMiB = parseList<uint64_t>(value);
+        else if (name == "--parallel")
+            config.parallel = parseList<int>(value);
+        else if (name == "--repeat")
+            config.repeat = std::stoi(value);
+        else if (name == "--threads")
+            config.threads = std::stoi(value);
+        else if (name == "--latency-ms")
+            config.server.latency = std::chrono::milliseconds(std::stoi(value));
+        else if (name == "--bandwidth-mib")
+            config.server.bandwidth = std::stoull(value) * 1024 * 1024;
+        else if (name == "--connection-mib")
+            config.server.connectionBandwidth = std::stoull(value) * 1024 * 1024;
+        else if (name == "--error-rate")
+            config.server.errorRate = std::stod(value);
+        else if (name == "--corruption-rate")
+            config.server.corruptionRate = std::stod(value);
+        else if (name == "--stall-rate")
+            config.server.stallRate = std::stod(value);
+        else if (name == "--hedge-budget")
+            config.hedgeBudget = std::stod(value);
+        else if (name == "--mirror-bandwidth-mib")
+        {
+            config.mirrorBandwidth = parseList<uint64_t>(value);
+            for (auto& bandwidth : config.mirrorBandwidth)
+                bandwidth *= 1024 * 1024;
+        }
+        else if (name == "--copy")
+        {
+            config.zeroCopy.clear();
+            std::istringstream in(value);
+            std::string item;
+            while (std::getline(in, item, ','))
+            {
+                if (item != "buffered" && item != "splice")
+                    return false;
+                config.zeroCopy.push_back(item == "splice");
+            }
+        }
+        else if (name == "--cache-dir")
+            config.cacheDir = value;
+        else if (name == "--reorder-window-mib")
+            config.reorderWindow = std::stoull(value) * 1024 * 1024;
+        else if (name == "--output")
+            config.outputFile = value;
+        else
+            return false;
+    }
+    return true;
+}
+
+// Writes the block checksum manifest of a synthetic file and returns its SHA-256
+std::string prepareVerification(uint64_t fileSize, const std::string& manifestPath)
+{
+    std::ofstream manifest(manifestPath);
+    manifest << "block-size " << DownloadVerifier::DEFAULT_BLOCK_SIZE << "\n";
+
+    EVP_MD_CTX* context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+    std::vector<char> block(DownloadVerifier::DEFAULT_BLOCK_SIZE);
+    for (uint64_t offset = 0; offset < fileSize; offset += block.size())
+    {
+        const auto size = static_cast<size_t>(std::min<uint64_t>(block.size(), fileSize - offset));
+        for (size_t i = 0; i < size; ++i)
+            block[i] = LocalHttpServer::patternByte(offset + i);
+        char crc[16];
+        std::snprintf(crc, sizeof(crc), "%08x\n", crc32c(block.data(), size));
+        manifest << crc;
+        EVP_DigestUpdate(context, block.data(), size);
+    }
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    EVP_DigestFinal_ex(context, digest, &length);
+    EVP_MD_CTX_free(context);
+    return toHex(digest, length);
+}
+
+// What the forked child measured around the download, in memory shared with the parent
+struct RunCounters
+{
+    uint64_t allocations = 0;
+    // Negative when the hardware counter is not available
+    int64_t cycles = -1;
+};
+
+// Counts the CPU cycles of the calling thread and of the threads it starts from now on, kernel mode included;
+// -1 where the kernel does not allow it
+int openCycleCounter()
+{
+#ifdef __linux__
+    perf_event_attr attributes{};
+    attributes.size = sizeof(attributes);
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.config = PERF_COUNT_HW_CPU_CYCLES;
+    attributes.inherit = 1;
+    attributes.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#else
+    return -1;
+#endif
+}
+
+// The threads of the download are joined by now, so their counts were folded into the counter
+int64_t readCycleCounter(int counter)
+{
+    uint64_t cycles = 0;
+    if (counter < 0 || read(counter, &cycles, sizeof(cycles)) != sizeof(cycles))
+        return -1;
+    close(counter);
+    return static_cast<int64_t>(cycles);
+}
+
+// Runs in the forked child; the exit code tells the parent whether the engine reported success
+int runDownload(Engine engine, const std::string& url, const std::vector<std::string>& mirrorUrls,
+                const BenchmarkConfig& config, const std::string& caFile, const DownloadOptions& verification,
+                int parallelTasks, bool zeroCopy, RunCounters& counters)
+{
+    // Engine progress messages would drown the results
+    std::cerr.rdbuf(nullptr);
+
+    // An ordered output hands the file to a consumer, which writes it out for the check
+    std::ofstream ordered;
+    auto downloader = createDownloader(engine, url);
+    DownloadOptions options = verification;
+    if (config.reorderWindow > 0)
+    {
+        ordered.open(config.outputFile, std::ios::binary);
+        options.reorderWindow = config.reorderWindow;
+        options.outputConsumer = [&ordered](const char* data, size_t size) {
+            return static_cast<bool>(ordered.write(data, static_cast<std::streamsize>(size)));
+        };
+    }
+    options.threads = config.threads;
+    options.resume = false;
+    options.adaptive = config.adaptive;
+    options.fastStart = config.fastStart;
+    options.zeroCopy = zeroCopy;
+    options.hedgeBudget = config.hedgeBudget;
+    options.caFile = caFile;
+    options.mirrors = mirrorUrls;
+    options.cacheDir = config.cacheDir;
+    downloader->setOptions(options);
+    downloader->setUp();
+
+    const auto fileSize = downloader->getFileSize();
+    if (fileSize == 0 && !downloader->remoteFile().singleStream())
+        return 1;
+
+    const int cycleCounter = openCycleCounter();
+    const uint64_t allocationsBefore = heapAllocations.load();
+    const bool success = downloader->downloadFile(config.outputFile, parallelTasks, fileSize);
+    counters.allocations = heapAllocations.load() - allocationsBefore;
+    counters.cycles = readCycleCounter(cycleCounter);
+    return success ? 0 : 1;
+}
+
+bool matchesPattern(const std::string& path, uint64_t fileSize)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::vector<char> block(1024 * 1024);
+    uint64_t offset = 0;
+    while (offset < fileSize)
+    {
+        const auto size = static_cast<size_t>(std::min<uint64_t>(block.size(), fileSize - offset));
+        if (!in.read(block.data(), size))
+            return false;
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (block[i] != LocalHttpServer::patternByte(offset + i))
+                return false;
+        }
+        offset += size;
+    }
+    return in.peek() == std::char_traits<char>::eof();
+}
+
+double percentile(std::vector<double> values, double share)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    const auto index = static_cast<size_t>(share * (values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+double seconds(const timeval& time)
+{
+    return time.tv_sec + time.tv_usec / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+    BenchmarkConfig config;
+    if (!parseArguments(argc, argv, config))
+    {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--engines boost,curl,curl-threads] [--sizes-mib 1,16,128] [--parallel 1,4,16] [--repeat 1]"
+                     " [--threads 1] [--tls] [--latency-ms 0] [--bandwidth-mib 0] [--connection-mib 0]"
+                     " [--error-rate 0] [--corruption-rate 0] [--stall-rate 0] [--verify] [--adaptive]"
+                     " [--copy splice] [--hedge-budget 0.1] [--mirror-bandwidth-mib 0] [--fast-start] [--no-ranges]"
+                     " [--chunked] [--cache-dir path] [--reorder-window-mib 0] [--output path]\n"
+                     "  --copy buffered,splice  the Boost engine with and without splicing bodies to the file; over TLS"
+                     " the bytes are decrypted in user space and splicing has no effect\n"
+                     "  --verify                hand the engines the SHA-256 and a block checksum manifest\n"
+                     "  --adaptive              let the engines tune their connections, --parallel is the ceiling\n"
+                     "  --stall-rate            pause that share of range responses halfway for ten seconds;"
+                     " --hedge-budget 0 turns hedging off to compare\n"
+                     "  --mirror-bandwidth-mib  one mirror per value, capped at that many MiB/s (0 for none);"
+                     " --bandwidth-mib caps the first server\n"
+                     "  --fast-start            send the first range instead of a size probe; shows with --latency-ms\n"
+                     "  --no-ranges, --chunked  ignore Range requests, or send bodies without a length\n"
+                     "  --cache-dir             keep each download in that cache; with --repeat 2 later runs only"
+                     " revalidate\n"
+                     "  --reorder-window-mib    download through the ordered output with that window, as into a pipe;"
+                     " splicing is then off"
+                  << std::endl;
+        return 1;
+    }
+
+    LocalHttpServer server(config.server);
+    std::vector<std::unique_ptr<LocalHttpServer>> mirrors;
+    for (const uint64_t bandwidth : config.mirrorBandwidth)
+    {
+        ServerOptions options = config.server;
+        options.bandwidth = bandwidth;
+        mirrors.push_back(std::make_unique<LocalHttpServer>(options));
+    }
+    // Every server signs its own certificate, so with mirrors the engines trust a bundle of them
+    std::string caFile = server.certificateFile();
+    if (config.server.tls && !mirrors.empty())
+    {
+        caFile = config.outputFile + ".ca.pem";
+        std::ofstream bundle(caFile);
+        bundle << std::ifstream(server.certificateFile()).rdbuf();
+        for (const auto& mirror : mirrors)
+            bundle << std::ifstream(mirror->certificateFile()).rdbuf();
+    }
+    bool allOk = true;
+    auto* counters = static_cast<RunCounters*>(
+        mmap(nullptr, sizeof(RunCounters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (counters == MAP_FAILED)
+    {
+        std::cerr << "Cannot map memory shared with the download processes" << std::endl;
+        return 1;
+    }
+
+    for (const uint64_t sizeMiB : config.sizesMiB)
+    {
+        const uint64_t fileSize = sizeMiB * 1024 * 1024;
+        const std::string url = server.url(fileSize);
+        std::vector<std::string> mirrorUrls;
+        for (const auto& mirror : mirrors)
+            mirrorUrls.push_back(mirror->url(fileSize));
+
+        DownloadOptions verification;
+        if (config.verify)
+        {
+            verification.blockChecksums = config.outputFile + ".blocks";
+            verification.sha256 = prepareVerification(fileSize, verification.blockChecksums);
+        }
+
+        for (const Engine engine : config.engines)
+        {
+            const std::vector<bool> copyModes = engine == Engine::Boost ? config.zeroCopy : std::vector<bool>{false};
+            for (const int parallelTasks : config.parallel)
+            {
+                for (const bool zeroCopy : copyModes)
+                {
+                    for (int run = 0; run < config.repeat; ++run)
+                    {
+                        std::remove(config.outputFile.c_str());
+                        server.takeStats();
+                        for (auto& mirror : mirrors)
+                            mirror->takeStats();
+                        *counters = RunCounters{};
+                        std::cout.flush();
+
+                        const auto started = std::chrono::steady_clock::now();
+                        const pid_t child = fork();
+                        if (child == 0)
+                            _exit(runDownload(engine, url, mirrorUrls, config, caFile, verification, parallelTasks,
+                                              zeroCopy, *counters));
+
+                        int status = 0;
+                        rusage usage{};
+                        wait4(child, &status, 0, &usage);
+                        const double elapsed =
+                            std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+                        // The child's connections are gone, but the server threads may still be writing into them
+                        server.waitIdle(DRAIN_TIMEOUT);
+                        for (auto& mirror : mirrors)
+                            mirror->waitIdle(DRAIN_TIMEOUT);
+                        // The mirrors' counters add up with the first server's
+                        ServerStats stats = server.takeStats();
+                        std::vector<uint64_t> sourceBytes{stats.bodyBytes};
+                        for (auto& mirror : mirrors)
+                        {
+                            ServerStats mirrorStats = mirror->takeStats();
+                            stats.connections += mirrorStats.connections;
+                            stats.requests += mirrorStats.requests;
+                            stats.injectedErrors += mirrorStats.injectedErrors;
+                            stats.corruptedResponses += mirrorStats.corruptedResponses;
+                            stats.stalledResponses += mirrorStats.stalledResponses;
+                            stats.responseMs.insert(stats.responseMs.end(), mirrorStats.responseMs.begin(),
+                                                    mirrorStats.responseMs.end());
+                            sourceBytes.push_back(mirrorStats.bodyBytes);
+                        }
+
+                        const bool ok = child > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+                                        matchesPattern(config.outputFile, fileSize);
+                        allOk = allOk && ok;
+                        const double cpuSeconds = seconds(usage.ru_utime) + seconds(usage.ru_stime);
+                        const double gib = fileSize / (1024.0 * 1024.0 * 1024.0);
+
+                        std::cout << "{\"engine\":\"" << engineName(engine) << "\",\"tls\":"
+                                  << (config.server.tls ? "true" : "false") << ",\"size\":" << fileSize
+                                  << ",\"parallel\":" << parallelTasks
+                                  << ",\"zero_copy\":"
+                                  << (zeroCopy && !config.server.tls && !config.reorderWindow ? "true" : "false")
+                                  << ",\"run\":" << run
+                                  << ",\"ok\":" << (ok ? "true" : "false") << ",\"seconds\":" << elapsed
+                                  << ",\"mib_per_s\":" << (ok ? sizeMiB / elapsed : 0.0)
+                                  << ",\"requests\":" << stats.requests << ",\"connections\":" << stats.connections
+                                  << ",\"injected_errors\":" << stats.injectedErrors
+                                  << ",\"corrupted\":" << stats.corruptedResponses
+                                  << ",\"stalled\":" << stats.stalledResponses << ",\"source_mib\":[";
+                        for (size_t i = 0; i < sourceBytes.size(); ++i)
+                            std::cout << (i ? "," : "") << sourceBytes[i] / (1024.0 * 1024.0);
+                        std::cout << "]"
+                                  << ",\"chunk_p50_ms\":" << percentile(stats.responseMs, 0.50)
+                                  << ",\"chunk_p99_ms\":" << percentile(stats.responseMs, 0.99)
+                                  << ",\"peak_rss_kib\":" << usage.ru_maxrss
+                                  << ",\"cpu_user_s\":" << seconds(usage.ru_utime)
+                                  << ",\"cpu_system_s\":" << seconds(usage.ru_stime)
+                                  << ",\"allocations\":" << counters->allocations
+                                  << ",\"cpu_ms_per_gib\":" << cpuSeconds * 1000.0 / gib << ",\"cycles_per_gib\":";
+                        if (counters->cycles >= 0)
+                            std::cout << static_cast<double>(counters->cycles) / gib;
+                        else
+                            std::cout << "null";
+                        std::cout << "}" << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    munmap(counters, sizeof(RunCounters));
+    std::remove(config.outputFile.c_str());
+    std::remove((config.outputFile + ".blocks").c_str());
+    std::remove((config.outputFile + ".ca.pem").c_str());
+    return allOk ? 0 : 1;
+}
@@ -0,0 +1,432 @@
+#include "LocalHttpServer.h"
+
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+using tcp = asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t SLICE_SIZE = 64 * 1024;
+
+static std::string toPem(int (*write)(BIO*, void*), void* object)
+{
+    BIO* bio = BIO_new(BIO_s_mem());
+    write(bio, object);
+    char* data = nullptr;
+    const long size = BIO_get_mem_data(bio, &data);
+    std::string pem(data, size);
+    BIO_free(bio);
+    return pem;
+}
+
+// Self-signed certificate for 127.0.0.1 and localhost; the PEM goes to a temporary file the clients can trust, one
+// per server so that several can run side by side
+static std::string makeCertificate(asio::ssl::context& context, unsigned short port)
+{
+    EVP_PKEY* key = nullptr;
+    EVP_PKEY_CTX* keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    EVP_PKEY_keygen_init(keyContext);
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1);
+    EVP_PKEY_keygen(keyContext, &key);
+    EVP_PKEY_CTX_free(keyContext);
+
+    X509* certificate = X509_new();
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 7 * 24 * 3600);
+    X509_set_pubkey(certificate, key);
+
+    X509_NAME* name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1,
+                               0);
+    // Trust stores look issuers up by name, so the certificates of servers running side by side need their own
+    const std::string unit = "port " + std::to_string(port);
+    X509_NAME_add_entry_by_txt(name, "OU", MBSTRING_ASC, reinterpret_cast<const unsigned char*>(unit.c_str()), -1, -1,
+                               0);
+    X509_set_issuer_name(certificate, name);
+
+    X509V3_CTX extensionContext;
+    X509V3_set_ctx_nodb(&extensionContext);
+    X509V3_set_ctx(&extensionContext, certificate, certificate, nullptr, nullptr, 0);
+    // A trust anchor has to be a CA, even one that only ever signs itself
+    const std::pair<int, const char*> extensions[] = {{NID_basic_constraints, "critical,CA:TRUE"},
+                                                      {NID_key_usage, "digitalSignature,keyCertSign"},
+                                                      {NID_subject_alt_name, "IP:127.0.0.1,DNS:localhost"}};
+    for (const auto& [nid, value] : extensions)
+    {
+        X509_EXTENSION* extension = X509V3_EXT_conf_nid(nullptr, &extensionContext, nid, value);
+        X509_add_ext(certificate, extension, -1);
+        X509_EXTENSION_free(extension);
+    }
+    X509_sign(certificate, key, EVP_sha256());
+
+    const auto certificatePem = toPem([](BIO* bio, void* x) { return PEM_write_bio_X509(bio, static_cast<X509*>(x)); },
+                                      certificate);
+    const auto keyPem = toPem(
+        [](BIO* bio, void* k) {
+            return PEM_write_bio_PrivateKey(bio, static_cast<EVP_PKEY*>(k), nullptr, nullptr, 0, nullptr, nullptr);
+        },
+        key);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+
+    context.use_certificate(asio::buffer(certificatePem), asio::ssl::context::pem);
+    context.use_private_key(asio::buffer(keyPem), asio::ssl::context::pem);
+
+    const auto path = std::filesystem::temp_directory_path() /
+                      ("file_downloader_bench_" + std::to_string(getpid()) + "_" + std::to_string(port) + ".pem");
+    std::ofstream(path) << certificatePem;
+    return path.string();
+}
+
+// "/<size>.bin"
+static bool parseSize(const std::string& target, uint64_t& size)
+{
+    if (target.size() < 6 || target[0] != '/' || target.compare(target.size() - 4, 4, ".bin") != 0)
+        return false;
+
+    try
+    {
+        size_t parsed = 0;
+        size = std::stoull(target.substr(1), &parsed);
+        return parsed == target.size() - 5 && size > 0;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+// "bytes=<first>-[<last>]"
+static bool parseRange(const std::string& range, uint64_t size, uint64_t& first, uint64_t& last)
+{
+    const auto dash = range.find('-');
+    if (range.rfind("bytes=", 0) != 0 || dash == std::string::npos)
+        return false;
+
+    try
+    {
+        first = std::stoull(range.substr(6, dash - 6));
+        last = size - 1;
+        if (dash + 1 < range.size())
+            last = std::min<uint64_t>(std::stoull(range.substr(dash + 1)), last);
+        return first <= last;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+LocalHttpServer::LocalHttpServer(ServerOptions serverOptions)
+    : options(serverOptions), acceptor(ioContext, tcp::endpoint(asio::ip::address_v4::loopback(), 0))
+{
+    listenPort = acceptor.local_endpoint().port();
+    if (options.tls)
+    {
+        tlsContext = std::make_unique<asio::ssl::context>(asio::ssl::context::tls_server);
+        certificatePath = makeCertificate(*tlsContext, listenPort);
+    }
+    acceptThread = std::thread([this] { acceptLoop(); });
+}
+
+LocalHttpServer::~LocalHttpServer()
+{
+    stopping = true;
+
+    // A blocked accept() only returns for a connection
+    boost::system::error_code ignored;
+    tcp::socket wakeUp(ioContext);
+    wakeUp.connect(tcp::endpoint(asio::ip::address_v4::loopback(), listenPort), ignored);
+    acceptThread.join();
+
+    std::vector<std::thread> running;
+    {
+        std::lock_guard lock(mutex);
+        for (int fd : openSockets)
+            ::shutdown(fd, SHUT_RDWR);
+        running = std::move(workers);
+    }
+    for (auto& worker : running)
+        worker.join();
+
+    if (!certificatePath.empty())
+        std::filesystem::remove(certificatePath);
+}
+
+std::string LocalHttpServer::url(uint64_t fileSize) const
+{
+    return std::string(options.tls ? "https" : "http") + "://127.0.0.1:" + std::to_string(listenPort) + "/" +
+           std::to_string(fileSize) + ".bin";
+}
+
+ServerStats LocalHttpServer::takeStats()
+{
+    std::lock_guard lock(mutex);
+    ServerStats taken = std::move(stats);
+    stats = {};
+    return taken;
+}
+
+bool LocalHttpServer::waitIdle(std::chrono::milliseconds timeout)
+{
+    std::unique_lock lock(mutex);
+    return idle.wait_for(lock, timeout, [this] { return openSockets.empty(); });
+}
+
+char LocalHttpServer::patternByte(uint64_t offset)
+{
+    // Neighbouring bytes and blocks differ, so a range written to the wrong place does not go unnoticed
+    return static_cast<char>((offset ^ (offset >> 8) ^ (offset >> 16) ^ (offset >> 24)) * 167);
+}
+
+void LocalHttpServer::acceptLoop()
+{
+    while (!stopping)
+    {
+        tcp::socket socket(ioContext);
+        boost::system::error_code error;
+        acceptor.accept(socket, error);
+        if (stopping)
+            break;
+        if (error)
+            continue;
+
+        socket.set_option(tcp::no_delay(true), error);
+        std::lock_guard lock(mutex);
+        // Registered here rather than by the worker, so shutting down never misses a fresh connection
+        openSockets.insert(socket.native_handle());
+        ++stats.connections;
+        workers.emplace_back([this, connection = std::move(socket)]() mutable { serve(std::move(connection)); });
+    }
+}
+
+void LocalHttpServer::serve(tcp::socket socket)
+{
+    const int fd = socket.native_handle();
+    try
+    {
+        if (tlsContext)
+        {
+            asio::ssl::stream<tcp::socket&> stream(socket, *tlsContext);
+            stream.handshake(asio::ssl::stream_base::server);
+            serveRequests(stream);
+        }
+        else
+        {
+            serveRequests(socket);
+        }
+    }
+    catch (const std::exception&)
+    {
+        // The client went away mid-response
+    }
+
+    std::lock_guard lock(mutex);
+    openSockets.erase(fd);
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    if (openSockets.empty())
+        idle.notify_all();
+}
+
+template <class Stream> void LocalHttpServer::serveRequests(Stream& stream)
+{
+    beast::flat_buffer buffer;
+    for (;;)
+    {
+        http::request<http::empty_body> request;
+        boost::system::error_code error;
+        http::read(stream, buffer, request, error);
+        if (error)
+            return;
+
+        if (!respond(stream, std::string(request.method_string()), std::string(request.target()),
+                     std::string(request[http::field::range]), std::string(request[http::field::if_range]),
+                     std::string(request[http::field::if_none_match]), request.keep_alive()))
+        {
+            return;
+        }
+    }
+}
+
+template <class Stream>
+bool LocalHttpServer::respond(Stream& stream, const std::string& method, const std::string& target,
+                              const std::string& range, const std::string& ifRange, const std::string& ifNoneMatch,
+                              bool keepAlive)
+{
+    const auto started = Clock::now();
+    {
+        std::lock_guard lock(mutex);
+        ++stats.requests;
+    }
+    if (options.latency.count() > 0)
+        std::this_thread::sleep_for(options.latency);
+
+    const auto sendStatus = [&](const char* status) {
+        const std::string header = std::string("HTTP/1.1 ") + status + "\r\nContent-Length: 0\r\n" +
+                                   (keepAlive ? "" : "Connection: close\r\n") + "\r\n";
+        asio::write(stream, asio::buffer(header));
+        return keepAlive;
+    };
+
+    uint64_t size = 0;
+    if (!parseSize(target, size))
+        return sendStatus("404 Not Found");
+
+    thread_local std::mt19937_64 random(std::random_device{}());
+    bool truncate = false;
+    if (options.errorRate > 0.0 && method == "GET")
+    {
+        const double draw = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+        if (draw < options.errorRate)
+        {
+            {
+                std::lock_guard lock(mutex);
+                ++stats.injectedErrors;
+            }
+            if (draw < options.errorRate / 2)
+                return sendStatus("503 Service Unavailable");
+            truncate = true;
+        }
+    }
+
+    const std::string etag = "\"" + std::to_string(size) + "\"";
+    if (ifNoneMatch == etag)
+        return sendStatus("304 Not Modified");
+
+    uint64_t first = 0;
+    uint64_t last = size - 1;
+    const bool partial = options.ranges && !range.empty() && (ifRange.empty() || ifRange == etag);
+    if (partial && !parseRange(range, size, first, last))
+        return sendStatus("416 Range Not Satisfiable");
+
+    const uint64_t length = last - first + 1;
+    std::string header = partial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+    header += options.chunked ? std::string("Transfer-Encoding: chunked") : "Content-Length: " + std::to_string(length);
+    header += std::string("\r\nAccept-Ranges: ") + (options.ranges ? "bytes" : "none") + "\r\nETag: " + etag + "\r\n";
+    if (partial)
+        header += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" +
+                  std::to_string(size) + "\r\n";
+    if (!keepAlive)
+        header += "Connection: close\r\n";
+    header += "\r\n";
+    asio::write(stream, asio::buffer(header));
+    if (method == "HEAD")
+        return keepAlive;
+
+    bool corrupt = false;
+    if (options.corruptionRate > 0.0 && method == "GET" &&
+        std::uniform_real_distribution<double>(0.0, 1.0)(random) < options.corruptionRate)
+    {
+        corrupt = true;
+        std::lock_guard lock(mutex);
+        ++stats.corruptedResponses;
+    }
+
+    bool stall = false;
+    if (options.stallRate > 0.0 && method == "GET" && partial &&
+        std::uniform_real_distribution<double>(0.0, 1.0)(random) < options.stallRate)
+    {
+        stall = true;
+        std::lock_guard lock(mutex);
+        ++stats.stalledResponses;
+    }
+
+    std::vector<char> slice(SLICE_SIZE);
+    uint64_t sent = 0;
+    // Counts what went out also when the response is cut short or the client hangs up halfway
+    struct BodyCounter
+    {
+        LocalHttpServer& server;
+        const uint64_t& sent;
+        ~BodyCounter()
+        {
+            std::lock_guard lock(server.mutex);
+            server.stats.bodyBytes += sent;
+        }
+    } counter{*this, sent};
+    while (sent < length)
+    {
+        // An injected failure cuts the body short and drops the connection
+        if (truncate && sent >= length / 2)
+            return false;
+        if (stall && sent >= length / 2)
+        {
+            // Short naps, so shutting the server down does not wait for the whole stall
+            const auto resume = Clock::now() + options.stallTime;
+            while (!stopping && Clock::now() < resume)
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            stall = false;
+        }
+
+        const size_t bytes = static_cast<size_t>(std::min<uint64_t>(slice.size(), length - sent));
+        for (size_t i = 0; i < bytes; ++i)
+            slice[i] = patternByte(first + sent + i);
+        if (corrupt && sent <= length / 2 && length / 2 < sent + bytes)
+            slice[length / 2 - sent] ^= 0x01;
+
+        throttle(started, sent, bytes);
+        if (options.chunked)
+        {
+            std::ostringstream size;
+            size << std::hex << bytes << "\r\n";
+            const std::string prefix = size.str();
+            const std::array<asio::const_buffer, 3> framed{asio::buffer(prefix), asio::buffer(slice.data(), bytes),
+                                                           asio::buffer("\r\n", 2)};
+            asio::write(stream, framed);
+        }
+        else
+        {
+            asio::write(stream, asio::buffer(slice.data(), bytes));
+        }
+        sent += bytes;
+    }
+    if (options.chunked)
+        asio::write(stream, asio::buffer("0\r\n\r\n", 5));
+
+    const auto elapsed = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+    std::lock_guard lock(mutex);
+    stats.responseMs.push_back(elapsed);
+    return keepAlive;
+}
+
+void LocalHttpServer::throttle(Clock::time_point started, uint64_t sent, size_t bytes)
+{
+    auto wakeUp = Clock::now();
+    if (options.connectionBandwidth > 0)
+    {
+        const std::chrono::duration<double> due(static_cast<double>(sent) / options.connectionBandwidth);
+        wakeUp = std::max(wakeUp, started + std::chrono::duration_cast<Clock::duration>(due));
+    }
+    if (options.bandwidth > 0)
+    {
+        // Every slice books the next free slot of the shared link
+        const std::chrono::duration<double> slot(static_cast<double>(bytes) / options.bandwidth);
+        std::lock_guard lock(mutex);
+        const auto start = std::max(bandwidthFree, wakeUp);
+        bandwidthFree = start + std::chrono::duration_cast<Clock::duration>(slot);
+        wakeUp = start;
+    }
+    std::this_thread::sleep_until(wakeUp);
+}
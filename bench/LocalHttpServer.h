@@ -0,0 +1,102 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/context.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ServerOptions
+{
+    // Serve over TLS with a self-signed certificate made at startup
+    bool tls = false;
+    // Delay before every response, like a round trip to a distant server
+    std::chrono::milliseconds latency{0};
+    // Bytes per second across all connections; 0 is unlimited
+    uint64_t bandwidth = 0;
+    // Bytes per second of each connection, like a CDN throttling per connection; 0 is unlimited
+    uint64_t connectionBandwidth = 0;
+    // Share of responses that fail: half of them answer 503, the others drop the connection halfway through the body
+    double errorRate = 0.0;
+    // Share of range responses with one byte flipped halfway through the body, for the verification paths
+    double corruptionRate = 0.0;
+    // Share of range responses that stop halfway through the body for stallTime, like a bad node or a lossy path
+    double stallRate = 0.0;
+    std::chrono::milliseconds stallTime{10000};
+    // Off answers every GET with the whole file, like a server without range support
+    bool ranges = true;
+    // Send bodies chunked and never announce their length, like a server streaming generated content
+    bool chunked = false;
+};
+
+struct ServerStats
+{
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t injectedErrors = 0;
+    uint64_t corruptedResponses = 0;
+    uint64_t stalledResponses = 0;
+    // Response body bytes written, the interrupted ones included
+    uint64_t bodyBytes = 0;
+    // Time from reading a GET to writing its last byte, one entry per completed response
+    std::vector<double> responseMs;
+};
+
+// Loopback HTTP/1.1 stand-in for the download benchmarks. Serves synthetic files at /<size>.bin whose bytes are a
+// function of their offset, with HEAD, Range, If-Range and keep-alive, so downloads can be checked without a copy
+// of the file. Every connection gets its own thread with blocking I/O, which keeps the throttling simple and puts
+// the server's CPU time in other threads than the engine under test.
+class LocalHttpServer
+{
+  public:
+    explicit LocalHttpServer(ServerOptions options);
+    ~LocalHttpServer();
+
+    unsigned short port() const { return listenPort; }
+    std::string url(uint64_t fileSize) const;
+    // PEM file with the self-signed certificate, for DownloadOptions::caFile; empty without TLS
+    const std::string& certificateFile() const { return certificatePath; }
+
+    // Returns the counters gathered since the previous call and starts over
+    ServerStats takeStats();
+    // Waits until every connection is closed, so their last responses are in the counters; false on timeout
+    bool waitIdle(std::chrono::milliseconds timeout);
+
+    static char patternByte(uint64_t offset);
+
+  private:
+    void acceptLoop();
+    void serve(boost::asio::ip::tcp::socket socket);
+    template <class Stream> void serveRequests(Stream& stream);
+    template <class Stream> bool respond(Stream& stream, const std::string& method, const std::string& target,
+                                         const std::string& range, const std::string& ifRange,
+                                         const std::string& ifNoneMatch, bool keepAlive);
+    // Paces a response body: `sent` bytes went out since `started`, `bytes` more are about to
+    void throttle(std::chrono::steady_clock::time_point started, uint64_t sent, size_t bytes);
+
+    ServerOptions options;
+    boost::asio::io_context ioContext;
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::unique_ptr<boost::asio::ssl::context> tlsContext;
+    std::string certificatePath;
+    unsigned short listenPort = 0;
+
+    std::atomic<bool> stopping = false;
+    std::thread acceptThread;
+
+    std::mutex mutex;
+    std::vector<std::thread> workers;
+    std::set<int> openSockets;
+    std::condition_variable idle;
+    std::chrono::steady_clock::time_point bandwidthFree;
+    ServerStats stats;
+};
@@ -0,0 +1,168 @@
+// One connection per range versus ranges multiplexed as HTTP/2 (and HTTP/3, when libcurl has it) streams.
+//
+// Usage: multiplex_benchmark <url> [parallel=16] [repeat=3] [output=bench_multiplex.bin]
+// The file is split into `parallel` ranges that all start at once. Prints one CSV row per protocol, for its fastest
+// run: protocol,negotiated,handshakes,ttfb_p50_ms,ttfb_max_ms,best_seconds,best_mib_per_s
+// `handshakes` counts the connections curl had to open, `negotiated` the HTTP version the server actually spoke.
+
+#include <include/CurlEventLoop.h>
+#include <include/CurlUtils.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct RunResult
+{
+    bool ok = true;
+    double seconds = 0.0;
+    long handshakes = 0;
+    long negotiated = 0;
+    std::vector<double> ttfbMs;
+};
+
+RunResult runOnce(const std::string& url, const std::string& outputFile, uint64_t fileSize, int parallelTasks,
+                  const DownloadOptions& options)
+{
+    RunResult run;
+    FileSink sink;
+    if (!sink.open(outputFile, fileSize))
+    {
+        run.ok = false;
+        return run;
+    }
+
+    boost::asio::io_context ioContext;
+    CurlEventLoop eventLoop(ioContext);
+    CURLM* multiHandle = eventLoop.multi();
+    configureMultiplexing(multiHandle, options, parallelTasks);
+
+    auto chunks = createChunks(parallelTasks, fileSize, sink);
+    std::vector<CurlTransfer> transfers(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        transfers[i].easy = curl_easy_init();
+        configureRangeHandle(transfers[i], url, chunks[i], nullptr);
+        configureHttpVersion(transfers[i].easy, options.httpVersion);
+        eventLoop.attach(transfers[i].easy);
+        curl_multi_add_handle(multiHandle, transfers[i].easy);
+    }
+
+    eventLoop.onActivity([&]() {
+        int queued = 0;
+        while (CURLMsg* message = curl_multi_info_read(multiHandle, &queued))
+        {
+            if (message->msg != CURLMSG_DONE)
+                continue;
+
+            CURL* easy = message->easy_handle;
+            CurlTransfer* transfer = nullptr;
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, &transfer);
+            run.ok = run.ok && transferSucceeded(message->data.result, *transfer->chunk);
+
+            long connects = 0;
+            curl_off_t startTransfer = 0;
+            curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+            curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &startTransfer);
+            curl_easy_getinfo(easy, CURLINFO_HTTP_VERSION, &run.negotiated);
+            run.handshakes += connects;
+            run.ttfbMs.push_back(startTransfer / 1000.0);
+            curl_multi_remove_handle(multiHandle, easy);
+        }
+    });
+
+    const auto started = std::chrono::steady_clock::now();
+    ioContext.run();
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    for (auto& transfer : transfers)
+        curl_easy_cleanup(transfer.easy);
+    run.ok = run.ok && finishFile(sink, fileSize);
+    return run;
+}
+
+const char* httpVersionName(long version)
+{
+    switch (version)
+    {
+    case CURL_HTTP_VERSION_1_0:
+        return "1.0";
+    case CURL_HTTP_VERSION_1_1:
+        return "1.1";
+    case CURL_HTTP_VERSION_2_0:
+        return "2";
+    case CURL_HTTP_VERSION_3:
+        return "3";
+    default:
+        return "?";
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <url> [parallel=16] [repeat=3] [output]" << std::endl;
+        return 1;
+    }
+
+    const std::string url = argv[1];
+    const int parallelTasks = argc > 2 ? std::stoi(argv[2]) : 16;
+    const int repeat = argc > 3 ? std::stoi(argv[3]) : 3;
+    const std::string outputFile = argc > 4 ? argv[4] : "bench_multiplex.bin";
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    const auto fileSize = probeFileByCurl(url).size;
+    if (fileSize == 0)
+    {
+        std::cerr << "Could not determine file size of " << url << std::endl;
+        return 1;
+    }
+
+    // Multiplexing is only negotiated over TLS
+    std::vector<std::pair<std::string, HttpVersion>> protocols = {{"http1.1", HttpVersion::Http1}};
+    const auto features = curl_version_info(CURLVERSION_NOW)->features;
+    if (url.rfind("https://", 0) != 0)
+        std::cerr << "Not an https:// URL, only HTTP/1.1 is measured" << std::endl;
+    else if (features & CURL_VERSION_HTTP2)
+        protocols.emplace_back("http2", HttpVersion::Http2);
+    if (url.rfind("https://", 0) == 0 && (features & CURL_VERSION_HTTP3))
+        protocols.emplace_back("http3", HttpVersion::Http3);
+
+    std::cout << "protocol,negotiated,handshakes,ttfb_p50_ms,ttfb_max_ms,best_seconds,best_mib_per_s" << std::endl;
+    for (const auto& [name, version] : protocols)
+    {
+        DownloadOptions options;
+        options.httpVersion = version;
+
+        RunResult best;
+        for (int i = 0; i < repeat; ++i)
+        {
+            // Chunk messages would drown the table
+            auto* cerrBuffer = std::cerr.rdbuf(nullptr);
+            RunResult run = runOnce(url, outputFile, fileSize, parallelTasks, options);
+            std::cerr.rdbuf(cerrBuffer);
+            std::cerr.clear();
+
+            if (!run.ok)
+            {
+                std::cerr << "Download failed over " << name << std::endl;
+                return 1;
+            }
+            if (i == 0 || run.seconds < best.seconds)
+                best = std::move(run);
+        }
+
+        std::sort(best.ttfbMs.begin(), best.ttfbMs.end());
+        std::cout << name << "," << httpVersionName(best.negotiated) << "," << best.handshakes << ","
+                  << best.ttfbMs[best.ttfbMs.size() / 2] << "," << best.ttfbMs.back() << "," << best.seconds << ","
+                  << fileSize / 1024.0 / 1024.0 / best.seconds << std::endl;
+    }
+
+    std::remove(outputFile.c_str());
+    curl_global_cleanup();
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Throughput of the Boost engine versus the number of io_context threads.
+//
+// Usage: thread_scaling_benchmark <url> [parallel=16] [maxThreads=hardware] [repeat=3] [output=bench_download.bin]
+// Prints one CSV row per thread count: threads,best_seconds,mean_seconds,best_mib_per_s
+
+#include <include/BoostUtils.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <url> [parallel=16] [maxThreads] [repeat=3] [output]" << std::endl;
+        return 1;
+    }
+
+    const std::string url = argv[1];
+    const int parallelTasks = argc > 2 ? std::stoi(argv[2]) : 16;
+    const int maxThreads = argc > 3 ? std::stoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+    const int repeat = argc > 4 ? std::stoi(argv[4]) : 3;
+    const std::string outputFile = argc > 5 ? argv[5] : "bench_download.bin";
+
+    BoostDownloader probe(url);
+    const auto fileSize = probe.getFileSize();
+    if (fileSize == 0)
+    {
+        std::cerr << "Could not determine file size of " << url << std::endl;
+        return 1;
+    }
+
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2)
+        threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+
+    std::cout << "threads,best_seconds,mean_seconds,best_mib_per_s" << std::endl;
+    for (int threads : threadCounts)
+    {
+        std::vector<double> seconds;
+        for (int run = 0; run < repeat; ++run)
+        {
+            // Engine progress messages would drown the table
+            auto* cerrBuffer = std::cerr.rdbuf(nullptr);
+
+            BoostDownloader downloader(url);
+            DownloadOptions options;
+            options.threads = threads;
+            downloader.setOptions(options);
+
+            const auto started = std::chrono::steady_clock::now();
+            const bool ok = downloader.downloadFile(outputFile, parallelTasks, fileSize);
+            const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+            std::cerr.rdbuf(cerrBuffer);
+            std::cerr.clear();
+            if (!ok)
+            {
+                std::cerr << "Download failed with " << threads << " thread(s)" << std::endl;
+                return 1;
+            }
+            seconds.push_back(elapsed);
+        }
+
+        const double best = *std::min_element(seconds.begin(), seconds.end());
+        double mean = 0.0;
+        for (double value : seconds)
+            mean += value / seconds.size();
+
+        std::cout << threads << "," << best << "," << mean << "," << fileSize / 1024.0 / 1024.0 / best << std::endl;
+    }
+
+    std::remove(outputFile.c_str());
+    return 0;
+}
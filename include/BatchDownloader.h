@@ -0,0 +1,73 @@
+#pragma once
+
+#include <include/CurlEventLoop.h>
+#include <include/Downloader.h>
+
+#include <curl/curl.h>
+
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct BatchEntry
+{
+    std::string url;
+    std::string outputFile;
+};
+
+// One "<url> <output path>" pair per line; blank lines and lines starting with '#' are skipped
+std::vector<BatchEntry> readManifest(std::istream& in);
+
+struct BatchOptions
+{
+    int maxConnections = 16;
+    int maxConnectionsPerHost = 6;
+    // Files up to this size are fetched over a single connection, larger ones are split into ranges
+    uint64_t splitThreshold = 8 * 1024 * 1024;
+    DownloadOptions download;
+};
+
+// Downloads a whole manifest in one process over a single curl multi handle, so DNS results and
+// connections are shared between files. Connection slots are refilled as soon as they free up,
+// from the earliest file that still has work, within the global and per-host caps.
+class BatchDownloader
+{
+  public:
+    BatchDownloader(std::vector<BatchEntry> entries, BatchOptions options);
+    ~BatchDownloader();
+
+    // Returns the number of files that could not be downloaded
+    size_t run();
+
+  private:
+    struct FileJob;
+    struct Slot;
+
+    bool dispatch(Slot& slot);
+    bool startProbe(Slot& slot);
+    bool startRange(Slot& slot, FileJob& job, bool allowSteal);
+    bool activate(FileJob& job);
+    void onProbeDone(Slot& slot, CURLcode result);
+    void onRangeDone(Slot& slot, CURLcode result);
+    void finishIfDone(FileJob& job);
+    bool hostHasCapacity(const FileJob& job) const;
+    void release(Slot& slot);
+    void collectFinished();
+
+    BatchOptions options;
+    std::vector<std::unique_ptr<FileJob>> jobs;
+    std::vector<std::unique_ptr<Slot>> slots;
+    boost::asio::io_context ioContext;
+    std::unique_ptr<CurlEventLoop> eventLoop;
+    CURLM* multiHandle = nullptr;
+    std::map<std::string, int> hostConnections;
+
+    size_t firstOpenJob = 0;
+    int activeProbes = 0;
+    size_t readyJobs = 0;
+    size_t failedFiles = 0;
+    uint64_t downloadedBytes = 0;
+};
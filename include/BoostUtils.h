@@ -1,23 +1,51 @@
 #include <include/Chunk.h>
+#include <include/ConnectionPool.h>
 #include <include/Downloader.h>
+#include <include/MirrorSet.h>
 
 #include <boost/asio/awaitable.hpp>
+#include <boost/asio/io_context.hpp>
 
+#include <memory>
 #include <string>
+#include <vector>
+
+class DownloadRuntime;
+
+// A server the Boost engine fetches the file from, in the order of the download's MirrorSet
+struct BoostSource
+{
+    std::string target;
+    // The download's own, or the one a DownloadRuntime keeps for the host
+    std::shared_ptr<ConnectionPool> pool;
+};
+
+// The first range of a fast start, whose header getFileSize() read and whose body waits for downloadFile()
+struct FirstResponse;
 
 class BoostDownloader : public Downloader
 {
   public:
-    BoostDownloader(const std::string& url);
-    ~BoostDownloader() override {}
+    // With a runtime the download runs on its io_context and connection pools, otherwise on ones of its own
+    BoostDownloader(const std::string& url, DownloadRuntime* runtime = nullptr);
+    ~BoostDownloader() override;
 
     void setUp() override {}
+    void setOptions(const DownloadOptions& value) override;
     size_t getFileSize() override;
     bool downloadFile(const std::string& outputFile, int parallelTasks, std::uint64_t fileSize) override;
 
   private:
-    void parseUrl(const std::string& url, std::string& host, std::string& target);
+    // downloadFile() once the cache is out of the picture
+    bool fetchFile(const std::string& outputFile, int parallelTasks, std::uint64_t fileSize);
+    // Parses the URL and gives it a connection pool; an invalid URL gets a source that cannot connect
+    BoostSource makeSource(const std::string& url);
 
-    std::string host;
-    std::string target;
+    std::string url;
+    DownloadRuntime* runtime;
+    boost::asio::io_context privateContext;
+    boost::asio::io_context& ioContext;
+    std::unique_ptr<MirrorSet> mirrors;
+    std::vector<BoostSource> sources;
+    std::unique_ptr<FirstResponse> firstResponse;
 };
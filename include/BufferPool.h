@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Fixed-size receive buffers shared by the connections of a download. A buffer is leased for one response and
+// comes back when the lease ends, so once every connection has had one the receive path stops allocating.
+// Safe to share between threads.
+class BufferPool
+{
+  public:
+    class Lease
+    {
+      public:
+        Lease(Lease&& other) noexcept : pool(other.pool), buffer(std::move(other.buffer)) {}
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease& operator=(Lease&&) = delete;
+        ~Lease()
+        {
+            if (buffer)
+                pool.release(std::move(buffer));
+        }
+
+        char* data() const { return buffer.get(); }
+        size_t size() const { return pool.size; }
+
+      private:
+        friend class BufferPool;
+        Lease(BufferPool& owner, std::unique_ptr<char[]> storage) : pool(owner), buffer(std::move(storage)) {}
+
+        BufferPool& pool;
+        std::unique_ptr<char[]> buffer;
+    };
+
+    explicit BufferPool(size_t bufferSize);
+
+    Lease acquire();
+
+    size_t bufferSize() const { return size; }
+    // Buffers ever allocated; stays at the peak number of concurrent leases
+    uint64_t allocations() const { return allocated.load(std::memory_order_relaxed); }
+
+  private:
+    void release(std::unique_ptr<char[]> buffer);
+
+    const size_t size;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<char[]>> free;
+    std::atomic<uint64_t> allocated = 0;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+
+// Lets another thread cancel a download. The parts of a download that wait on the network register how to interrupt
+// them while they run; cancel() runs every registered stop, and a stop registered after the cancel runs right away.
+// A stop runs under the lock, so once remove() returns it is no longer running and will not run again
+class Cancellation
+{
+  public:
+    // Stops whatever is registered for as long as it lives; a null cancellation registers nothing
+    class Scope
+    {
+      public:
+        Scope(Cancellation* cancellation, std::function<void()> stop);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+      private:
+        Cancellation* cancellation;
+        uint64_t id = 0;
+    };
+
+    void cancel();
+    bool cancelled() const { return flag.load(std::memory_order_acquire); }
+
+  private:
+    uint64_t add(std::function<void()> stop);
+    void remove(uint64_t id);
+
+    std::mutex mutex;
+    std::atomic<bool> flag = false;
+    std::map<uint64_t, std::function<void()>> stops;
+    uint64_t nextId = 1;
+};
+
+// For code that only polls: true once `cancellation` was cancelled, false without one
+inline bool isCancelled(const Cancellation* cancellation)
+{
+    return cancellation && cancellation->cancelled();
+}
@@ -1,19 +1,89 @@
 #pragma once
 
+#include <include/FileSink.h>
+#include <include/SplicePipe.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
-#include <fstream>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 
-struct Chunk
+class DownloadVerifier;
+
+// Inclusive byte range
+struct ByteRange
 {
     uint64_t start;
     uint64_t end;
-    std::vector<char> data;
 };
 
-std::vector<Chunk> createChunks(int parallelTasks, uint64_t fileSize);
+struct Chunk
+{
+    uint64_t start = 0;
+    // Inclusive; only ever lowered, under mutex, when another connection steals the tail
+    std::atomic<uint64_t> end{0};
+    // Bytes already written to the sink by the connection that owns the chunk
+    std::atomic<uint64_t> received{0};
+    FileSink* sink = nullptr;
+
+    // Bytes the owner has reserved for writing; a steal never splits below this point
+    uint64_t claimed = 0;
+    std::mutex mutex;
+    // Held for a whole write, so the two copies of a hedged chunk add their bytes in order
+    std::mutex writeMutex;
+    // How to interrupt each fetch of the chunk, so the copy that finishes a hedged chunk can stop the others.
+    // Guarded by mutex
+    std::array<std::function<void()>, 3> stoppers;
+
+    // Checksums the bytes as they are written; pieceCrc covers those since the last block boundary
+    DownloadVerifier* verifier = nullptr;
+    uint32_t pieceCrc = 0;
+
+    int attempts = 0;
+    // MirrorSet source the last failed attempt went to, so the retry goes to another one; -1 for none
+    int failedSource = -1;
+    // Guarded by the scheduler: requests fetching the chunk right now, whether it was ever hedged, and whether it
+    // counted as complete
+    int fetchers = 0;
+    bool hedged = false;
+    bool done = false;
+    uint64_t receivedAtAssign = 0;
+    std::chrono::steady_clock::time_point assignedAt;
+    // When the latest copy of the chunk started, hedged or not, and what the chunk had received by then
+    uint64_t receivedAtCopy = 0;
+    std::chrono::steady_clock::time_point copiedAt;
+
+    uint64_t size() const { return end - start + 1; }
+    uint64_t offset() const { return start + received; }
+    uint64_t remaining() const { return complete() ? 0 : size() - received; }
+    bool complete() const { return received >= size(); }
+};
+
+std::vector<Chunk> createChunks(int parallelTasks, uint64_t fileSize, FileSink& sink);
+
+// Streams received bytes to the chunk's position in the output file; anything past the end of the range is dropped
+bool appendChunkData(Chunk& chunk, const char* data, size_t size);
+// The same for a response whose bytes start at file offset `position`, which advances past them. With two copies of
+// a hedged chunk racing, only the copy ahead writes; the other one drops what is already there
+bool appendChunkData(Chunk& chunk, uint64_t& position, const char* data, size_t size);
+#ifdef __linux__
+// appendChunkData for `size` bytes waiting in a splice pipe, which end up in the file without a copy
+bool spliceChunkData(Chunk& chunk, uint64_t& position, SplicePipe& pipe, size_t size);
+#endif
+
+// Registers how to interrupt a fetch of the chunk; returns the slot for removeStopper, or -1 when none is free
+int addStopper(Chunk& chunk, std::function<void()> stop);
+void removeStopper(Chunk& chunk, int slot);
+// Interrupts every fetch still registered, e.g. the slower copy of a hedged chunk once the other one completed it
+void stopFetches(Chunk& chunk);
+
+// Moves the upper half of the chunk's unclaimed bytes into `tail`; false if less than 2 * minSize is left
+bool splitChunk(Chunk& chunk, Chunk& tail, uint64_t minSize);
 
-bool writeFile(const std::string& outputFile, const std::vector<Chunk>& chunks, uint64_t expectedFileSize);
+bool finishFile(FileSink& sink, uint64_t expectedFileSize);
 
 bool checkDownloadedFileSize(const std::string& filePath, uint64_t expectedFileSize);
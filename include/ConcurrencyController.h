@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Picks how many connections a download keeps busy, from the goodput and failures it sees.
+// Starts with two connections and doubles while every step pays off, then settles on the best level and
+// probes one connection above it every few seconds. A failed range (a 503, a dropped connection) stops the growth;
+// when failures make up a real share of the ranges, the limit is halved.
+// Without adaptive mode the limit stays at the maximum.
+class ConcurrencyController
+{
+  public:
+    static constexpr std::chrono::milliseconds SAMPLE_INTERVAL{500};
+
+    ConcurrencyController(int maxConnections, bool adaptive);
+
+    // Safe to read from any thread
+    int limit() const { return current.load(std::memory_order_relaxed); }
+    int maximum() const { return maxLimit; }
+    bool adaptive() const { return isAdaptive; }
+
+    // Called every SAMPLE_INTERVAL with the download's running totals of bytes, completed ranges and failed ones;
+    // returns true when the limit changed
+    bool update(uint64_t bytes, uint64_t ranges, uint64_t failures);
+
+  private:
+    enum class Phase
+    {
+        SlowStart,
+        Probing,
+        Holding
+    };
+
+    const int maxLimit;
+    const bool isAdaptive;
+    std::atomic<int> current;
+
+    Phase phase = Phase::SlowStart;
+    // Limit and goodput of the last level that was worth keeping
+    int baselineLimit = 0;
+    double baselineRate = 0.0;
+    // Samples to skip after a change while new connections ramp up, or to wait before the next probe
+    int settling = 0;
+    int holding = 0;
+
+    uint64_t lastBytes = 0;
+    uint64_t lastRanges = 0;
+    uint64_t lastFailures = 0;
+    std::chrono::steady_clock::time_point lastSample;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <include/SplicePipe.h>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/ssl/ssl_stream.hpp>
+
+#include <openssl/ssl.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+using TlsStream = boost::beast::ssl_stream<boost::beast::tcp_stream>;
+
+// Persistent HTTP/1.1 connection, plain or TLS. The read buffer lives with the socket because
+// bytes of the next response may already sit in it when a keep-alive exchange ends.
+struct Connection
+{
+    explicit Connection(boost::asio::io_context& ioContext)
+        : stream(std::in_place_type<boost::beast::tcp_stream>, ioContext)
+    {
+    }
+    Connection(boost::asio::io_context& ioContext, boost::asio::ssl::context& tlsContext)
+        : stream(std::in_place_type<TlsStream>, ioContext, tlsContext)
+    {
+    }
+
+    boost::beast::tcp_stream& tcp();
+    bool isOpen();
+
+    // Beast's algorithms are templates on the stream, so callers std::visit this
+    std::variant<boost::beast::tcp_stream, TlsStream> stream;
+    boost::beast::flat_buffer buffer;
+    // Backs the header fields of one exchange at a time, so sending a request and parsing its response allocate
+    // nothing unless the headers outgrow it
+    std::array<std::byte, 8 * 1024> headerArena;
+    // Opened by the first plain-HTTP response body that is spliced into the file
+    SplicePipe splicePipe;
+    bool reused = false;
+    // What opening the connection cost, for telemetry
+    std::chrono::microseconds connectTime{0};
+    std::chrono::microseconds tlsTime{0};
+};
+
+// Keep-alive pool for one host. The host is resolved once and the endpoints are cached,
+// so only the first request on each connection pays for DNS and the TCP handshake.
+// For https the pool also keeps the newest TLS session the server handed out and offers it on
+// every new connection, so after the first full handshake the others are abbreviated ones.
+// Safe to share between coroutines running on different io_context threads.
+class ConnectionPool
+{
+  public:
+    // `caFile` replaces the bundled CA certificates when it is not empty
+    ConnectionPool(boost::asio::io_context& ioContext, std::string host, std::string port, bool secure = false,
+                   const std::string& caFile = {}, size_t maxIdle = 64);
+    ~ConnectionPool();
+
+    // Blocking resolve used before the event loop runs; a no-op once endpoints are cached
+    void resolve();
+
+    boost::asio::awaitable<std::unique_ptr<Connection>> acquire();
+    // The idle half of acquire(), without suspending: null when no idle connection is left
+    std::unique_ptr<Connection> takeIdle();
+    // Always a new connection, for a request that should not share a path with the others, like a hedged one
+    boost::asio::awaitable<std::unique_ptr<Connection>> connect();
+
+    // Only hand back connections whose last response was fully read and allowed keep-alive
+    void release(std::unique_ptr<Connection> connection);
+
+    const std::string& host() const { return hostName; }
+    const std::string& port() const { return portName; }
+    // Value of the Host header: the port is only spelled out when it is not the scheme's default
+    const std::string& authority() const { return hostHeader; }
+    bool secure() const { return tlsContext != nullptr; }
+
+    uint64_t connectionsOpened() const { return opened; }
+    uint64_t connectionsReused() const { return reused; }
+    double reuseRatio() const;
+
+    // How long resolving the host took; zero until it was resolved
+    std::chrono::microseconds resolveTime() const { return resolveDuration; }
+
+    uint64_t fullHandshakes() const { return fullTls; }
+    uint64_t resumedHandshakes() const { return resumedTls; }
+
+  private:
+    boost::asio::awaitable<boost::asio::ip::tcp::resolver::results_type> resolveAsync();
+    boost::asio::awaitable<void> handshake(TlsStream& stream);
+
+    // OpenSSL hands every new session or TLS 1.3 ticket to this callback
+    static int onNewSession(SSL* ssl, SSL_SESSION* session);
+
+    boost::asio::io_context& ioContext;
+    std::string hostName;
+    std::string portName;
+    std::string hostHeader;
+    size_t maxIdle;
+    std::unique_ptr<boost::asio::ssl::context> tlsContext;
+
+    std::mutex mutex;
+    std::optional<boost::asio::ip::tcp::resolver::results_type> endpoints;
+    std::vector<std::unique_ptr<Connection>> idle;
+    SSL_SESSION* tlsSession = nullptr;
+    std::chrono::microseconds resolveDuration{0};
+
+    std::atomic<uint64_t> opened = 0;
+    std::atomic<uint64_t> reused = 0;
+    std::atomic<uint64_t> fullTls = 0;
+    std::atomic<uint64_t> resumedTls = 0;
+};
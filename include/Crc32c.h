@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli), as used by iSCSI, ext4 and many object stores. Chains like zlib's crc32():
+// crc32c(b, crc32c(a)) is the CRC of a followed by b. Uses the CPU's CRC32 instruction when it has one.
+uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+// CRC of a followed by b, given the CRCs of both and the length of b, without touching the data
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lengthB);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <curl/curl.h>
+
+#include <boost/asio.hpp>
+
+#include <functional>
+#include <map>
+#include <memory>
+
+// Drives a curl multi handle from an asio io_context with curl_multi_socket_action. curl names the sockets and
+// the timeout it is waiting for and asio watches exactly those, so a wakeup costs O(ready sockets) instead of a
+// curl_multi_perform walk over every transfer. The sockets themselves are asio sockets opened on curl's behalf,
+// which lets the transfers share the io_context with anything else in the process. All curl calls run on one
+// strand, so the io_context may be run by several threads.
+class CurlEventLoop
+{
+  public:
+    using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+    explicit CurlEventLoop(boost::asio::io_context& ioContext);
+    // Remove the easy handles first; cleaning up the multi handle closes the cached connections through the loop
+    ~CurlEventLoop();
+
+    CURLM* multi() const { return multiHandle; }
+    Strand& strand() { return executor; }
+
+    // Opens and closes the handle's sockets through the loop; needed before the handle is added, and again after
+    // a curl_easy_reset
+    void attach(CURL* easy);
+    // Called on the strand after every curl_multi_socket_action, to collect finished transfers
+    void onActivity(std::function<void()> handler) { activityHandler = std::move(handler); }
+    // Transfers still running after the last socket action
+    int running() const { return stillRunning; }
+
+  private:
+    struct Socket;
+
+    static curl_socket_t openSocket(void* clientp, curlsocktype purpose, curl_sockaddr* address);
+    static int closeSocket(void* clientp, curl_socket_t fd);
+    static int socketCallback(CURL* easy, curl_socket_t fd, int what, void* userp, void* socketp);
+    static int timerCallback(CURLM* multi, long timeoutMs, void* userp);
+
+    void watch(const std::shared_ptr<Socket>& socket);
+    void onReady(const std::shared_ptr<Socket>& socket, bool inbound, const boost::system::error_code& error);
+    void socketAction(curl_socket_t fd, int eventMask);
+
+    boost::asio::io_context& ioContext;
+    Strand executor;
+    boost::asio::steady_timer timer;
+    CURLM* multiHandle = nullptr;
+    std::map<curl_socket_t, std::shared_ptr<Socket>> sockets;
+    std::function<void()> activityHandler;
+    int stillRunning = 0;
+};
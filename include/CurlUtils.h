@@ -1,5 +1,7 @@
 #include <curl/curl.h>
 
+#include <boost/asio/io_context.hpp>
+
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -8,16 +10,93 @@
 
 #include <include/Chunk.h>
 #include <include/Downloader.h>
+#include <include/MirrorSet.h>
+#include <include/Telemetry.h>
+
+// One easy handle of the curl engines; the multi engine re-arms it with the next chunk after each range
+struct CurlTransfer
+{
+    CURL* easy = nullptr;
+    Chunk* chunk = nullptr;
+    // Index of the MirrorSet source the handle points at
+    size_t source = 0;
+    // If-Range was sent, so a 200 answer means the remote file changed
+    bool conditional = false;
+    bool remoteChanged = false;
+    // Clocks the current range; unattached handles skip the bookkeeping
+    RangeProbe probe;
+};
+
+// The first range of a fast start, sent in place of the size probe
+struct FirstRange
+{
+    // Bytes asked for
+    uint64_t limit = 0;
+    // Head of the file received; empty when the server ignored the Range and the file did not fit
+    std::string bytes;
+    // The server ignored the Range and answered with the whole file
+    bool wholeFile = false;
+};
+
+// With `cached`, the probe is conditional and a 304 returns the cached info marked notModified
+RemoteFileInfo probeFileByCurl(const std::string& url, const std::string& caFile = {},
+                               const RemoteFileInfo* cached = nullptr, CURLSH* share = nullptr);
+// Takes the size from the Content-Range of the first range, or from the Content-Length of a 200 answer; a zero
+// size when neither worked out
+RemoteFileInfo fetchFirstRange(const std::string& url, const std::string& caFile, FirstRange& first,
+                               CURLSH* share = nullptr);
+
+// Building blocks for engines that drive their own multi handle
+void configureProbeHandle(CURL* curl, const std::string& url);
+RemoteFileInfo probeResult(CURL* curl);
+void configureRangeHandle(CurlTransfer& transfer, const std::string& url, Chunk& chunk, curl_slist* headers);
+void setChunkRange(CurlTransfer& transfer, Chunk& chunk);
+// Verifies servers against `caFile` instead of the bundled cacert.pem; a no-op when it is empty
+void configureCaFile(CURL* easy, const std::string& caFile);
+// Takes DNS results and TLS sessions from the share handle of a DownloadRuntime; a no-op without one
+void configureShare(CURL* easy, CURLSH* share);
+// Aborts the transfer with CURLE_ABORTED_BY_CALLBACK once the download is cancelled, within a second even while no
+// data arrives; a no-op without a cancellation
+void configureCancellation(CURL* easy, const Cancellation* cancellation);
+bool transferSucceeded(CURLcode result, const Chunk& chunk);
+// Posts the finished range to the transfer's telemetry, with the timings curl measured for it
+void recordTransfer(CurlTransfer& transfer, bool completed);
+
+// The requested protocol, or the next older one the linked libcurl can speak
+HttpVersion supportedHttpVersion(HttpVersion requested);
+// Pins the protocol of a handle; multiplexed protocols wait for a connection they can share instead of opening one
+void configureHttpVersion(CURL* easy, HttpVersion version);
+// Caps the connections per host so that `streams` transfers become multiplexed streams over them
+void configureMultiplexing(CURLM* multi, const DownloadOptions& options, int streams);
 
 class CurlDownloader : public Downloader
 {
   public:
-    CurlDownloader(const std::string& url) : url(url) {}
+    // `threadPerChunk` selects the blocking engine with one thread per chunk instead of the multi handle. Every
+    // handle of the download uses `share`, e.g. the one of a DownloadRuntime, if given
+    CurlDownloader(const std::string& url, bool threadPerChunk = false, CURLSH* share = nullptr)
+        : url(url), threadPerChunk(threadPerChunk), share(share),
+          mirrors(std::make_unique<MirrorSet>(std::vector{url}))
+    {
+    }
     ~CurlDownloader() override;
 
     void setUp() override;
+    void setOptions(const DownloadOptions& value) override;
     size_t getFileSize() override;
     bool downloadFile(const std::string& outputFile, int parallelTasks, std::uint64_t fileSize) override;
 
+    // downloadFile() once the cache is out of the picture
+    bool fetchFile(const std::string& outputFile, int parallelTasks, std::uint64_t fileSize);
+
     std::string url;
+    bool threadPerChunk;
+    CURLSH* share;
+    bool globalInit = false;
+    // The URL and its mirrors
+    std::unique_ptr<MirrorSet> mirrors;
+    // Runs the multi handle's sockets and timer
+    boost::asio::io_context ioContext;
+    // What a fast start in getFileSize() received, for downloadFile()
+    FirstRange firstRange;
 };
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <include/Chunk.h>
+#include <include/Downloader.h>
+#include <include/FileSink.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+class RangeJournal;
+
+// Block checksums of a published file, to download it as a delta against a local seed such as its previous
+// version, the way zsync does. Every block has a weak checksum that rolls over the seed one byte at a time and a
+// strong one that confirms a weak hit; blocks found anywhere in the seed are copied locally and only the rest is
+// fetched.
+//
+// Format: a "file_downloader-delta 1" line, "size <bytes>" and "block-size <bytes>" lines, then one line per block:
+// its rolling checksum as 8 hex digits and the first 16 bytes of its SHA-256 in hex.
+class DeltaManifest
+{
+  public:
+    static constexpr uint64_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+    static constexpr size_t STRONG_SIZE = 16;
+    using Strong = std::array<unsigned char, STRONG_SIZE>;
+
+    static std::optional<DeltaManifest> load(const std::string& path);
+    // Manifest of a local file, to publish next to it
+    static std::optional<DeltaManifest> generate(const std::string& file, uint64_t blockSize = DEFAULT_BLOCK_SIZE);
+    bool save(const std::string& path) const;
+
+    // Scans the seed for the blocks that lie wholly in `missing`, writes those it finds to their place in the sink
+    // and returns them. The last block, when shorter than the others, is always fetched
+    std::vector<ByteRange> copyFromSeed(const std::string& seedPath, FileSink& sink,
+                                        const std::vector<ByteRange>& missing) const;
+
+    uint64_t fileSize() const { return size; }
+    uint64_t blockSize() const { return block; }
+
+  private:
+    uint64_t size = 0;
+    uint64_t block = 0;
+    std::vector<uint32_t> weak;
+    std::vector<Strong> strong;
+};
+
+// rsync's checksum of a block: a sum of its bytes and a sum weighted by position, 16 bits each. Both roll forward
+// by a byte in constant time
+uint32_t rollingChecksum(const char* data, size_t size);
+
+// Fills what it can of `missing` from options.seedFile with the blocks options.deltaManifest lists, takes them off
+// the list and counts them as done in the journal. False if the manifest cannot be used for this file
+bool seedDownload(const DownloadOptions& options, uint64_t fileSize, FileSink& sink, RangeJournal& journal,
+                  std::vector<ByteRange>& missing);
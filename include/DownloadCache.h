@@ -0,0 +1,54 @@
+#pragma once
+
+#include <include/OrderedOutput.h>
+#include <include/RemoteFileInfo.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// Directory of finished downloads shared by every run on the host. Each URL has one entry: the file, and a record of
+// the validators it was served with, so a later run can ask the server whether it changed (If-None-Match,
+// If-Modified-Since) and place the cached copy on a 304. An entry verified against a SHA-256 is also found by that
+// digest, under any URL and without asking a server. Beyond the size limit the least recently used entries go.
+//
+// Several processes may share the directory: entries are read under a shared lock of its lock file and changed
+// under an exclusive one, and land by rename, so no process sees half an entry.
+class DownloadCache
+{
+  public:
+    struct Entry
+    {
+        std::string url;
+        // Size and validators the file was served with
+        RemoteFileInfo remote;
+        // Digest the download was verified against, in lower-case hex; empty without one
+        std::string sha256;
+        std::string dataPath;
+    };
+
+    DownloadCache(std::string directory, uint64_t maxBytes);
+
+    // The entry of the URL or, given a digest, any entry verified against it; nullopt when there is none
+    std::optional<Entry> find(const std::string& url, const std::string& sha256 = {}) const;
+    // Puts the cached file at outputFile: a reflink where the file system shares blocks, else a copy; into a pipe or
+    // the consumer it is written. Fails if the entry changed since find(). Counts as a use of the entry for the LRU
+    // order
+    bool place(const Entry& entry, const std::string& outputFile, const OrderedOutput::Consumer& consumer = {}) const;
+    // Takes a finished download of the URL in place of its previous entry, then evicts the least recently used
+    // entries until the cache fits its limit again
+    bool store(const std::string& url, const RemoteFileInfo& remote, const std::string& sha256,
+               const std::string& file);
+    // Drops the entry, e.g. because its file failed a check
+    void remove(const Entry& entry);
+
+    const std::string& path() const { return directory; }
+
+  private:
+    std::string entryPath(const std::string& url) const;
+    std::optional<Entry> load(const std::string& path) const;
+    void evict() const;
+
+    std::string directory;
+    uint64_t maxBytes;
+};
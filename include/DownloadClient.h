@@ -0,0 +1,125 @@
+#pragma once
+
+#include <include/DownloadRuntime.h>
+#include <include/Downloader.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct DownloadProgress
+{
+    // Bytes received over the network so far, retried and hedged ones included
+    uint64_t receivedBytes = 0;
+    // Size of the file; 0 until it is known, and for a stream that never tells
+    uint64_t totalBytes = 0;
+    // Connections the download keeps busy
+    int connections = 0;
+    // Telemetry::statusLine() since the previous report; only in progress callbacks
+    std::string status;
+};
+
+struct DownloadResult
+{
+    bool success = false;
+    bool cancelled = false;
+    // What the probe found; empty if the download never started
+    RemoteFileInfo remote;
+    // The download's telemetry as Telemetry::writeJson() writes it; empty if the download never started
+    std::string telemetry;
+};
+
+struct DownloadRequest
+{
+    std::string url;
+    // A file, "-" for stdout or a named pipe; the library's own messages all go to stderr. With options.outputConsumer
+    // the file goes to the consumer and this only names the download
+    std::string outputFile;
+    int parallelTasks = 4;
+    // Replaced when the download needs another one, see engineFor()
+    Engine engine = Engine::Boost;
+    // options.cancellation is the one of the download's handle
+    DownloadOptions options;
+    // Called on the client's progress thread every progressInterval while the download runs
+    std::function<void(const DownloadProgress&)> onProgress;
+    std::chrono::milliseconds progressInterval{1000};
+    // Called on the thread that ran the download once it is over, before its future becomes ready
+    std::function<void(const DownloadResult&)> onComplete;
+};
+
+// The state of a submitted download, shared by its handles and the client
+struct DownloadJob;
+
+// A submitted download. Copies refer to the same download, which runs whether or not a handle is kept
+class DownloadHandle
+{
+  public:
+    DownloadHandle() = default;
+
+    std::shared_future<DownloadResult> result() const;
+    // Stops the download, or drops it if it has not started; its result is marked cancelled. A range download into a
+    // file keeps its journal, so submitting it again resumes it
+    void cancel();
+    DownloadProgress progress() const;
+
+    bool valid() const { return job != nullptr; }
+
+  private:
+    friend class DownloadClient;
+    explicit DownloadHandle(std::shared_ptr<DownloadJob> job) : job(std::move(job)) {}
+
+    std::shared_ptr<DownloadJob> job;
+};
+
+struct ClientOptions
+{
+    // Downloads that run at once, each on a thread of the client; the others wait in the order they came
+    int maxConcurrentDownloads = 4;
+    // Threads running the shared event loop of the Boost engine; 0 uses every hardware thread. Downloads in order, to
+    // stdout, a pipe or a consumer, wait on their reader and run on options.threads of their own instead
+    int ioThreads = 1;
+};
+
+// The downloader as a library for long-lived processes. Requests carry their own engine and options and run
+// concurrently on a pool of threads, all on one DownloadRuntime, so connections, TLS sessions and DNS results carry
+// over from one download to the next instead of being set up for every file.
+class DownloadClient
+{
+  public:
+    explicit DownloadClient(ClientOptions options = {});
+    // Cancels the downloads still waiting or running and waits for them to end
+    ~DownloadClient();
+
+    DownloadClient(const DownloadClient&) = delete;
+    DownloadClient& operator=(const DownloadClient&) = delete;
+
+    DownloadHandle submit(DownloadRequest request);
+    // submit() and wait for the result
+    DownloadResult download(DownloadRequest request);
+
+  private:
+    void workLoop();
+    void progressLoop();
+    DownloadResult run(DownloadJob& job);
+
+    ClientOptions options;
+    DownloadRuntime runtime;
+
+    std::mutex mutex;
+    std::condition_variable wakeWorker;
+    std::condition_variable wakeReporter;
+    std::deque<std::shared_ptr<DownloadJob>> queue;
+    std::vector<std::shared_ptr<DownloadJob>> running;
+    bool stopping = false;
+
+    std::vector<std::thread> workers;
+    std::thread reporter;
+};
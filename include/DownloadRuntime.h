@@ -0,0 +1,54 @@
+#pragma once
+
+#include <include/ConnectionPool.h>
+
+#include <curl/curl.h>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// What the downloads of a long-lived process share. The Boost engine runs on one io_context that threads of the
+// runtime keep running, and takes its connections from one pool per host, so a download reuses the keep-alive
+// connections, cached endpoints and TLS sessions earlier ones left behind. The curl engines share DNS results and TLS
+// sessions through a share handle; curl's connection cache cannot be shared between threads safely, so their
+// connections stay with each download.
+class DownloadRuntime
+{
+  public:
+    // `ioThreads` run the io_context; 0 uses every hardware thread
+    explicit DownloadRuntime(int ioThreads = 1);
+    // Every download on the runtime must have finished
+    ~DownloadRuntime();
+
+    DownloadRuntime(const DownloadRuntime&) = delete;
+    DownloadRuntime& operator=(const DownloadRuntime&) = delete;
+
+    boost::asio::io_context& context() { return ioContext; }
+    // The pool of the host, created on first use
+    std::shared_ptr<ConnectionPool> pool(const std::string& host, const std::string& port, bool secure,
+                                         const std::string& caFile);
+    CURLSH* curlShare() const { return share; }
+
+  private:
+    static void lockShare(CURL* easy, curl_lock_data data, curl_lock_access access, void* userData);
+    static void unlockShare(CURL* easy, curl_lock_data data, void* userData);
+
+    boost::asio::io_context ioContext;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+    std::vector<std::thread> threads;
+
+    std::mutex poolsMutex;
+    // By scheme, host, port and CA file
+    std::map<std::string, std::shared_ptr<ConnectionPool>> pools;
+
+    CURLSH* share = nullptr;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> shareLocks;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <include/Chunk.h>
+#include <include/Downloader.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+class OrderedOutput;
+class RangeScheduler;
+struct evp_md_ctx_st;
+
+// Checks a download while it runs, so no second pass over the file is needed at the end.
+// The file is cut into fixed blocks. Connections feed every byte they write into a CRC32C of the block it
+// belongs to; pieces of a block written by different connections are combined once the block is covered.
+// With a block manifest, a block whose CRC does not match goes back to the scheduler on its own.
+// For SHA-256, a background thread follows the prefix of the file whose blocks are complete, so the
+// digest is ready moments after the last byte lands.
+// A pipe cannot be read back: there the digest is taken from the bytes as they are emitted, and with a manifest the
+// emission waits for each block to pass its check, so a corrupt block is fetched again before it goes out.
+//
+// Manifest format: a "block-size <bytes>" line, then the CRC32C of every block as 8 hex digits, one per line.
+class DownloadVerifier
+{
+  public:
+    static constexpr uint64_t DEFAULT_BLOCK_SIZE = 1024 * 1024;
+
+    DownloadVerifier(const DownloadOptions& options, uint64_t fileSize);
+    ~DownloadVerifier();
+
+    DownloadVerifier(const DownloadVerifier&) = delete;
+    DownloadVerifier& operator=(const DownloadVerifier&) = delete;
+
+    // Nothing was requested; the engines then skip the verifier entirely
+    bool enabled() const { return active; }
+
+    // Loads the manifest and starts hashing. The bytes outside `missing`, left on disk by an earlier run, are read
+    // back once; blocks among them that fail their check are handed to the scheduler. Without a scheduler, e.g.
+    // after an engine that cannot re-fetch, failing blocks only fail the download.
+    bool start(const std::string& path, RangeScheduler* scheduler, const std::vector<ByteRange>& missing);
+    // Checks the download as it goes out through the output instead of reading the file back; call before start()
+    void attach(OrderedOutput& output);
+
+    // Called by the chunk's owner with bytes just written at chunk.offset()
+    void append(Chunk& chunk, const char* data, size_t size);
+
+    // Waits for the digest and compares everything that was asked for; a failed download only stops the hashing
+    bool finish(bool downloaded);
+
+  private:
+    struct Piece
+    {
+        uint64_t start;
+        uint64_t length;
+        uint32_t crc;
+    };
+
+    struct Block
+    {
+        std::vector<Piece> pieces;
+        uint64_t covered = 0;
+        uint32_t crc = 0;
+        bool done = false;
+        int refetches = 0;
+    };
+
+    bool loadManifest(const std::string& path);
+    bool seedFromDisk(const std::vector<ByteRange>& missing);
+    void addPiece(uint64_t start, uint64_t length, uint32_t crc);
+    uint64_t blockLength(size_t block) const;
+    void hashLoop();
+    void hashEmitted(const char* data, size_t size);
+
+    bool active = false;
+    uint64_t fileSize;
+    uint64_t blockSize = DEFAULT_BLOCK_SIZE;
+    std::string expectedSha256;
+    std::optional<uint32_t> expectedCrc;
+    std::string manifestPath;
+    std::vector<uint32_t> expectedBlocks;
+    // Why the expected checksums cannot be used; start() fails with it
+    std::string invalidOptions;
+
+    std::string filePath;
+    RangeScheduler* scheduler = nullptr;
+    OrderedOutput* output = nullptr;
+    // SHA-256 of the bytes emitted so far, for an ordered output
+    evp_md_ctx_st* emittedContext = nullptr;
+    uint64_t emittedBytes = 0;
+
+    std::mutex mutex;
+    std::condition_variable progress;
+    std::vector<Block> blocks;
+    // Bytes from the start of the file whose blocks are complete and passed their check
+    uint64_t verifiedPrefix = 0;
+    size_t corruptBlocks = 0;
+    bool failed = false;
+    bool stopping = false;
+
+    std::thread hasher;
+    std::string sha256;
+};
+
+// Lowercase hex of a binary digest
+std::string toHex(const unsigned char* data, size_t size);
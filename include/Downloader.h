@@ -1,6 +1,87 @@
 #pragma once
 
+#include <include/Cancellation.h>
 #include <include/Chunk.h>
+#include <include/DownloadCache.h>
+#include <include/RemoteFileInfo.h>
+#include <include/Telemetry.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+class DownloadRuntime;
+
+enum class HttpVersion
+{
+    Http1,
+    Http2,
+    // Experimental: QUIC, needs a curl built with HTTP/3 support
+    Http3
+};
+
+struct DownloadOptions
+{
+    // Preferred size of the work units the file is split into
+    uint64_t chunkSize = 4 * 1024 * 1024;
+    // Threads running the Boost engine's io_context; 0 uses every hardware thread
+    int threads = 1;
+    // Continue from the range journal of an interrupted download of the same file
+    bool resume = true;
+    // Protocol of the curl engines; HTTP/2 and HTTP/3 run the ranges as streams multiplexed over a few connections
+    HttpVersion httpVersion = HttpVersion::Http1;
+    // Connections per host the multiplexed streams are spread over
+    int multiplexConnections = 1;
+    // PEM bundle to verify servers against instead of the bundled cacert.pem
+    std::string caFile;
+    // Expected digests of the whole file, in hex; empty skips the check
+    std::string sha256;
+    std::string crc32c;
+    // Tune the number of connections at runtime, up to the requested parallelism, instead of using all of them
+    bool adaptive = false;
+    // Linux, Boost engine, plain HTTP: splice range bodies from the socket into the file instead of copying them
+    // through a buffer. Ranges checksummed in flight still take the buffered path, the checksums need the bytes
+    bool zeroCopy = true;
+    // Boost engine: share of the bytes that hedged requests may fetch twice. A range that has fallen far behind gets a
+    // second copy, from an idle connection or, while every connection is busy, an extra one, and the first copy to
+    // finish wins. 0 turns it off
+    double hedgeBudget = 0.1;
+    // Manifest with the CRC32C of every block, so a corrupt block is fetched again on its own
+    std::string blockChecksums;
+    // Other URLs of the same file. Ranges are spread over all of them by measured speed; mirrors whose size or ETag
+    // disagree with the first URL that answers are left out
+    std::vector<std::string> mirrors;
+    // getFileSize() sends the first range right away instead of a size probe and takes the size from its
+    // Content-Range; downloadFile() then carries on with that response. A server that ignores the Range gets the
+    // whole file over that one connection. Only without mirrors, which need every size to compare
+    bool fastStart = false;
+    // Files that come down as one stream, see RemoteFileInfo::singleStream(): ask for a gzip, deflate or zstd
+    // encoding and decode it on the way to the file
+    bool decodeContent = false;
+    // Directory of finished downloads shared by the runs on this host, see DownloadCache; empty for none. The size
+    // probe asks whether the cached copy of the URL is still current and a 304 places it instead of downloading
+    std::string cacheDir;
+    // Bytes the cache may hold before the least recently used files go
+    uint64_t cacheLimit = 10ull * 1024 * 1024 * 1024;
+    // Output to stdout ("-") or a named pipe, see FileSink::isPipe: ranges are still fetched in parallel but emitted
+    // strictly in order, through a reorder window of this many bytes. Connections wait while it is full
+    uint64_t reorderWindow = 64 * 1024 * 1024;
+    // Download as a delta, see DeltaManifest: the blocks of the new file's manifest that this local file, e.g. the
+    // previous version, holds anywhere are copied from it and only the others are fetched. Range downloads into a
+    // file only
+    std::string seedFile;
+    std::string deltaManifest;
+    // Takes the file in order instead of the output file, the way a pipe does, through a reorder window of
+    // reorderWindow bytes; the output path then only names the download
+    OrderedOutput::Consumer outputConsumer;
+    // Stops the download from another thread once cancelled; null for none
+    Cancellation* cancellation = nullptr;
+
+    // Whether the file goes out in order, to the consumer or a pipe, rather than into a file
+    bool inOrder(const std::string& outputFile) const { return outputConsumer || FileSink::isPipe(outputFile); }
+};
 
 class Downloader
 {
@@ -10,4 +91,48 @@ class Downloader
     virtual void setUp() = 0;
     virtual size_t getFileSize() = 0;
     virtual bool downloadFile(const std::string& outputFile, int parallelTasks, std::uint64_t fileSize) = 0;
+
+    virtual void setOptions(const DownloadOptions& value);
+
+    // Filled in by getFileSize(). A file without a known size or Range support is streamed over one connection by
+    // downloadFile(), whatever its fileSize and parallelTasks
+    const RemoteFileInfo& remoteFile() const { return remote; }
+    // Counters and histograms of the current or last downloadFile() call
+    Telemetry& telemetry() { return metrics; }
+
+  protected:
+    // For getFileSize(): looks the URL up in the download cache. True when an entry already has the expected SHA-256,
+    // so `remote` is filled in without asking the server; otherwise `cached` holds the entry to revalidate, if any
+    bool lookUpCache(const std::string& url);
+    // For downloadFile() when the probe found the cached copy current. False if it could not be placed or failed
+    // the requested checks; the entry is dropped then, so probing again fetches the file
+    bool placeCached(const std::string& outputFile);
+    // Keeps a finished download of the URL in the cache
+    void storeInCache(const std::string& url, const std::string& outputFile);
+
+    DownloadOptions options;
+    RemoteFileInfo remote;
+    Telemetry metrics;
+    std::unique_ptr<DownloadCache> cache;
+    std::optional<DownloadCache::Entry> cached;
 };
+
+enum class Engine
+{
+    // Coroutines on a Boost.Asio io_context
+    Boost,
+    // One curl multi handle driven by the event loop
+    CurlMulti,
+    // One thread with a blocking curl easy handle per chunk
+    CurlThreads
+};
+
+// Accepts "boost", "curl" (or "curl-multi") and "curl-threads"
+std::optional<Engine> parseEngine(const std::string& name);
+const char* engineName(Engine engine);
+// `requested`, or the engine that can do what the download needs instead: HTTP/2 and HTTP/3 only run on the curl
+// engine, and ordered output and delta downloads need the range scheduler that curl-threads does without
+Engine engineFor(Engine requested, const DownloadOptions& options, const std::string& outputFile);
+// With a runtime the download shares its event loop, connection pools, DNS results and TLS sessions with the other
+// downloads on it
+std::unique_ptr<Downloader> createDownloader(Engine engine, const std::string& url, DownloadRuntime* runtime = nullptr);
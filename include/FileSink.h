@@ -0,0 +1,60 @@
+#pragma once
+
+#include <include/OrderedOutput.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Output file opened once and written at arbitrary offsets while chunks are still being received.
+// Concurrent writes to disjoint ranges are safe, so every connection can stream into the same sink.
+// A pipe is opened as an OrderedOutput instead: writes go through its reorder window, and sizing or syncing does
+// nothing.
+class FileSink
+{
+  public:
+    FileSink() = default;
+    ~FileSink();
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    // Creates (or truncates) the file and reserves fileSize bytes on disk up front.
+    // With truncate == false the existing content is kept so a download can resume into it.
+    bool open(const std::string& path, uint64_t fileSize, bool truncate = true);
+    // Opens stdout ("-") or a named pipe to emit the file in order through a reorder window of `window` bytes. With a
+    // consumer the bytes go to it instead and the path only names the output
+    bool openOrdered(const std::string& path, uint64_t window, const OrderedOutput::Consumer& consumer = {});
+    bool write(uint64_t offset, const char* data, size_t size);
+    // Reserves blocks for the first fileSize bytes, e.g. ahead of a stream whose length is not known up front
+    bool reserve(uint64_t fileSize) { return preallocate(fileSize); }
+    // Sets the length of the file, e.g. cuts a reservation back to what was written
+    bool resize(uint64_t fileSize);
+#ifdef __linux__
+    // Moves `size` bytes waiting in a pipe to `offset` with splice(), so they never pass through user space
+    bool writeFromPipe(uint64_t offset, int pipe, size_t size);
+#endif
+    // Flushes written data to the device; call before recording the data as complete anywhere
+    bool sync();
+    bool close();
+
+    bool isOpen() const;
+    const std::string& path() const { return filePath; }
+    // The reorder window of a pipe output, nullptr for a file
+    OrderedOutput* ordered() const { return orderedOutput.get(); }
+
+    // Whether the path names stdout or a named pipe, which take the file only in order and cannot be read back
+    static bool isPipe(const std::string& path);
+
+  private:
+    bool preallocate(uint64_t fileSize);
+
+    std::string filePath;
+    std::unique_ptr<OrderedOutput> orderedOutput;
+#ifdef _WIN32
+    void* handle = nullptr;
+#else
+    int fd = -1;
+#endif
+};
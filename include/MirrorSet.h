@@ -0,0 +1,63 @@
+#pragma once
+
+#include <include/RemoteFileInfo.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The sources of one file: the URL it was asked for, then its mirrors. Each range goes to the source with the most
+// measured throughput per range it already has in flight, so the sources end up with connections in proportion to
+// their speed and a source capped per client stops drawing more once another one does better. A source that fails
+// several ranges in a row is dropped for the rest of the download; the last one left is always kept.
+// Safe to share between threads.
+class MirrorSet
+{
+  public:
+    explicit MirrorSet(std::vector<std::string> urls = {});
+
+    size_t size() const { return sources.size(); }
+    const std::string& url(size_t source) const { return sources[source].url; }
+    // What the size probe of the source returned, for its If-Range validator
+    const RemoteFileInfo& remote(size_t source) const { return sources[source].remote; }
+
+    // Takes the size probe of every source, in order. The first source that answered is the reference; the others
+    // are dropped unless they report the same size and, where both have one, the same ETag. Returns the reference,
+    // with a zero size when no source answered. When none reported a size, the first that answered without one is
+    // kept to stream the file
+    RemoteFileInfo agree(const std::vector<RemoteFileInfo>& probes);
+
+    // Source for the next range, counted as in flight until finish(). A range whose last attempt failed passes the
+    // source of that attempt, which is only picked again when no other one is left
+    size_t pick(int avoid = -1);
+    // A range fetched from the source ended: the bytes it received and how long it took
+    void finish(size_t source, uint64_t bytes, std::chrono::steady_clock::duration elapsed, bool succeeded);
+    // Drops the source, e.g. because its copy of the file changed; false if it is the last one left
+    bool disable(size_t source);
+
+    void printSummary() const;
+
+  private:
+    struct Source
+    {
+        std::string url;
+        RemoteFileInfo remote;
+        bool enabled = true;
+        // Smoothed bytes per second of one range; zero until a range was measured
+        double rate = 0.0;
+        int active = 0;
+        int consecutiveFailures = 0;
+        uint64_t bytes = 0;
+        uint64_t ranges = 0;
+        uint64_t failures = 0;
+    };
+
+    bool disableLocked(size_t source, const char* reason);
+    double bestRate() const;
+
+    mutable std::mutex mutex;
+    std::vector<Source> sources;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Feeds a pipe strictly in order while the ranges of the file arrive in parallel and out of order. Writes land in a
+// reorder window of fixed size that starts at the first byte not yet emitted; a thread emits the contiguous prefix
+// as it fills. The scheduler only hands out ranges that end before horizon(), so memory stays at the window size
+// and idle connections wait while the consumer is behind. A write past the window, as a single stream makes them,
+// blocks until the consumer catches up.
+class OrderedOutput
+{
+  public:
+    // Takes the bytes of the file in order, on the emitting thread; returns false to fail the download
+    using Consumer = std::function<bool(const char* data, size_t size)>;
+
+    // Takes ownership of `file` unless it is stdout
+    OrderedOutput(std::FILE* file, uint64_t window);
+    // Emits to a consumer of the caller's instead of a pipe
+    OrderedOutput(Consumer consumer, uint64_t window);
+    ~OrderedOutput();
+
+    OrderedOutput(const OrderedOutput&) = delete;
+    OrderedOutput& operator=(const OrderedOutput&) = delete;
+
+    bool write(uint64_t offset, const char* data, size_t size);
+
+    // Emission stops at what release() allows, e.g. at the blocks that passed their checks so far
+    void hold();
+    void release(uint64_t upTo);
+    // Sees every emitted byte, in order, on the emitting thread; set before the first write
+    void onEmit(std::function<void(const char*, size_t)> observer);
+
+    // Emits what is ready and closes the pipe; false if writing to it failed
+    bool close();
+
+    uint64_t window() const { return ring.size(); }
+    // First byte past the window: a range ending before it can be written without waiting
+    uint64_t horizon() const;
+    uint64_t emitted() const;
+
+  private:
+    uint64_t limitLocked() const;
+    void emitLoop();
+
+    std::FILE* file = nullptr;
+    Consumer consumer;
+    std::vector<char> ring;
+
+    mutable std::mutex mutex;
+    std::condition_variable wakeEmitter;
+    std::condition_variable spaceFreed;
+    // Written ranges past the contiguous prefix, start to end (exclusive)
+    std::map<uint64_t, uint64_t> written;
+    // End of the contiguous prefix written so far
+    uint64_t ready = 0;
+    uint64_t emittedBytes = 0;
+    bool held = false;
+    uint64_t released = 0;
+    bool closing = false;
+    bool failed = false;
+    std::function<void(const char*, size_t)> observer;
+
+    std::thread emitter;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <include/Chunk.h>
+#include <include/FileSink.h>
+#include <include/RangeScheduler.h>
+#include <include/RemoteFileInfo.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Sidecar file next to the output that records which byte ranges are safely on disk,
+// together with the validators of the remote file they came from. Progress is
+// persisted in batches from a background thread; a later run fetches only the gaps.
+class RangeJournal
+{
+  public:
+    explicit RangeJournal(const std::string& outputFile);
+    ~RangeJournal();
+
+    RangeJournal(const RangeJournal&) = delete;
+    RangeJournal& operator=(const RangeJournal&) = delete;
+
+    // Opens the sink and returns the ranges that still have to be fetched: the whole file,
+    // or only the gaps if resuming is allowed and the journal matches the remote file.
+    // Returns nullopt if the output file cannot be opened.
+    // Given a reorder window, a pipe output or the consumer is opened to take the file in order; it has nothing to
+    // resume and no journal is kept for it.
+    std::optional<std::vector<ByteRange>> open(FileSink& sink, const RemoteFileInfo& remote, bool resume,
+                                               uint64_t reorderWindow = 0,
+                                               const OrderedOutput::Consumer& consumer = {});
+
+    void startFlushing(const RangeScheduler& scheduler,
+                       std::chrono::milliseconds interval = std::chrono::milliseconds(2000));
+    // Removes the journal after a complete download, otherwise records the final progress
+    void finish(bool success);
+    // Forgets all progress, e.g. because the remote file changed
+    void discard();
+    // Counts ranges that reached the output another way, e.g. copied from a seed file, as done; call before
+    // startFlushing()
+    void recordPresent(const std::vector<ByteRange>& ranges);
+
+    uint64_t resumedBytes() const;
+    const std::string& path() const { return journalPath; }
+
+  private:
+    bool load(RemoteFileInfo& recorded, std::vector<ByteRange>& ranges) const;
+    bool flush();
+    void stopFlushing();
+
+    std::string outputPath;
+    std::string journalPath;
+    RemoteFileInfo remote;
+    std::vector<ByteRange> completed; // recorded by earlier runs
+    bool pipe = false;
+
+    FileSink* sink = nullptr;
+    const RangeScheduler* scheduler = nullptr;
+
+    std::thread flusher;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+};
+
+// Sorts the ranges and merges overlapping or adjacent ones
+std::vector<ByteRange> mergeRanges(std::vector<ByteRange> ranges);
+
+// Complement of the (merged) ranges within [0, fileSize)
+std::vector<ByteRange> missingRanges(const std::vector<ByteRange>& ranges, uint64_t fileSize);
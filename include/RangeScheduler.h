@@ -0,0 +1,114 @@
+#pragma once
+
+#include <include/Chunk.h>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Shared queue of small work units. Every connection pulls the next unit when it finishes one;
+// once the queue is empty, idle connections split the tail off the slowest range still in flight.
+// With hedging on, an idle connection that finds nothing left to split duplicates a straggler: a range whose rate
+// fell far below the median of the finished ones, or that has been in flight much longer than nearly all of them.
+// Before the copy starts, the straggler's unclaimed upper half goes back to the queue. The copies write the same bytes
+// and the first to finish the range wins; a copy that falls behind as well is hedged once more.
+// Into an ordered output (a pipe) units go out lowest first and only once they fit into its reorder window, and
+// stealing splits the range nearest the emit position. Ranges reaching past the window, like the head a fast start
+// already fetches, are neither split nor hedged, as a second connection's writes there would block it.
+class RangeScheduler
+{
+  public:
+    // Smallest unit worth a request of its own
+    static constexpr uint64_t MIN_UNIT_SIZE = 256 * 1024;
+
+    RangeScheduler(uint64_t fileSize, uint64_t unitSize, FileSink& sink, int maxRetries);
+    // Schedules only the given ranges, e.g. the gaps left by an interrupted download
+    RangeScheduler(const std::vector<ByteRange>& ranges, uint64_t unitSize, FileSink& sink, int maxRetries);
+
+    // Returns nullptr when there is nothing left to hand out or the download has failed.
+    // Without allowSteal only queued units are handed out.
+    Chunk* next(bool allowSteal = true);
+    // A straggler to fetch a second copy of, or nullptr; only with hedging on and while the budget lasts. Connections
+    // of the download only hedge once no queued unit is left for them; an extra connection, opened for the hedge
+    // alone, also does while units are queued, as every connection may be stuck on a straggler
+    Chunk* hedge(bool extraConnection = false);
+    // While a range is in flight that hedge() may still pick later, the earliest moment it can fall behind far enough
+    // if no more of its bytes arrive, so an idle connection should stay around until then; time_point::max() if only
+    // a range finishing can make it a straggler, or while a hedged range, which may yet fail on every copy and come
+    // back, is in flight. nullopt once no range is left to hedge
+    std::optional<std::chrono::steady_clock::time_point> nextStragglerCheck() const;
+    // Counts the changes that can give an idle connection work: a range finishing or failing, a refetch, the end
+    uint64_t changeCount() const;
+    // Called on every such change, with the scheduler's lock held: it must not call back into the scheduler
+    void setWaker(std::function<void()> waker);
+    // True while queued units wait for the reorder window of an ordered output to move on
+    bool waitingForWindow() const;
+    // Every fetcher of a chunk reports back, the copy that lost a hedge race included
+    void complete(Chunk& chunk);
+    // Puts the unfinished part back in the queue; false once the unit has used up its retries.
+    // A hedged chunk whose other copy is still running stays with that copy.
+    bool fail(Chunk& chunk);
+    // Stops handing out work, e.g. when the remote file changed under the download
+    void abort();
+    // Stops handing out work and interrupts every fetch in flight; their units stay unfinished for a resume
+    void cancel();
+
+    // Every unit, present or future, feeds its bytes to the verifier
+    void setVerifier(DownloadVerifier* verifier);
+    // Queues a range again whose bytes failed verification, ahead of fresh work
+    void refetch(const ByteRange& range);
+    // Takes on a range a request is already fetching, e.g. the first one of a fast start, as a unit in flight
+    Chunk* adopt(const ByteRange& range);
+    // Lets hedged requests fetch up to this share of the scheduled bytes a second time
+    void enableHedging(double budgetShare);
+
+    bool finished() const;
+    bool failed() const;
+
+    uint64_t unitSize() const { return unitBytes; }
+    size_t unitCount() const;
+    uint64_t stealCount() const;
+    uint64_t hedgeCount() const;
+
+    // Every byte range that has reached the sink so far, including prefixes of unfinished units
+    std::vector<ByteRange> writtenRanges() const;
+
+    // Unit size for a download: at most preferredSize, but small enough that every connection gets work, and with a
+    // reorder window of `window` bytes small enough that a unit for every connection fits into it
+    static uint64_t chooseUnitSize(uint64_t fileSize, int parallelTasks, uint64_t preferredSize, uint64_t window = 0);
+
+  private:
+    Chunk* steal();
+    bool fitsWindow(const Chunk& chunk) const;
+    void requeue(Chunk& chunk);
+    void assign(Chunk& chunk);
+    Chunk* findStraggler(std::chrono::steady_clock::time_point now) const;
+    void changed();
+
+    mutable std::mutex mutex;
+    std::deque<Chunk> units; // owns every unit ever created, addresses stay stable
+    std::deque<Chunk*> pending;
+    std::vector<Chunk*> inFlight;
+
+    uint64_t unitBytes;
+    int maxRetries;
+    FileSink* sink;
+    DownloadVerifier* verifier = nullptr;
+    size_t completed = 0;
+    uint64_t steals = 0;
+    bool hasFailed = false;
+    uint64_t changes = 0;
+    std::function<void()> waker;
+
+    uint64_t totalBytes = 0;
+    uint64_t hedgeBudget = 0;
+    uint64_t hedgedBytes = 0;
+    uint64_t hedges = 0;
+    // Rate and duration of every finished range, the yardsticks for stragglers
+    std::vector<double> finishedRates;
+    std::vector<double> finishedSeconds;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// What the size probe learned about the remote file
+struct RemoteFileInfo
+{
+    uint64_t size = 0;
+    std::string etag;
+    std::string lastModified;
+    // The server refuses Range requests (Accept-Ranges: none)
+    bool acceptsRanges = true;
+    // The server answered without a length, e.g. with a chunked body; size stays 0
+    bool unknownSize = false;
+    // The server answered a conditional probe with 304, or the download cache holds a copy with the expected digest:
+    // downloadFile() places the cached copy instead of fetching anything
+    bool notModified = false;
+
+    // Such files cannot be split, they come down as one stream
+    bool singleStream() const { return !acceptsRanges || unknownSize; }
+
+    // Value for If-Range: the ETag if it is strong, otherwise Last-Modified; empty if neither can be used
+    std::string validator() const
+    {
+        if (!etag.empty() && etag.rfind("W/", 0) != 0)
+            return etag;
+        return lastModified;
+    }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Kernel pipe that carries response bodies from a socket into the output file without copying them through user
+// space: splice() moves the socket's pages into the pipe and from there into the file's page cache.
+// Linux only; elsewhere open() fails and the caller stays on the buffered path. One pipe per connection, since the
+// pipe must be empty again before the next fill().
+class SplicePipe
+{
+  public:
+    SplicePipe() = default;
+    ~SplicePipe();
+
+    SplicePipe(const SplicePipe&) = delete;
+    SplicePipe& operator=(const SplicePipe&) = delete;
+
+    bool open();
+    bool isOpen() const { return readEnd >= 0; }
+    // Most bytes one fill() can move
+    size_t capacity() const { return pipeSize; }
+    // Descriptor FileSink::writeFromPipe() takes the bytes from
+    int source() const { return readEnd; }
+
+    // Moves up to `size` bytes that are waiting on a non-blocking socket into the pipe without waiting for more.
+    // Returns the bytes moved, 0 at the end of the stream, or -1 with errno set; EAGAIN means nothing has arrived yet
+    int64_t fill(int socket, size_t size);
+    // Throws away `size` bytes from the front of the pipe
+    bool discard(size_t size);
+
+  private:
+    void close();
+
+    int readEnd = -1;
+    int writeEnd = -1;
+    size_t pipeSize = 0;
+};
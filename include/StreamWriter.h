@@ -0,0 +1,47 @@
+#pragma once
+
+#include <include/FileSink.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Writes a body that can only come down as one stream, of unknown length or from a server without Range support, to
+// the output file in order. The file is reserved ahead of the writes in growing steps instead of block by block and
+// cut back to what was written at the end. A gzip, deflate or zstd Content-Encoding can be undone on the way, through
+// a fixed-size buffer, so memory stays bounded whatever the length of the stream.
+class StreamWriter
+{
+  public:
+    // `reserved` is what the sink already reserved, e.g. the length the server announced
+    StreamWriter(FileSink& sink, uint64_t reserved);
+    ~StreamWriter();
+
+    StreamWriter(const StreamWriter&) = delete;
+    StreamWriter& operator=(const StreamWriter&) = delete;
+
+    // Decodes the rest of the body according to the response's Content-Encoding; false for one it cannot undo
+    bool setEncoding(const std::string& contentEncoding);
+    bool append(const char* data, size_t size);
+    // Cuts the file to the bytes written; false if a compressed stream ended early
+    bool finish();
+
+    // Bytes written to the file, after decoding
+    uint64_t size() const { return written; }
+    bool decoding() const { return decoder != nullptr; }
+
+    // Accept-Encoding value naming what setEncoding() can undo
+    static const char* acceptedEncodings();
+
+  private:
+    struct Decoder;
+
+    bool inflateData(const char* data, size_t size);
+    bool write(const char* data, size_t size);
+
+    FileSink& sink;
+    uint64_t written = 0;
+    uint64_t reserved = 0;
+    std::unique_ptr<Decoder> decoder;
+};
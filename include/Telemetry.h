@@ -0,0 +1,169 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Log2 histogram: bucket b counts the values in [2^(b-1), 2^b). Recording is a few relaxed atomic adds,
+// so any thread can record without locking; readers see a consistent enough picture for reporting.
+class Histogram
+{
+  public:
+    static constexpr size_t BUCKETS = 64;
+
+    void record(uint64_t value);
+    void reset();
+
+    uint64_t count() const { return samples.load(std::memory_order_relaxed); }
+    uint64_t max() const { return largest.load(std::memory_order_relaxed); }
+    // Upper bound of the bucket holding the given share of the samples
+    uint64_t percentile(double share) const;
+
+    void writeJson(std::ostream& out) const;
+
+  private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+    std::atomic<uint64_t> samples = 0;
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> largest = 0;
+};
+
+// Counters of one connection slot. Only the connection's own worker writes them, so they sit on their own
+// cache line and the receive path never contends with other connections.
+struct alignas(64) ConnectionStats
+{
+    std::atomic<uint64_t> bytes = 0;
+    std::atomic<uint64_t> ranges = 0;
+    std::atomic<uint64_t> retries = 0;
+    std::atomic<uint64_t> stalls = 0;
+};
+
+// Timings of one range request; zero where the range did not pay for the step, e.g. connect on a reused socket
+struct RangeSample
+{
+    uint64_t bytes = 0;
+    std::chrono::microseconds dns{0};
+    std::chrono::microseconds connect{0};
+    std::chrono::microseconds tls{0};
+    std::chrono::microseconds firstByte{0};
+    std::chrono::microseconds duration{0};
+};
+
+// Per-download instrumentation shared by the engines: per-connection counters plus histograms of every range
+class Telemetry
+{
+  public:
+    // A gap this long between two reads of the same response counts as a stall
+    static constexpr std::chrono::milliseconds STALL_THRESHOLD{200};
+
+    // Starts a new download over `connections` slots, dropping whatever the previous one recorded
+    void begin(int connections);
+    void end();
+
+    ConnectionStats& connection(int index) { return slots[index]; }
+    int connectionCount() const { return slotCount; }
+
+    void recordRange(const RangeSample& sample);
+    void recordDns(std::chrono::microseconds time);
+    void recordStall(int connection, std::chrono::microseconds time);
+    void recordRetry(int connection);
+    // The number of connections the download keeps busy changed; adaptive downloads call this on every step
+    void recordConcurrency(int connections);
+
+    uint64_t totalBytes() const;
+    uint64_t totalRanges() const;
+    uint64_t totalRetries() const;
+    uint64_t totalStalls() const;
+    int concurrency() const { return activeConnections.load(std::memory_order_relaxed); }
+
+    // One line for the periodic report; the rate covers the time since the previous call
+    std::string statusLine();
+    void writeJson(std::ostream& out) const;
+
+  private:
+    // Guards replacing the slots against the reporting thread; recording never takes it
+    mutable std::mutex mutex;
+    std::unique_ptr<ConnectionStats[]> slots;
+    int slotCount = 0;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point ended;
+
+    Histogram firstByteUs;
+    Histogram dnsUs;
+    Histogram connectUs;
+    Histogram tlsUs;
+    Histogram rangeUs;
+    Histogram rangeBytes;
+    Histogram rangeKiBPerSecond;
+    Histogram stallUs;
+
+    std::atomic<int> activeConnections = 0;
+    // Seconds since begin() and the concurrency from then on; empty while the download never changed it
+    std::vector<std::pair<double, int>> concurrencySteps;
+
+    // State of statusLine()
+    uint64_t lastBytes = 0;
+    std::chrono::steady_clock::time_point lastReport;
+};
+
+// Clocks one range request on behalf of a connection slot. It lives with whoever drives the request, so the
+// receive path only reads the clock and bumps its own slot's byte counter. Does nothing until attached.
+class RangeProbe
+{
+  public:
+    void attach(Telemetry* owner, int connectionIndex);
+
+    // A new request is about to be sent
+    void start();
+    // The response headers arrived
+    void onResponse();
+    void onData(size_t bytes)
+    {
+        if (!telemetry)
+            return;
+
+        const auto now = std::chrono::steady_clock::now();
+        if (sample.bytes > 0 && now - lastData >= Telemetry::STALL_THRESHOLD)
+            telemetry->recordStall(index, std::chrono::duration_cast<std::chrono::microseconds>(now - lastData));
+        lastData = now;
+        sample.bytes += bytes;
+        stats->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    // Posts the sample; failed ranges only count their bytes
+    void finish(bool completed);
+    // The range failed and goes back to the scheduler
+    void retry();
+
+    // Engines that learn the connection timings elsewhere fill them in before finish()
+    RangeSample sample;
+
+  private:
+    Telemetry* telemetry = nullptr;
+    ConnectionStats* stats = nullptr;
+    int index = 0;
+    std::chrono::steady_clock::time_point requested;
+    std::chrono::steady_clock::time_point lastData;
+};
+
+// Prints the telemetry's status line to std::cerr at a fixed interval until destroyed
+class StatsReporter
+{
+  public:
+    StatsReporter(Telemetry& telemetry, std::chrono::milliseconds interval);
+    ~StatsReporter();
+
+  private:
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+    std::thread thread;
+};
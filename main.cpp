@@ -3,15 +3,43 @@
 #include <QCoreApplication>
 #include <QDebug>
 
+#include <include/BatchDownloader.h>
 #include <include/BoostUtils.h>
 #include <include/CurlUtils.h>
+#include <include/DeltaManifest.h>
+#include <include/DownloadClient.h>
+#include <include/FileSink.h>
 
 #include <boost/asio.hpp>
 #include <boost/version.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+
 static constexpr auto FILE_URL = "http://speedtest.tele2.net/10MB.zip";
 
-bool parseCommandLine(QCoreApplication& app, std::string& outputFile, int& parallelTasks, std::string& url)
+struct CommandLine
+{
+    std::string outputFile;
+    int parallelTasks = 0;
+    std::string url;
+    // Batch mode: manifest path, or "-" for stdin
+    std::string manifest;
+    Engine engine = Engine::Boost;
+    // Where to write the JSON telemetry report, if anywhere
+    std::string statsJson;
+    // Seconds between status lines; 0 turns them off
+    int statsInterval = 0;
+    // Manifest mode: the local file whose delta manifest is written to outputFile
+    std::string deltaSource;
+    uint64_t deltaBlockSize = DeltaManifest::DEFAULT_BLOCK_SIZE;
+    DownloadOptions options;
+    BatchOptions batch;
+};
+
+bool parseCommandLine(QCoreApplication& app, CommandLine& commandLine)
 {
     QCommandLineParser parser;
     parser.setApplicationDescription("Parallel HTTP File Downloader");
@@ -21,16 +49,159 @@ bool parseCommandLine(QCoreApplication& app, std::string& outputFile, int& paral
     parser.addOption(outputOption);
     QCommandLineOption parallelOption({"p", "parallel"}, "Number of parallel tasks", "4");
     parser.addOption(parallelOption);
+    QCommandLineOption chunkSizeOption({"c", "chunk-size"}, "Size of the work units, in MiB", "MiB", "4");
+    parser.addOption(chunkSizeOption);
+    QCommandLineOption threadsOption({"t", "threads"}, "Threads for the Boost engine, 0 for all cores", "count", "1");
+    parser.addOption(threadsOption);
+    QCommandLineOption noResumeOption("no-resume", "Ignore the journal of an interrupted download and start over");
+    parser.addOption(noResumeOption);
+    QCommandLineOption adaptiveOption("adaptive",
+                                      "Tune the number of connections while downloading, up to --parallel");
+    parser.addOption(adaptiveOption);
+    QCommandLineOption noZeroCopyOption("no-zero-copy",
+                                        "Copy plain-HTTP bodies through a buffer instead of splicing them to the file");
+    parser.addOption(noZeroCopyOption);
+    QCommandLineOption hedgeBudgetOption("hedge-budget",
+                                         "Boost engine: share of the bytes hedged requests may fetch twice, 0 for none",
+                                         "share", "0.1");
+    parser.addOption(hedgeBudgetOption);
+    QCommandLineOption mirrorOption("mirror", "Another URL of the same file, repeat for more; ranges are spread over "
+                                              "all of them by speed", "url");
+    parser.addOption(mirrorOption);
+    QCommandLineOption fastStartOption("fast-start", "Send the first range right away instead of probing the size "
+                                                     "first; falls back to one stream if the server ignores Range");
+    parser.addOption(fastStartOption);
+    QCommandLineOption decodeOption("decode", "Ask for a gzip, deflate or zstd encoding of a file that has to be "
+                                              "streamed, and decode it on the way to disk");
+    parser.addOption(decodeOption);
+    QCommandLineOption cacheDirOption("cache-dir", "Keep finished downloads in this directory and reuse them while "
+                                                   "the server reports them unchanged", "path");
+    parser.addOption(cacheDirOption);
+    QCommandLineOption cacheSizeOption("cache-size", "Size limit of the download cache, in MiB", "MiB", "10240");
+    parser.addOption(cacheSizeOption);
+    QCommandLineOption reorderWindowOption("reorder-window", "Output '-' (stdout) or a named pipe: bytes held back to "
+                                                             "emit the ranges in order, in MiB", "MiB", "64");
+    parser.addOption(reorderWindowOption);
+    QCommandLineOption seedOption("seed", "Local file, e.g. the previous version, to copy the blocks of the "
+                                          "--delta-manifest from; only the others are downloaded", "path");
+    parser.addOption(seedOption);
+    QCommandLineOption deltaManifestOption("delta-manifest", "Block checksums of the file to download against --seed",
+                                           "path");
+    parser.addOption(deltaManifestOption);
+    QCommandLineOption makeDeltaManifestOption("make-delta-manifest",
+                                               "Write the delta manifest of a local file to the -o path and exit",
+                                               "file");
+    parser.addOption(makeDeltaManifestOption);
+    QCommandLineOption deltaBlockSizeOption("delta-block-size", "Block size of a new delta manifest, in KiB", "KiB",
+                                            "64");
+    parser.addOption(deltaBlockSizeOption);
+    QCommandLineOption engineOption({"e", "engine"}, "Download engine: boost, curl or curl-threads", "engine",
+                                    "boost");
+    parser.addOption(engineOption);
+    QCommandLineOption caFileOption("ca-file", "PEM bundle to verify HTTPS servers against", "path");
+    parser.addOption(caFileOption);
+    QCommandLineOption http2Option("http2", "Run the ranges as multiplexed HTTP/2 streams (curl engine)");
+    parser.addOption(http2Option);
+    QCommandLineOption http3Option("http3", "Experimental: run the ranges as HTTP/3 streams over QUIC (curl engine)");
+    parser.addOption(http3Option);
+    QCommandLineOption multiplexConnectionsOption("multiplex-connections",
+                                                  "Connections the HTTP/2 or HTTP/3 streams are spread over", "count",
+                                                  "1");
+    parser.addOption(multiplexConnectionsOption);
+    QCommandLineOption batchOption("batch", "Download every '<url> <path>' line of a manifest ('-' for stdin)",
+                                   "manifest");
+    parser.addOption(batchOption);
+    QCommandLineOption maxConnectionsOption("max-connections", "Batch mode: connections across all files",
+                                            "count", "16");
+    parser.addOption(maxConnectionsOption);
+    QCommandLineOption maxPerHostOption("max-per-host", "Batch mode: connections per host", "count", "6");
+    parser.addOption(maxPerHostOption);
+    QCommandLineOption sha256Option("sha256", "Expected SHA-256 of the file, checked while it downloads", "hex");
+    parser.addOption(sha256Option);
+    QCommandLineOption crc32cOption("crc32c", "Expected CRC32C of the file, checked while it downloads", "hex");
+    parser.addOption(crc32cOption);
+    QCommandLineOption blockChecksumsOption("block-checksums",
+                                            "Manifest of per-block CRC32C values; corrupt blocks are fetched again",
+                                            "path");
+    parser.addOption(blockChecksumsOption);
+    QCommandLineOption statsJsonOption("stats-json", "Write per-range telemetry with histograms to a JSON file",
+                                       "path");
+    parser.addOption(statsJsonOption);
+    QCommandLineOption statsIntervalOption("stats-interval", "Print a throughput line every few seconds, 0 for never",
+                                           "seconds", "0");
+    parser.addOption(statsIntervalOption);
     parser.addPositionalArgument("url", "The URL to download");
     parser.process(app);
 
+    auto& outputFile = commandLine.outputFile;
+    auto& parallelTasks = commandLine.parallelTasks;
+    auto& options = commandLine.options;
+    auto& batch = commandLine.batch;
+
     outputFile = parser.value(outputOption).toStdString();
+    // The file itself goes to stdout, everything said about it to stderr
+    if (outputFile == "-")
+        std::cout.rdbuf(std::cerr.rdbuf());
     parallelTasks = parser.value(parallelOption).toInt();
+    const auto chunkSizeMiB = parser.value(chunkSizeOption).toULongLong();
+    options.threads = parser.value(threadsOption).toInt();
+    options.resume = !parser.isSet(noResumeOption);
+    options.adaptive = parser.isSet(adaptiveOption);
+    options.fastStart = parser.isSet(fastStartOption);
+    options.decodeContent = parser.isSet(decodeOption);
+    options.cacheDir = parser.value(cacheDirOption).toStdString();
+    const auto cacheSizeMiB = parser.value(cacheSizeOption).toULongLong();
+    const auto reorderWindowMiB = parser.value(reorderWindowOption).toULongLong();
+    options.seedFile = parser.value(seedOption).toStdString();
+    options.deltaManifest = parser.value(deltaManifestOption).toStdString();
+    commandLine.deltaSource = parser.value(makeDeltaManifestOption).toStdString();
+    const auto deltaBlockSizeKiB = parser.value(deltaBlockSizeOption).toULongLong();
+    options.zeroCopy = !parser.isSet(noZeroCopyOption);
+    options.hedgeBudget = parser.value(hedgeBudgetOption).toDouble();
+    for (const auto& mirror : parser.values(mirrorOption))
+        options.mirrors.push_back(mirror.toStdString());
+    if (parser.isSet(http3Option))
+        options.httpVersion = HttpVersion::Http3;
+    else if (parser.isSet(http2Option))
+        options.httpVersion = HttpVersion::Http2;
+    options.multiplexConnections = parser.value(multiplexConnectionsOption).toInt();
+    options.caFile = parser.value(caFileOption).toStdString();
+    options.sha256 = parser.value(sha256Option).toStdString();
+    options.crc32c = parser.value(crc32cOption).toStdString();
+    options.blockChecksums = parser.value(blockChecksumsOption).toStdString();
+    commandLine.manifest = parser.value(batchOption).toStdString();
+    batch.maxConnections = parser.value(maxConnectionsOption).toInt();
+    batch.maxConnectionsPerHost = parser.value(maxPerHostOption).toInt();
+    commandLine.statsJson = parser.value(statsJsonOption).toStdString();
+    commandLine.statsInterval = parser.value(statsIntervalOption).toInt();
     QStringList positionalArgs = parser.positionalArguments();
-    url = positionalArgs.isEmpty() ? FILE_URL : positionalArgs.first().toStdString();
+    commandLine.url = positionalArgs.isEmpty() ? FILE_URL : positionalArgs.first().toStdString();
     std::cout << "File URL provided: " << FILE_URL << std::endl;
 
-    if (outputFile.empty())
+    if (batch.maxConnections <= 0 || batch.maxConnectionsPerHost <= 0)
+    {
+        std::cerr << "Connection limits must be greater than 0." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+
+    const auto engine = parseEngine(parser.value(engineOption).toStdString());
+    if (!engine)
+    {
+        std::cerr << "Unknown engine, expected boost, curl or curl-threads." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+    commandLine.engine = *engine;
+
+    if (options.multiplexConnections <= 0)
+    {
+        std::cerr << "Number of multiplexed connections must be greater than 0." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+
+    if (outputFile.empty() && commandLine.manifest.empty())
     {
         std::cerr << "Output file must be specified with -o option." << std::endl;
         parser.showHelp(1);
@@ -43,35 +214,167 @@ bool parseCommandLine(QCoreApplication& app, std::string& outputFile, int& paral
         parser.showHelp(1);
         return false;
     }
+
+    if (chunkSizeMiB == 0)
+    {
+        std::cerr << "Chunk size must be at least 1 MiB." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+    options.chunkSize = chunkSizeMiB * 1024 * 1024;
+
+    if (cacheSizeMiB == 0)
+    {
+        std::cerr << "Cache size must be at least 1 MiB." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+    options.cacheLimit = cacheSizeMiB * 1024 * 1024;
+
+    if (reorderWindowMiB == 0)
+    {
+        std::cerr << "Reorder window must be at least 1 MiB." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+    options.reorderWindow = reorderWindowMiB * 1024 * 1024;
+
+    if (deltaBlockSizeKiB == 0)
+    {
+        std::cerr << "Delta block size must be at least 1 KiB." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+    commandLine.deltaBlockSize = deltaBlockSizeKiB * 1024;
+
+    if (options.seedFile.empty() != options.deltaManifest.empty())
+    {
+        std::cerr << "--seed and --delta-manifest go together." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+    if (!options.seedFile.empty())
+    {
+        std::error_code errorCode;
+        if (FileSink::isPipe(outputFile))
+        {
+            std::cerr << "A delta download needs a file to copy the seed's blocks into, not a pipe." << std::endl;
+            return false;
+        }
+        // Opening the output would truncate the seed before it is read
+        if (std::filesystem::equivalent(options.seedFile, outputFile, errorCode))
+        {
+            std::cerr << "The seed must be another file than the output." << std::endl;
+            return false;
+        }
+    }
+
+    if (options.threads < 0)
+    {
+        std::cerr << "Number of threads cannot be negative." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+
+    const auto isHex = [](const std::string& text) {
+        return std::all_of(text.begin(), text.end(), [](unsigned char c) { return std::isxdigit(c); });
+    };
+    if (!options.sha256.empty() && (options.sha256.size() != 64 || !isHex(options.sha256)))
+    {
+        std::cerr << "SHA-256 must be 64 hex digits." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+    if (!options.crc32c.empty() && (options.crc32c.size() > 8 || !isHex(options.crc32c)))
+    {
+        std::cerr << "CRC32C must be at most 8 hex digits." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+
+    if (commandLine.statsInterval < 0)
+    {
+        std::cerr << "Stats interval cannot be negative." << std::endl;
+        parser.showHelp(1);
+        return false;
+    }
+    batch.download = options;
     return true;
 }
 
+int runBatch(const CommandLine& commandLine)
+{
+    std::vector<BatchEntry> entries;
+    if (commandLine.manifest == "-")
+    {
+        entries = readManifest(std::cin);
+    }
+    else
+    {
+        std::ifstream in(commandLine.manifest);
+        if (!in)
+        {
+            std::cerr << "Cannot open manifest " << commandLine.manifest << std::endl;
+            return 1;
+        }
+        entries = readManifest(in);
+    }
+
+    BatchDownloader downloader(std::move(entries), commandLine.batch);
+    return downloader.run() == 0 ? 0 : 1;
+}
+
+int writeDeltaManifest(const CommandLine& commandLine)
+{
+    const auto manifest = DeltaManifest::generate(commandLine.deltaSource, commandLine.deltaBlockSize);
+    if (!manifest || !manifest->save(commandLine.outputFile))
+        return 1;
+
+    std::cout << "Wrote the delta manifest of " << commandLine.deltaSource << " to " << commandLine.outputFile
+              << std::endl;
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
     QCoreApplication app(argc, argv);
 
-    int parallelTasks;
-    std::string url;
-    std::string outputFile;
-    if (!parseCommandLine(app, outputFile, parallelTasks, url))
+    CommandLine commandLine;
+    if (!parseCommandLine(app, commandLine))
     {
         return 1;
     }
 
-    std::unique_ptr<Downloader> downloader = std::make_unique<BoostDownloader>(url);
-    //std::unique_ptr<Downloader> downloader = std::make_unique<CurlDownloader>(url);
+    if (!commandLine.manifest.empty())
+        return runBatch(commandLine);
+    if (!commandLine.deltaSource.empty())
+        return writeDeltaManifest(commandLine);
+
+    // A client of one download; the Boost engine runs on its event loop threads
+    DownloadClient client(ClientOptions{1, commandLine.options.threads});
 
-    const auto fileSize = downloader->getFileSize();
-    if (fileSize <= 0)
+    DownloadRequest request;
+    request.url = commandLine.url;
+    request.outputFile = commandLine.outputFile;
+    request.parallelTasks = commandLine.parallelTasks;
+    request.engine = commandLine.engine;
+    request.options = commandLine.options;
+    if (commandLine.statsInterval > 0)
     {
-        std::cerr << "Could not determine file size!" << std::endl;
-        return 1;
+        request.onProgress = [](const DownloadProgress& progress) { std::cout << progress.status << std::endl; };
+        request.progressInterval = std::chrono::seconds(commandLine.statsInterval);
+    }
+    const DownloadResult result = client.download(std::move(request));
+
+    if (!commandLine.statsJson.empty() && !result.telemetry.empty())
+    {
+        std::ofstream report(commandLine.statsJson);
+        report << result.telemetry;
+        if (!report)
+            std::cerr << "Cannot write the stats report to " << commandLine.statsJson << std::endl;
     }
-    std::cout << "File size: " << fileSize << " bytes / " << (fileSize / 1024.0 / 1024.0) << " MB"
-              << std::endl;
 
-    bool success = downloader->downloadFile(outputFile, parallelTasks, fileSize);
-    if (success)
+    if (result.success)
     {
         std::cout << "File downloaded successfully!" << std::endl;
     }
@@ -0,0 +1,426 @@
+#include <include/BatchDownloader.h>
+#include <include/CurlUtils.h>
+#include <include/RangeJournal.h>
+#include <include/RangeScheduler.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+static constexpr int MAX_RETRIES = 3;
+
+struct BatchDownloader::FileJob
+{
+    enum class State
+    {
+        Unprobed,
+        Probing,
+        Ready,
+        Active,
+        Done,
+        Failed
+    };
+
+    BatchEntry entry;
+    std::string host;
+    State state = State::Unprobed;
+    int probeAttempts = 0;
+    RemoteFileInfo remote;
+
+    // Created when the first range of the file is dispatched and released once it is finished
+    std::unique_ptr<FileSink> sink;
+    std::unique_ptr<RangeJournal> journal;
+    std::unique_ptr<RangeScheduler> scheduler;
+    curl_slist* headers = nullptr;
+    int inFlight = 0;
+    bool remoteChanged = false;
+};
+
+struct BatchDownloader::Slot
+{
+    CurlTransfer transfer;
+    FileJob* job = nullptr;
+    bool probe = false;
+};
+
+std::vector<BatchEntry> readManifest(std::istream& in)
+{
+    std::vector<BatchEntry> entries;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        BatchEntry entry;
+        if (!(fields >> entry.url) || entry.url[0] == '#')
+            continue;
+
+        if (!(fields >> entry.outputFile))
+        {
+            std::cerr << "Manifest line without output path skipped: " << line << std::endl;
+            continue;
+        }
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+static std::string hostOf(const std::string& url)
+{
+    std::string host;
+    CURLU* parsed = curl_url();
+    char* part = nullptr;
+    if (curl_url_set(parsed, CURLUPART_URL, url.c_str(), CURLU_GUESS_SCHEME) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_HOST, &part, 0) == CURLUE_OK)
+    {
+        host = part;
+        curl_free(part);
+    }
+    curl_url_cleanup(parsed);
+    return host;
+}
+
+BatchDownloader::BatchDownloader(std::vector<BatchEntry> entries, BatchOptions batchOptions)
+    : options(std::move(batchOptions))
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    for (auto& entry : entries)
+    {
+        auto job = std::make_unique<FileJob>();
+        job->host = hostOf(entry.url);
+        job->entry = std::move(entry);
+        jobs.push_back(std::move(job));
+    }
+
+    options.download.httpVersion = supportedHttpVersion(options.download.httpVersion);
+
+    eventLoop = std::make_unique<CurlEventLoop>(ioContext);
+    multiHandle = eventLoop->multi();
+    // curl enforces the same caps on its side, so its connection cache never exceeds them either
+    curl_multi_setopt(multiHandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(options.maxConnections));
+    curl_multi_setopt(multiHandle, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(options.maxConnectionsPerHost));
+
+    for (int i = 0; i < options.maxConnections; ++i)
+    {
+        auto slot = std::make_unique<Slot>();
+        slot->transfer.easy = curl_easy_init();
+        slots.push_back(std::move(slot));
+    }
+}
+
+BatchDownloader::~BatchDownloader()
+{
+    for (auto& slot : slots)
+    {
+        curl_multi_remove_handle(multiHandle, slot->transfer.easy);
+        curl_easy_cleanup(slot->transfer.easy);
+    }
+    eventLoop.reset();
+
+    for (auto& job : jobs)
+        curl_slist_free_all(job->headers);
+
+    curl_global_cleanup();
+}
+
+size_t BatchDownloader::run()
+{
+    const auto started = std::chrono::steady_clock::now();
+
+    for (auto& slot : slots)
+        dispatch(*slot);
+
+    // Runs until no transfer is left and curl has nothing to wait for
+    eventLoop->onActivity([this]() { collectFinished(); });
+    ioContext.restart();
+    ioContext.run();
+
+    for (auto& job : jobs)
+    {
+        if (job->state != FileJob::State::Done && job->state != FileJob::State::Failed)
+        {
+            job->state = FileJob::State::Failed;
+            ++failedFiles;
+        }
+    }
+
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cerr << "Batch finished: " << jobs.size() - failedFiles << " of " << jobs.size() << " files, "
+              << downloadedBytes / 1024.0 / 1024.0 << " MB in " << seconds << " s ("
+              << downloadedBytes / 1024.0 / 1024.0 / std::max(seconds, 1e-3) << " MB/s)" << std::endl;
+    return failedFiles;
+}
+
+void BatchDownloader::collectFinished()
+{
+    int queued = 0;
+    bool finished = false;
+    while (CURLMsg* message = curl_multi_info_read(multiHandle, &queued))
+    {
+        if (message->msg != CURLMSG_DONE)
+            continue;
+
+        Slot* slot = nullptr;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &slot);
+        const CURLcode result = message->data.result;
+        curl_multi_remove_handle(multiHandle, slot->transfer.easy);
+
+        if (slot->probe)
+            onProbeDone(*slot, result);
+        else
+            onRangeDone(*slot, result);
+        release(*slot);
+        finished = true;
+    }
+    if (!finished)
+        return;
+
+    // Refill every idle slot, not just the ones that finished: a probe may have unlocked new work
+    for (auto& slot : slots)
+        if (!slot->job)
+            dispatch(*slot);
+}
+
+bool BatchDownloader::dispatch(Slot& slot)
+{
+    while (firstOpenJob < jobs.size() && (jobs[firstOpenJob]->state == FileJob::State::Done ||
+                                          jobs[firstOpenJob]->state == FileJob::State::Failed))
+    {
+        ++firstOpenJob;
+    }
+
+    // Probe ahead while few probed files are waiting, so ranges never run dry between files
+    const int maxProbes = std::max(1, options.maxConnections / 4);
+    if (activeProbes < maxProbes && readyJobs < static_cast<size_t>(options.maxConnections) && startProbe(slot))
+        return true;
+
+    // Queued ranges in manifest order, so only a handful of files are open at a time
+    for (size_t i = firstOpenJob; i < jobs.size(); ++i)
+    {
+        auto& job = *jobs[i];
+        if ((job.state == FileJob::State::Ready || job.state == FileJob::State::Active) && hostHasCapacity(job) &&
+            startRange(slot, job, false))
+        {
+            return true;
+        }
+    }
+
+    if (activeProbes < maxProbes && startProbe(slot))
+        return true;
+
+    // Nothing queued anywhere: help finish the slowest tail of a file in flight
+    for (size_t i = firstOpenJob; i < jobs.size(); ++i)
+    {
+        auto& job = *jobs[i];
+        if (job.state == FileJob::State::Active && hostHasCapacity(job) && startRange(slot, job, true))
+            return true;
+    }
+
+    return false;
+}
+
+bool BatchDownloader::startProbe(Slot& slot)
+{
+    FileJob* next = nullptr;
+    for (size_t i = firstOpenJob; i < jobs.size() && !next; ++i)
+    {
+        if (jobs[i]->state == FileJob::State::Unprobed && hostHasCapacity(*jobs[i]))
+            next = jobs[i].get();
+    }
+    if (!next)
+        return false;
+
+    auto& job = *next;
+    CURL* easy = slot.transfer.easy;
+    curl_easy_reset(easy);
+    eventLoop->attach(easy);
+    configureProbeHandle(easy, job.entry.url);
+    configureCaFile(easy, options.download.caFile);
+    configureHttpVersion(easy, options.download.httpVersion);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, &slot);
+
+    job.state = FileJob::State::Probing;
+    slot.job = &job;
+    slot.probe = true;
+    ++activeProbes;
+    ++hostConnections[job.host];
+    curl_multi_add_handle(multiHandle, easy);
+    return true;
+}
+
+bool BatchDownloader::startRange(Slot& slot, FileJob& job, bool allowSteal)
+{
+    if (job.state == FileJob::State::Ready && !activate(job))
+        return false;
+
+    Chunk* chunk = job.scheduler->next(allowSteal);
+    if (!chunk)
+        return false;
+
+    curl_easy_reset(slot.transfer.easy);
+    eventLoop->attach(slot.transfer.easy);
+    configureRangeHandle(slot.transfer, job.entry.url, *chunk, job.headers);
+    configureCaFile(slot.transfer.easy, options.download.caFile);
+    configureHttpVersion(slot.transfer.easy, options.download.httpVersion);
+    curl_easy_setopt(slot.transfer.easy, CURLOPT_PRIVATE, &slot);
+
+    slot.job = &job;
+    slot.probe = false;
+    ++job.inFlight;
+    ++hostConnections[job.host];
+    curl_multi_add_handle(multiHandle, slot.transfer.easy);
+    return true;
+}
+
+bool BatchDownloader::activate(FileJob& job)
+{
+    const auto& download = options.download;
+    --readyJobs;
+    job.sink = std::make_unique<FileSink>();
+
+    std::vector<ByteRange> missing;
+    if (job.remote.size > options.splitThreshold)
+    {
+        // Only split files are worth a journal; a small file is simply fetched again
+        job.journal = std::make_unique<RangeJournal>(job.entry.outputFile);
+        auto ranges = job.journal->open(*job.sink, job.remote, download.resume);
+        if (!ranges)
+        {
+            job.state = FileJob::State::Failed;
+            ++failedFiles;
+            return false;
+        }
+        missing = std::move(*ranges);
+    }
+    else
+    {
+        if (!job.sink->open(job.entry.outputFile, job.remote.size))
+        {
+            job.state = FileJob::State::Failed;
+            ++failedFiles;
+            return false;
+        }
+        if (job.remote.size > 0)
+            missing.push_back({0, job.remote.size - 1});
+    }
+
+    const uint64_t unitSize = job.remote.size > options.splitThreshold ? download.chunkSize : job.remote.size;
+    job.scheduler = std::make_unique<RangeScheduler>(missing, unitSize, *job.sink, MAX_RETRIES);
+    if (job.journal)
+        job.journal->startFlushing(*job.scheduler);
+
+    if (const auto validator = job.remote.validator(); !validator.empty())
+        job.headers = curl_slist_append(job.headers, ("If-Range: " + validator).c_str());
+
+    job.state = FileJob::State::Active;
+    finishIfDone(job); // empty files and fully resumed ones have nothing to fetch
+    return job.state == FileJob::State::Active;
+}
+
+void BatchDownloader::onProbeDone(Slot& slot, CURLcode result)
+{
+    auto& job = *slot.job;
+    --activeProbes;
+
+    if (result == CURLE_OK)
+    {
+        job.remote = probeResult(slot.transfer.easy);
+
+        // A size of zero is only trusted when the server said so explicitly
+        curl_off_t length = -1;
+        curl_easy_getinfo(slot.transfer.easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        if (length >= 0)
+        {
+            job.state = FileJob::State::Ready;
+            ++readyJobs;
+            return;
+        }
+        std::cerr << "Could not determine file size of " << job.entry.url << std::endl;
+    }
+    else
+    {
+        std::cerr << "Size probe of " << job.entry.url << " failed: " << curl_easy_strerror(result) << std::endl;
+        if (++job.probeAttempts < MAX_RETRIES)
+        {
+            job.state = FileJob::State::Unprobed;
+            return;
+        }
+    }
+
+    job.state = FileJob::State::Failed;
+    ++failedFiles;
+}
+
+void BatchDownloader::onRangeDone(Slot& slot, CURLcode result)
+{
+    auto& job = *slot.job;
+    Chunk* chunk = slot.transfer.chunk;
+    --job.inFlight;
+
+    if (slot.transfer.remoteChanged)
+    {
+        job.remoteChanged = true;
+        job.scheduler->abort();
+    }
+    else if (transferSucceeded(result, *chunk))
+    {
+        job.scheduler->complete(*chunk);
+    }
+    else
+    {
+        std::cerr << job.entry.url << " [" << chunk->start << "-" << chunk->end << "] failed (attempt "
+                  << chunk->attempts + 1 << "): " << curl_easy_strerror(result) << std::endl;
+        job.scheduler->fail(*chunk);
+    }
+
+    finishIfDone(job);
+}
+
+void BatchDownloader::finishIfDone(FileJob& job)
+{
+    if (job.inFlight > 0 || (!job.scheduler->finished() && !job.scheduler->failed()))
+        return;
+
+    bool success = job.scheduler->finished();
+    if (job.remoteChanged)
+    {
+        std::cerr << job.entry.url << " changed while downloading, progress discarded" << std::endl;
+        if (job.journal)
+            job.journal->discard();
+    }
+    else if (job.journal)
+    {
+        job.journal->finish(success);
+    }
+
+    success = success && finishFile(*job.sink, job.remote.size);
+    if (success)
+    {
+        downloadedBytes += job.remote.size;
+        job.state = FileJob::State::Done;
+    }
+    else
+    {
+        std::cerr << "Download of " << job.entry.url << " failed" << std::endl;
+        job.state = FileJob::State::Failed;
+        ++failedFiles;
+    }
+
+    job.scheduler.reset();
+    job.journal.reset();
+    job.sink.reset();
+}
+
+bool BatchDownloader::hostHasCapacity(const FileJob& job) const
+{
+    const auto it = hostConnections.find(job.host);
+    return it == hostConnections.end() || it->second < options.maxConnectionsPerHost;
+}
+
+void BatchDownloader::release(Slot& slot)
+{
+    --hostConnections[slot.job->host];
+    slot.job = nullptr;
+    slot.transfer.chunk = nullptr;
+}
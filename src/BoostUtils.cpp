@@ -1,4 +1,12 @@
 #include <include/BoostUtils.h>
+#include <include/BufferPool.h>
+#include <include/ConcurrencyController.h>
+#include <include/DeltaManifest.h>
+#include <include/DownloadRuntime.h>
+#include <include/DownloadVerifier.h>
+#include <include/RangeJournal.h>
+#include <include/RangeScheduler.h>
+#include <include/StreamWriter.h>
 
 #include <boost/asio.hpp>
 #include <boost/asio/co_spawn.hpp>
@@ -10,8 +18,19 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <memory_resource>
+#include <optional>
 #include <regex>
+#include <thread>
+#include <type_traits>
 
 namespace asio = boost::asio;
 namespace beast = boost::beast;
@@ -19,50 +38,120 @@ namespace http = beast::http;
 using tcp = asio::ip::tcp;
 using asio::awaitable;
 using asio::use_awaitable;
+using ArenaAllocator = std::pmr::polymorphic_allocator<char>;
+using ArenaFields = http::basic_fields<ArenaAllocator>;
 
-static constexpr auto PORT = "80";
-static constexpr auto URL_REGEX = R"(^(?:https?://)?(?:www\.)?([^/]+)(/.*)?$)";
+// Waits for what was spawned on the io_context. A private context runs on this thread until it is out of work; a
+// shared one is kept running by the threads of its DownloadRuntime, so this thread only waits
+template <class T>
+T awaitSpawned(asio::io_context& ioContext, bool shared, std::future<T>& result)
+{
+    if (!shared)
+    {
+        ioContext.restart();
+        ioContext.run();
+    }
+    return result.get();
+}
+
+static constexpr auto URL_REGEX = R"(^(?:(https?)://)?([^/:]+)(?::(\d+))?(/.*)?$)";
+static constexpr size_t RECEIVE_BUFFER_SIZE = 64 * 1024;
+static constexpr std::chrono::milliseconds WINDOW_POLL_INTERVAL{5};
+// The hedger looks at the ranges in flight at least this often
+static constexpr std::chrono::milliseconds HEDGE_POLL_INTERVAL{100};
 
-std::uint64_t getFileSizeByBoost(const std::string& host, const std::string& target, const std::string& port,
-                                 int maxRetries)
+enum class RangeResult
 {
-    auto tryRequest = [&host, &target, &port, maxRetries](http::verb method) -> std::optional<std::uint64_t> {
-        try
-        {
-            asio::io_context ioContext;
-            tcp::resolver resolver(ioContext);
-            auto endpoint = resolver.resolve(host, port);
+    Complete,
+    Failed,
+    RemoteChanged,
+    // The other copy of a hedged range finished it first
+    Superseded
+};
 
-            tcp::socket socket(ioContext);
-            asio::connect(socket, endpoint);
+template <class Stream>
+awaitable<std::optional<RemoteFileInfo>> requestFileInfo(Stream& stream, beast::flat_buffer& buffer,
+                                                         const std::string& authority, const std::string& target,
+                                                         http::verb method, const RemoteFileInfo* cached,
+                                                         bool& reusable)
+{
+    http::request<http::empty_body> request{method, target, 11};
+    request.set(http::field::host, authority);
+    request.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    request.set(http::field::accept, "*/*");
+    // Asks whether the copy in the download cache is still current
+    if (cached && !cached->etag.empty())
+        request.set(http::field::if_none_match, cached->etag);
+    if (cached && !cached->lastModified.empty())
+        request.set(http::field::if_modified_since, cached->lastModified);
+    if (method != http::verb::head)
+    {
+        // The GET body is never read, so this connection cannot go back to the pool
+        request.set(http::field::connection, "close");
+    }
 
-            http::request<http::empty_body> request{method, target, 11};
-            request.set(http::field::host, host);
-            request.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-            request.set(http::field::accept, "*/*");
-            request.set(http::field::connection, "close");
+    co_await http::async_write(stream, request, use_awaitable);
 
-            http::write(socket, request);
+    http::response_parser<http::empty_body> parser;
+    parser.skip(true); // skip http response body
+    co_await http::async_read_header(stream, buffer, parser, use_awaitable);
 
-            beast::flat_buffer buffer;
-            http::response_parser<http::empty_body> parser;
-            parser.skip(true); // skip http response body
-            http::read_header(socket, buffer, parser);
+    auto response = parser.get();
+    reusable = method == http::verb::head && parser.is_done() && parser.keep_alive();
 
-            auto response = parser.get();
-            if (response.result() != http::status::ok)
-                return std::nullopt;
+    if (cached && response.result() == http::status::not_modified)
+    {
+        RemoteFileInfo info = *cached;
+        info.notModified = true;
+        co_return info;
+    }
+    if (response.result() != http::status::ok)
+        co_return std::nullopt;
 
-            if (auto it = response.find(http::field::content_length); it != response.end())
-            {
-                return std::stoull(std::string(it->value()));
-            }
+    RemoteFileInfo info;
+    auto it = response.find(http::field::content_length);
+    if (it != response.end())
+        info.size = std::stoull(std::string(it->value()));
+    else
+        info.unknownSize = true;
+    // Servers that take ranges without saying so are common, so only an explicit refusal counts
+    info.acceptsRanges = !beast::iequals(response[http::field::accept_ranges], "none");
+    info.etag = std::string(response[http::field::etag]);
+    info.lastModified = std::string(response[http::field::last_modified]);
+    co_return info;
+}
 
-            return std::nullopt;
+awaitable<std::optional<RemoteFileInfo>> requestFileInfo(ConnectionPool& pool, const std::string& target,
+                                                         http::verb method, const RemoteFileInfo* cached)
+{
+    auto connection = co_await pool.acquire();
+
+    bool reusable = false;
+    auto info = co_await std::visit(
+        [&](auto& stream) {
+            return requestFileInfo(stream, connection->buffer, pool.authority(), target, method, cached, reusable);
+        },
+        connection->stream);
+
+    if (reusable)
+        pool.release(std::move(connection));
+    co_return info;
+}
+
+// With `cached`, the probe is conditional and a 304 returns the cached info marked notModified
+RemoteFileInfo probeFileByBoost(asio::io_context& ioContext, bool shared, ConnectionPool& pool,
+                                const std::string& target, int maxRetries, const RemoteFileInfo* cached = nullptr)
+{
+    auto tryRequest = [&ioContext, shared, &pool, &target, cached](http::verb method) -> std::optional<RemoteFileInfo> {
+        try
+        {
+            auto result =
+                asio::co_spawn(ioContext, requestFileInfo(pool, target, method, cached), asio::use_future);
+            return awaitSpawned(ioContext, shared, result);
         }
         catch (std::exception& e)
         {
-            std::cout << "File size request exception: " << e.what() << std::endl;
+            std::cerr << "File size request exception: " << e.what() << std::endl;
             return std::nullopt;
         }
     };
@@ -70,150 +159,1041 @@ std::uint64_t getFileSizeByBoost(const std::string& host, const std::string& tar
     for (int attempt = 1; attempt <= maxRetries; ++attempt)
     {
         // Firstly, try HEAD request
-        if (auto size = tryRequest(http::verb::head))
-            return *size;
+        const auto head = tryRequest(http::verb::head);
+        if (head && !head->unknownSize)
+            return *head;
+
+        // If HEAD fails or leaves out the length, try GET
+        const auto get = tryRequest(http::verb::get);
+        if (get && !get->unknownSize)
+            return *get;
+
+        // The server answered, just without a length: the file gets streamed
+        if (get || head)
+            return get ? *get : *head;
+
+        std::cerr << "Attempt " << attempt << " failed, retrying...\n";
+    }
+
+    std::cerr << "Error: unable to determine file size after " << maxRetries << " attempts\n";
+    return {};
+}
+
+// "bytes=<first>-<last>" formatted without a heap allocation
+beast::string_view rangeHeader(std::array<char, 48>& text, uint64_t first, uint64_t last)
+{
+    static constexpr char PREFIX[] = "bytes=";
+    char* end = std::copy(PREFIX, PREFIX + sizeof(PREFIX) - 1, text.data());
+    end = std::to_chars(end, text.data() + text.size(), first).ptr;
+    *end++ = '-';
+    end = std::to_chars(end, text.data() + text.size(), last).ptr;
+    return {text.data(), static_cast<size_t>(end - text.data())};
+}
+
+struct FirstResponse
+{
+    std::unique_ptr<Connection> connection;
+    http::response_parser<http::buffer_body> parser;
+    // Last byte the response carries
+    uint64_t last = 0;
+    // The server ignored the Range and sends the whole file
+    bool wholeFile = false;
+};
+
+// Sends the first range of the file and reads its header: the size comes from Content-Range, or from Content-Length
+// when the server answers 200. The body stays on the connection
+template <class Stream>
+awaitable<std::optional<RemoteFileInfo>> requestFirstRange(Stream& stream, FirstResponse& first,
+                                                           const std::string& authority, const std::string& target,
+                                                           uint64_t length)
+{
+    http::request<http::empty_body> request{http::verb::get, target, 11};
+    request.set(http::field::host, authority);
+    request.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    std::array<char, 48> rangeText;
+    request.set(http::field::range, rangeHeader(rangeText, 0, length - 1));
+    co_await http::async_write(stream, request, use_awaitable);
 
-        // If HEAD fails, try GET
-        if (auto size = tryRequest(http::verb::get))
-            return *size;
+    first.parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+    co_await http::async_read_header(stream, first.connection->buffer, first.parser, use_awaitable);
 
-        std::cout << "Attempt " << attempt << " failed, retrying...\n";
+    const auto& response = first.parser.get();
+    RemoteFileInfo info;
+    info.etag = std::string(response[http::field::etag]);
+    info.lastModified = std::string(response[http::field::last_modified]);
+    if (response.result() == http::status::partial_content)
+    {
+        // "bytes 0-<last>/<size>"; a server that does not know the size answers "*" and gets probed instead
+        static const std::regex contentRange(R"(^bytes 0-(\d+)/(\d+)$)");
+        const std::string value(response[http::field::content_range]);
+        std::smatch match;
+        if (!std::regex_match(value, match, contentRange))
+            co_return std::nullopt;
+        first.last = std::stoull(match[1].str());
+        info.size = std::stoull(match[2].str());
+        if (first.last >= info.size)
+            co_return std::nullopt;
+    }
+    else if (response.result() == http::status::ok && first.parser.content_length() && !first.parser.chunked())
+    {
+        info.size = *first.parser.content_length();
+        first.last = info.size - 1;
+        first.wholeFile = true;
+    }
+    else
+    {
+        co_return std::nullopt;
     }
 
-    std::cout << "Error: unable to determine file size after " << maxRetries << " attempts\n";
-    return 0;
+    if (info.size == 0)
+        co_return std::nullopt;
+    co_return info;
 }
 
-awaitable<bool> downloadChunk(const std::string& host, const std::string& port, const std::string& target,
-                              Chunk& chunk)
+// The first range of a fast start, run on the io_context before the download is set up; null when the server gave
+// no usable answer
+std::unique_ptr<FirstResponse> startFirstRange(asio::io_context& ioContext, bool shared, ConnectionPool& pool,
+                                               const std::string& target, uint64_t length, RemoteFileInfo& info)
 {
+    auto first = std::make_unique<FirstResponse>();
     try
     {
-        tcp::resolver resolver(co_await asio::this_coro::executor);
-        auto endpoint = co_await resolver.async_resolve(host, port, use_awaitable);
+        auto request = [&]() -> awaitable<std::optional<RemoteFileInfo>> {
+            first->connection = co_await pool.acquire();
+            co_return co_await std::visit(
+                [&](auto& stream) { return requestFirstRange(stream, *first, pool.authority(), target, length); },
+                first->connection->stream);
+        };
+        auto result = asio::co_spawn(ioContext, request(), asio::use_future);
+        auto received = awaitSpawned(ioContext, shared, result);
+        if (!received)
+            return nullptr;
+        info = *received;
+        return first;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "First range request exception: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
 
-        tcp::socket socket(co_await asio::this_coro::executor);
-        co_await asio::async_connect(socket, endpoint, use_awaitable);
+// How a fetch that got to `position` ended: only the copy that wrote the last byte of a hedged range completed it
+RangeResult rangeResult(const Chunk& chunk, uint64_t position)
+{
+    if (!chunk.complete())
+        return RangeResult::Failed;
+    return position > chunk.end ? RangeResult::Complete : RangeResult::Superseded;
+}
 
-        // Build request with Range
-        http::request<http::empty_body> request{http::verb::get, target, 11};
-        request.set(http::field::host, host);
-        request.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-        request.set(http::field::range,
-                    "bytes=" + std::to_string(chunk.start) + "-" + std::to_string(chunk.end));
+// Interrupts whatever the socket is waiting for, from any thread; its owner sees an error and drops the connection
+void shutdownSocket(tcp::socket::native_handle_type socket)
+{
+#ifdef _WIN32
+    ::shutdown(socket, SD_BOTH);
+#else
+    ::shutdown(socket, SHUT_RDWR);
+#endif
+}
 
-        co_await http::async_write(socket, request, use_awaitable);
+// Reads the body of a range response whose header `parser` already holds into the chunk, from file offset
+// `position` on
+template <class Stream, class Parser>
+awaitable<RangeResult> readRangeBody(Stream& stream, Connection& connection, Parser& parser, BufferPool& buffers,
+                                     Chunk& chunk, uint64_t position, RangeProbe& probe, bool zeroCopy,
+                                     bool& reusable)
+{
+    beast::flat_buffer& buffer = connection.buffer;
+    const auto contentLength = parser.content_length();
+    if (parser.chunked() || !contentLength)
+    {
+        const auto lease = buffers.acquire();
+        // Without a length the parser has to find the end of the body, so it goes through the parser in pieces
+        while (!parser.is_done() && !chunk.complete())
+        {
+            parser.get().body().data = lease.data();
+            parser.get().body().size = lease.size();
+
+            beast::error_code errorCode;
+            co_await http::async_read(stream, buffer, parser, asio::redirect_error(use_awaitable, errorCode));
+            if (errorCode && errorCode != http::error::need_buffer)
+                throw beast::system_error(errorCode);
+
+            const size_t received = lease.size() - parser.get().body().size;
+            if (!appendChunkData(chunk, position, lease.data(), received))
+                co_return RangeResult::Failed;
+            probe.onData(received);
+        }
+
+        // A response that was read to the end leaves the socket ready for the next Range request
+        reusable = parser.is_done() && parser.keep_alive();
+        co_return rangeResult(chunk, position);
+    }
 
-        beast::flat_buffer buffer;
-        http::response<http::vector_body<char>> response;
-        co_await http::async_read(socket, buffer, response, use_awaitable);
+    // A body of known length needs no parsing, so it is read from the socket straight into the leased buffer
+    // instead of being copied there out of the connection's read buffer. The body bytes that came in with the
+    // header are written from the read buffer itself.
+    uint64_t remaining = *contentLength;
+    if (const auto early = static_cast<size_t>(std::min<uint64_t>(buffer.size(), remaining)); early > 0)
+    {
+        if (!appendChunkData(chunk, position, static_cast<const char*>(buffer.data().data()), early))
+            co_return RangeResult::Failed;
+        probe.onData(early);
+        buffer.consume(early);
+        remaining -= early;
+    }
 
-        if (response.result() == http::status::partial_content || response.result() == http::status::ok)
+#ifdef __linux__
+    // Plain HTTP: the rest of the body goes from the socket to the file through the connection's pipe and never
+    // enters user space. In-flight checksums need the bytes, so verified ranges stay on the buffered path.
+    if constexpr (std::is_same_v<Stream, beast::tcp_stream>)
+    {
+        SplicePipe& pipe = connection.splicePipe;
+        if (zeroCopy && !chunk.verifier && (pipe.isOpen() || pipe.open()))
         {
-            chunk.data = std::move(response.body());
-            co_return true;
+            auto& socket = stream.socket();
+            while (remaining > 0 && !chunk.complete())
+            {
+                const uint64_t end = chunk.end;
+                const uint64_t untilEnd = end + 1 - std::min(position, end + 1);
+                const auto wanted = static_cast<size_t>(std::min({uint64_t{pipe.capacity()}, remaining, untilEnd}));
+                if (wanted == 0)
+                    break;
+                const int64_t moved = pipe.fill(socket.native_handle(), wanted);
+                if (moved < 0 && errno == EAGAIN)
+                {
+                    // Peeking at one byte instead of async_wait: asio tries a receive before it parks the operation,
+                    // so data that arrived since the splice cannot be missed. Ends with eof like a read would.
+                    char next;
+                    co_await socket.async_receive(asio::buffer(&next, 1), tcp::socket::message_peek, use_awaitable);
+                    continue;
+                }
+                if (moved == 0)
+                    throw beast::system_error(asio::error::eof);
+                if (moved < 0)
+                    throw beast::system_error(beast::error_code(errno, boost::system::system_category()));
+
+                if (!spliceChunkData(chunk, position, pipe, static_cast<size_t>(moved)))
+                    co_return RangeResult::Failed;
+                probe.onData(static_cast<size_t>(moved));
+                remaining -= static_cast<uint64_t>(moved);
+            }
+
+            reusable = remaining == 0 && parser.keep_alive();
+            co_return rangeResult(chunk, position);
         }
+    }
+#endif
 
-        std::cout << "Failed to download chunk " << chunk.start << "-" << chunk.end << " : "
-                  << response.result_int() << std::endl;
-        co_return false;
+    const auto lease = buffers.acquire();
+    while (remaining > 0 && !chunk.complete())
+    {
+        const auto wanted = static_cast<size_t>(std::min<uint64_t>(lease.size(), remaining));
+        const size_t received = co_await stream.async_read_some(asio::buffer(lease.data(), wanted), use_awaitable);
+        if (!appendChunkData(chunk, position, lease.data(), received))
+            co_return RangeResult::Failed;
+        probe.onData(received);
+        remaining -= received;
+    }
 
-        beast::error_code errorCode;
-        socket.shutdown(tcp::socket::shutdown_both, errorCode);
+    // A response that was read to the end leaves the socket ready for the next Range request
+    reusable = remaining == 0 && parser.keep_alive();
+
+    co_return rangeResult(chunk, position);
+}
+
+template <class Stream>
+awaitable<RangeResult> fetchRange(Stream& stream, Connection& connection, BufferPool& buffers,
+                                  const std::string& authority, const std::string& target, const std::string& ifRange,
+                                  Chunk& chunk, RangeProbe& probe, bool zeroCopy, bool& reusable)
+{
+    // Header fields of this exchange are carved out of the connection's arena; only an oversized header spills
+    // to the heap
+    std::pmr::monotonic_buffer_resource arena(connection.headerArena.data(), connection.headerArena.size(),
+                                              std::pmr::new_delete_resource());
+    const ArenaAllocator allocator(&arena);
+    beast::flat_buffer& buffer = connection.buffer;
+
+    // Build request with Range, resuming after whatever a previous attempt already wrote
+    http::request<http::empty_body, ArenaFields> request(std::piecewise_construct, std::make_tuple(),
+                                                         std::make_tuple(allocator));
+    request.method(http::verb::get);
+    request.target(target);
+    request.version(11);
+    request.set(http::field::host, authority);
+    request.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    // File offset of the next body byte; behind the chunk's own progress when this is the slower copy of a hedged
+    // range, whose bytes are then dropped until it catches up
+    uint64_t position = chunk.offset();
+    std::array<char, 48> rangeText;
+    request.set(http::field::range, rangeHeader(rangeText, position, chunk.end));
+    if (!ifRange.empty())
+        request.set(http::field::if_range, ifRange);
+
+    // Writing through our own serializer spares async_write from allocating one
+    http::request_serializer<http::empty_body, ArenaFields> serializer(request);
+    co_await http::async_write(stream, serializer, use_awaitable);
+
+    http::response_parser<http::buffer_body, ArenaAllocator> parser(std::piecewise_construct, std::make_tuple(),
+                                                                    std::make_tuple(allocator));
+    parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+    co_await http::async_read_header(stream, buffer, parser, use_awaitable);
+    probe.onResponse();
+
+    const auto status = parser.get().result();
+
+    // With If-Range the server answers 200 with the whole file when the validator no longer matches
+    if (status == http::status::ok && !ifRange.empty())
+        co_return RangeResult::RemoteChanged;
+
+    // Without it a 200 is the whole file too, which only lines up with a range at the start of the file
+    if (status == http::status::ok && position != 0)
+    {
+        std::cerr << "Server ignored the range of chunk " << chunk.start << "-" << chunk.end
+                  << " and sent the whole file" << std::endl;
+        co_return RangeResult::Failed;
+    }
+
+    if (status != http::status::partial_content && status != http::status::ok)
+    {
+        std::cerr << "Failed to download chunk " << chunk.start << "-" << chunk.end << " : "
+                  << parser.get().result_int() << std::endl;
+        co_return RangeResult::Failed;
+    }
+
+    co_return co_await readRangeBody(stream, connection, parser, buffers, chunk, position, probe, zeroCopy, reusable);
+}
+
+// `first` carries on with the response a fast start already has in flight for the chunk
+awaitable<RangeResult> downloadChunk(ConnectionPool& pool, BufferPool& buffers, const std::string& target,
+                                     const std::string& ifRange, Chunk& chunk, RangeProbe& probe, bool zeroCopy,
+                                     bool hedge, FirstResponse* first = nullptr)
+{
+    try
+    {
+        probe.start();
+        for (;;)
+        {
+            // A hedged copy goes over a new connection, which may well reach another server than the straggler's.
+            // Otherwise reusing an idle connection needs no coroutine of its own.
+            std::unique_ptr<Connection> connection;
+            FirstResponse* adopted = nullptr;
+            if (first && first->connection)
+            {
+                adopted = first;
+                connection = std::move(first->connection);
+                probe.onResponse();
+            }
+            else if (hedge)
+                connection = co_await pool.connect();
+            else if (!(connection = pool.takeIdle()))
+                connection = co_await pool.acquire();
+            const bool reused = connection->reused;
+            if (!reused)
+            {
+                probe.sample.connect = connection->connectTime;
+                probe.sample.tls = connection->tlsTime;
+            }
+            if (chunk.complete())
+            {
+                // The other copy of a hedged range finished it while this one was connecting
+                pool.release(std::move(connection));
+                co_return RangeResult::Superseded;
+            }
+
+            // Whichever copy of a hedged range finishes first shuts the other one's socket down, and so does a cancel
+            const auto socket = connection->tcp().socket().native_handle();
+            std::atomic<bool> stopped = false;
+            const int stopper = addStopper(chunk, [socket, &stopped] {
+                stopped = true;
+                shutdownSocket(socket);
+            });
+            const uint64_t receivedBefore = chunk.received;
+            bool reusable = false;
+            RangeResult result;
+            try
+            {
+                result = co_await std::visit(
+                    [&](auto& stream) -> awaitable<RangeResult> {
+                        if (adopted)
+                        {
+                            return readRangeBody(stream, *connection, adopted->parser, buffers, chunk, chunk.offset(),
+                                                 probe, zeroCopy, reusable);
+                        }
+                        return fetchRange(stream, *connection, buffers, pool.authority(), target, ifRange, chunk,
+                                          probe, zeroCopy, reusable);
+                    },
+                    connection->stream);
+            }
+            catch (const boost::system::system_error&)
+            {
+                removeStopper(chunk, stopper);
+                if (chunk.complete())
+                    co_return RangeResult::Superseded;
+                // The server may have closed an idle keep-alive socket; that is not a failed attempt
+                if (!reused || chunk.received != receivedBefore || stopped)
+                    throw;
+                continue;
+            }
+            catch (...)
+            {
+                removeStopper(chunk, stopper);
+                throw;
+            }
+
+            // Unregistered before the connection can go to another request
+            removeStopper(chunk, stopper);
+            if (result == RangeResult::Complete)
+                stopFetches(chunk);
+            if (reusable)
+                pool.release(std::move(connection));
+            co_return result;
+        }
     }
     catch (std::exception& e)
     {
-        std::cout << "Chunk download exception: " << e.what() << std::endl;
-        co_return false;
+        std::cerr << "Chunk download exception: " << e.what() << std::endl;
+        co_return RangeResult::Failed;
     }
 }
 
-bool downloadFileByBoost(const std::string& host, const std::string& target, const std::string& port,
-                         const std::string& outputFile, int parallelTasks, std::uint64_t fileSize,
-                         int maxRetries)
+// `ioThreads` run a private io_context; 0 when it is shared and the threads of its DownloadRuntime run it
+bool downloadFileByBoost(asio::io_context& ioContext, std::vector<BoostSource>& sources, MirrorSet& mirrors,
+                         const std::string& outputFile, int parallelTasks, const RemoteFileInfo& remote,
+                         const DownloadOptions& options, Telemetry& telemetry, int ioThreads, int maxRetries,
+                         FirstResponse* first)
 {
     try
     {
-        auto chunks = createChunks(parallelTasks, fileSize);
+        // A server that ignored the Range of the first request cannot fill gaps either: its file starts over and
+        // comes down that one response, which cannot be retried or split
+        const bool wholeFile = first && first->wholeFile;
+        if (wholeFile)
+        {
+            std::cerr << "The server ignores Range requests, downloading over a single connection" << std::endl;
+            parallelTasks = 1;
+            maxRetries = 1;
+        }
 
-        asio::io_context ioContext;
-        std::vector<std::future<bool>> results;
+        FileSink sink;
+        RangeJournal journal(outputFile);
+        auto missing =
+            journal.open(sink, remote, options.resume && !wholeFile, options.reorderWindow, options.outputConsumer);
+        if (!missing)
+            return false;
+        if (!options.seedFile.empty() && !wholeFile && !sink.ordered() &&
+            !seedDownload(options, remote.size, sink, journal, *missing))
+        {
+            return false;
+        }
+        const uint64_t window = sink.ordered() ? sink.ordered()->window() : 0;
 
-        for (auto& chunk : chunks)
+        // The response of a fast start covers the head of the file; it is only of use while that is still missing.
+        // Into an ordered output only a unit of it is taken on, so the rest of the window is left for the other
+        // connections; the response is dropped once that much of it has come
+        const uint64_t unitSize = RangeScheduler::chooseUnitSize(remote.size, parallelTasks, options.chunkSize, window);
+        std::vector<ByteRange> ranges = *missing;
+        std::optional<ByteRange> firstRange;
+        if (first && !ranges.empty() && ranges.front().start == 0)
+        {
+            const uint64_t last = window && !wholeFile ? std::min(first->last, unitSize - 1) : first->last;
+            firstRange = ByteRange{0, std::min(last, ranges.front().end)};
+            if (firstRange->end == ranges.front().end)
+                ranges.erase(ranges.begin());
+            else
+                ranges.front().start = firstRange->end + 1;
+        }
+        else if (wholeFile)
         {
-            // Launch each chunk as a coroutine with retry logic
-            results.push_back(asio::co_spawn(
+            return false;
+        }
+
+        RangeScheduler scheduler(ranges, unitSize, sink, maxRetries);
+        Chunk* adopted = firstRange ? scheduler.adopt(*firstRange) : nullptr;
+        if (options.hedgeBudget > 0 && !wholeFile)
+            scheduler.enableHedging(options.hedgeBudget);
+        Cancellation::Scope cancelScope(options.cancellation, [&scheduler] { scheduler.cancel(); });
+        DownloadVerifier verifier(options, remote.size);
+        if (sink.ordered())
+            verifier.attach(*sink.ordered());
+        if (!verifier.start(sink.path(), &scheduler, *missing))
+            return false;
+        journal.startFlushing(scheduler);
+
+        // Every source is checked against its own validator, mirrors need not agree on Last-Modified
+        std::vector<std::string> ifRanges;
+        for (size_t i = 0; i < sources.size(); ++i)
+            ifRanges.push_back(mirrors.remote(i).validator());
+        std::atomic<bool> remoteChanged = false;
+
+        telemetry.begin(parallelTasks);
+        for (auto& source : sources)
+        {
+            source.pool->resolve();
+            telemetry.recordDns(source.pool->resolveTime());
+        }
+        ConcurrencyController controller(parallelTasks, options.adaptive);
+        if (controller.adaptive())
+            telemetry.recordConcurrency(controller.limit());
+
+        BufferPool buffers(RECEIVE_BUFFER_SIZE);
+        std::vector<std::future<void>> workers;
+        std::vector<std::atomic<bool>> busy(parallelTasks);
+        std::atomic<int> liveWorkers = 0;
+        auto tickerStrand = asio::make_strand(ioContext);
+        asio::steady_timer ticker(tickerStrand);
+        asio::steady_timer hedgeTimer(tickerStrand);
+
+        // Workers with nothing to do wait on the strand until the scheduler changes, which cancels their timers, or
+        // until a range in flight may have fallen behind far enough to hedge. Changes while nobody waits post nothing.
+        std::vector<asio::steady_timer*> idleTimers;
+        std::atomic<int> waiters = 0;
+        scheduler.setWaker([&tickerStrand, &idleTimers, &waiters] {
+            if (waiters == 0)
+                return;
+            asio::post(tickerStrand, [&idleTimers] {
+                for (auto* timer : idleTimers)
+                    timer->cancel();
+            });
+        });
+        auto waitForChange = [&scheduler, &tickerStrand, &idleTimers, &waiters](
+                                 uint64_t seen, std::chrono::steady_clock::time_point until) -> asio::awaitable<void> {
+            // Counted before looking: a change after the look sees the waiter and posts its wake-up behind this check
+            ++waiters;
+            if (scheduler.changeCount() != seen)
+            {
+                --waiters;
+                co_return;
+            }
+            asio::steady_timer timer(tickerStrand, until);
+            idleTimers.push_back(&timer);
+            boost::system::error_code ec;
+            co_await timer.async_wait(asio::redirect_error(use_awaitable, ec));
+            idleTimers.erase(std::find(idleTimers.begin(), idleTimers.end(), &timer));
+            --waiters;
+        };
+
+        // Hands the outcome of a fetch to the scheduler; false once the download cannot go on
+        const auto settle = [&scheduler, &mirrors, &remoteChanged](Chunk& chunk, size_t source, RangeResult result,
+                                                                   RangeProbe& probe,
+                                                                   std::chrono::steady_clock::time_point started) {
+            const bool completed = result == RangeResult::Complete && chunk.complete();
+            const bool succeeded = completed || result == RangeResult::Superseded;
+            mirrors.finish(source, probe.sample.bytes, std::chrono::steady_clock::now() - started, succeeded);
+            probe.finish(completed);
+            if (succeeded)
+            {
+                scheduler.complete(chunk);
+                return true;
+            }
+
+            // A mirror whose copy changed is dropped and the range goes to the others; the download only fails once
+            // no source is left
+            if (result == RangeResult::RemoteChanged && !mirrors.disable(source))
+            {
+                remoteChanged = true;
+                scheduler.abort();
+                return false;
+            }
+
+            if (!scheduler.failed())
+            {
+                std::cerr << "Chunk [" << chunk.start << "-" << chunk.end << "] failed (attempt " << chunk.attempts + 1
+                          << "), retrying...\n";
+            }
+            chunk.failedSource = static_cast<int>(source);
+            probe.retry();
+            scheduler.fail(chunk);
+            return true;
+        };
+        const bool zeroCopy = options.zeroCopy && !window;
+
+        auto spawnWorker = [&](int i) {
+            busy[i] = true;
+            ++liveWorkers;
+            // Each worker keeps one connection busy, pulling units until the scheduler runs dry or the controller
+            // lowers the limit below its index. A worker only ever has one operation in flight, so it needs no
+            // strand to run in parallel with the others on the io_context threads; a strand executor would also
+            // not fit in any_io_executor's inline storage and cost an allocation on every read.
+            workers.push_back(asio::co_spawn(
                 ioContext,
-                [&host, &port, &target, &chunk, maxRetries]() -> asio::awaitable<bool> {
-                    for (int attempt = 1; attempt <= maxRetries; ++attempt)
+                [&ioContext, &sources, &mirrors, &buffers, &ifRanges, &scheduler, &telemetry, &controller, &busy,
+                 &liveWorkers, &tickerStrand, &ticker, &hedgeTimer, &adopted, &waitForChange, &settle, first, i,
+                 zeroCopy]() -> asio::awaitable<void> {
+                    RangeProbe probe;
+                    probe.attach(&telemetry, i);
+                    asio::steady_timer idle(ioContext);
+                    // The first worker starts with the range of the fast start, whose response is already in
+                    Chunk* resumed = i == 0 ? std::exchange(adopted, nullptr) : nullptr;
+                    while (i < controller.limit())
                     {
-                        try
+                        const uint64_t changes = scheduler.changeCount();
+                        Chunk* chunk = resumed ? resumed : scheduler.next();
+                        const bool hedge = !chunk && (chunk = scheduler.hedge()) != nullptr;
+                        if (!chunk)
                         {
-                            bool ok = co_await downloadChunk(host, port, target, chunk);
-                            if (ok && chunk.data.size())
-                                co_return true;
+                            // Nothing to hand out until the consumer of an ordered output moves the window on
+                            if (scheduler.waitingForWindow())
+                            {
+                                idle.expires_after(WINDOW_POLL_INTERVAL);
+                                co_await idle.async_wait(use_awaitable);
+                                continue;
+                            }
+                            // Or nothing left at all, but a range still in flight may yet fall behind far enough to
+                            // be hedged, or fail and come back
+                            const auto recheck = scheduler.nextStragglerCheck();
+                            if (!recheck)
+                                break;
+                            co_await asio::co_spawn(tickerStrand, waitForChange(changes, *recheck), use_awaitable);
+                            continue;
+                        }
+
+                        const size_t source = mirrors.pick(chunk->failedSource);
+                        const auto started = std::chrono::steady_clock::now();
+                        const auto result = co_await downloadChunk(*sources[source].pool, buffers,
+                                                                   sources[source].target, ifRanges[source], *chunk,
+                                                                   probe, zeroCopy, hedge, resumed ? first : nullptr);
+                        resumed = nullptr;
+                        if (!settle(*chunk, source, result, probe, started))
+                            break;
+                    }
 
-                            std::cout << "Chunk [" << chunk.start << "-" << chunk.end << "] failed (attempt "
-                                      << attempt << "), retrying...\n";
+                    busy[i] = false;
+                    // The last worker out wakes the controller and the hedger so the io_context can run dry
+                    if (--liveWorkers == 0)
+                    {
+                        asio::post(tickerStrand, [&ticker, &hedgeTimer] {
+                            ticker.cancel();
+                            hedgeTimer.cancel();
+                        });
+                    }
+                },
+                asio::use_future));
+        };
+
+        for (int i = 0; i < controller.limit(); ++i)
+            spawnWorker(i);
+
+        // Stragglers on every connection leave no worker idle to hedge them. The hedger looks for stragglers on the
+        // strand and fetches their second copies over extra connections, at most one per worker at a time. It polls
+        // rather than waiting for changes, so the changes of a download that hedges nothing stay free of wake-ups
+        std::atomic<int> extraFetches = 0;
+        std::future<void> hedger;
+        if (options.hedgeBudget > 0 && !wholeFile)
+        {
+            hedger = asio::co_spawn(
+                tickerStrand,
+                [&]() -> asio::awaitable<void> {
+                    while (liveWorkers > 0 && !remoteChanged)
+                    {
+                        Chunk* chunk = extraFetches < parallelTasks ? scheduler.hedge(true) : nullptr;
+                        if (!chunk)
+                        {
+                            const auto poll = std::chrono::steady_clock::now() + HEDGE_POLL_INTERVAL;
+                            hedgeTimer.expires_at(std::min(scheduler.nextStragglerCheck().value_or(poll), poll));
+                            boost::system::error_code ec;
+                            co_await hedgeTimer.async_wait(asio::redirect_error(use_awaitable, ec));
+                            continue;
                         }
-                        catch (const std::exception& e)
+
+                        ++extraFetches;
+                        workers.push_back(asio::co_spawn(
+                            ioContext,
+                            [&, chunk]() -> asio::awaitable<void> {
+                                // Its bytes count towards the first connection's slot, whose counters are atomic
+                                RangeProbe probe;
+                                probe.attach(&telemetry, 0);
+                                const size_t source = mirrors.pick(chunk->failedSource);
+                                const auto started = std::chrono::steady_clock::now();
+                                const auto result =
+                                    co_await downloadChunk(*sources[source].pool, buffers, sources[source].target,
+                                                           ifRanges[source], *chunk, probe, zeroCopy, true);
+                                --extraFetches;
+                                settle(*chunk, source, result, probe, started);
+                            },
+                            asio::use_future));
+                    }
+                },
+                asio::use_future);
+        }
+
+        std::future<void> sampler;
+        if (controller.adaptive())
+        {
+            // Samples the goodput on its own strand and brings in workers when the limit grows; workers above a
+            // lowered limit leave on their own after their current unit
+            sampler = asio::co_spawn(
+                tickerStrand,
+                [&]() -> asio::awaitable<void> {
+                    for (;;)
+                    {
+                        ticker.expires_after(ConcurrencyController::SAMPLE_INTERVAL);
+                        boost::system::error_code ec;
+                        co_await ticker.async_wait(asio::redirect_error(use_awaitable, ec));
+                        if (liveWorkers == 0 || remoteChanged)
+                            co_return;
+                        const bool changed = controller.update(telemetry.totalBytes(), telemetry.totalRanges(),
+                                                               telemetry.totalRetries());
+                        if (!changed)
+                            continue;
+
+                        telemetry.recordConcurrency(controller.limit());
+                        for (int i = 0; i < controller.limit(); ++i)
                         {
-                            std::cout << "Chunk [" << chunk.start << "-" << chunk.end
-                                      << "] exception: " << e.what() << "\n";
+                            if (!busy[i])
+                                spawnWorker(i);
                         }
                     }
-                    co_return false;
                 },
-                asio::use_future));
+                asio::use_future);
         }
 
-        ioContext.run();
+        if (ioThreads > 0)
+        {
+            ioContext.restart();
+            std::vector<std::thread> threads;
+            for (int i = 1; i < ioThreads; ++i)
+                threads.emplace_back([&ioContext] { ioContext.run(); });
+            ioContext.run();
+            for (auto& thread : threads)
+                thread.join();
+        }
+        // The sampler and the hedger are the only ones to add workers, so once they are done the list stays as it is
+        if (sampler.valid())
+            sampler.get();
+        if (hedger.valid())
+            hedger.get();
+        for (auto& worker : workers)
+            worker.get();
+        // On a shared io_context the last worker's wake-up, or that of a change, may still wait on the strand; it goes
+        // before the timers
+        scheduler.setWaker(nullptr);
+        if (ioThreads == 0)
+            asio::post(tickerStrand, asio::use_future).get();
+        telemetry.end();
 
-        for (auto& future : results)
+        if (remoteChanged)
         {
-            if (!future.get())
-            {
-                std::cout << "Download failed: some chunks could not be retrieved\n";
-                return false;
-            }
+            std::cerr << "Download failed: the remote file changed while downloading, progress discarded\n";
+            journal.discard();
+            return false;
+        }
+
+        const bool success = scheduler.finished();
+        journal.finish(success);
+        if (!success)
+        {
+            if (isCancelled(options.cancellation))
+                std::cerr << "Download cancelled, its progress is kept for a resume\n";
+            else
+                std::cerr << "Download failed: some chunks could not be retrieved\n";
+            return false;
         }
 
-        return writeFile(outputFile, chunks, fileSize);
+        std::cerr << "Downloaded " << scheduler.unitCount() << " ranges, " << scheduler.stealCount()
+                  << " of them stolen from slower connections, " << scheduler.hedgeCount() << " hedged" << std::endl;
+        mirrors.printSummary();
+        // An ordered output emits the last verified blocks and the bytes its digest is taken from on closing
+        return verifier.finish(finishFile(sink, remote.size));
     }
     catch (const std::exception& e)
     {
-        std::cout << "Download failed: " << e.what() << std::endl;
+        std::cerr << "Download failed: " << e.what() << std::endl;
         return false;
     }
 }
 
-BoostDownloader::BoostDownloader(const std::string& url)
+// Reads the file as one plain GET, for servers that send no length or take no Range requests
+template <class Stream>
+awaitable<bool> fetchStream(Stream& stream, Connection& connection, const std::string& authority,
+                            const std::string& target, bool decode, StreamWriter& writer, RangeProbe& probe)
 {
-    parseUrl(url, host, target);
+    http::request<http::empty_body> request{http::verb::get, target, 11};
+    request.set(http::field::host, authority);
+    request.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    if (decode)
+        request.set(http::field::accept_encoding, StreamWriter::acceptedEncodings());
+    co_await http::async_write(stream, request, use_awaitable);
+
+    http::response_parser<http::buffer_body> parser;
+    parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+    co_await http::async_read_header(stream, connection.buffer, parser, use_awaitable);
+    probe.onResponse();
+
+    if (parser.get().result() != http::status::ok)
+    {
+        std::cerr << "Stream request failed: " << parser.get().result_int() << std::endl;
+        co_return false;
+    }
+    if (decode && !writer.setEncoding(std::string(parser.get()[http::field::content_encoding])))
+        co_return false;
+
+    // The parser takes the body apart whether it is chunked, has a length or runs until the server closes. Its reads
+    // are only as large as the free space in the connection's read buffer, which the header left small
+    connection.buffer.reserve(RECEIVE_BUFFER_SIZE);
+    std::vector<char> piece(RECEIVE_BUFFER_SIZE);
+    while (!parser.is_done())
+    {
+        parser.get().body().data = piece.data();
+        parser.get().body().size = piece.size();
+
+        beast::error_code errorCode;
+        co_await http::async_read(stream, connection.buffer, parser, asio::redirect_error(use_awaitable, errorCode));
+        if (errorCode && errorCode != http::error::need_buffer)
+            throw beast::system_error(errorCode);
+
+        const size_t received = piece.size() - parser.get().body().size;
+        if (!writer.append(piece.data(), received))
+            co_return false;
+        probe.onData(received);
+    }
+    co_return writer.finish();
+}
+
+bool streamFileByBoost(asio::io_context& ioContext, bool shared, std::vector<BoostSource>& sources,
+                       MirrorSet& mirrors, const std::string& outputFile, const RemoteFileInfo& remote,
+                       const DownloadOptions& options, Telemetry& telemetry, int maxRetries)
+{
+    if (options.inOrder(outputFile) && DownloadVerifier(options, remote.size).enabled())
+    {
+        std::cerr << "A streamed file is checked by reading it back, which a pipe does not allow" << std::endl;
+        return false;
+    }
+
+    const size_t sourceIndex = mirrors.pick();
+    BoostSource& source = sources[sourceIndex];
+    telemetry.begin(1);
+    source.pool->resolve();
+    telemetry.recordDns(source.pool->resolveTime());
+    RangeProbe probe;
+    probe.attach(&telemetry, 0);
+
+    bool success = false;
+    uint64_t size = 0;
+    const auto started = std::chrono::steady_clock::now();
+    // Without ranges there is nothing to resume from, a broken stream starts over. A pipe stays open across the
+    // attempts and skips what it already emitted
+    FileSink sink;
+    const bool pipe = options.inOrder(outputFile);
+    const int attempts =
+        pipe && !sink.openOrdered(outputFile, options.reorderWindow, options.outputConsumer) ? 0 : maxRetries;
+    for (int attempt = 1; attempt <= attempts && !success && !isCancelled(options.cancellation); ++attempt)
+    {
+        if (!pipe && !sink.open(outputFile, remote.size))
+            break;
+        StreamWriter writer(sink, remote.size);
+
+        probe.start();
+        try
+        {
+            auto fetch = [&]() -> awaitable<bool> {
+                auto connection = co_await source.pool->acquire();
+                if (!connection->reused)
+                {
+                    probe.sample.connect = connection->connectTime;
+                    probe.sample.tls = connection->tlsTime;
+                }
+                const auto socket = connection->tcp().socket().native_handle();
+                Cancellation::Scope cancelScope(options.cancellation, [socket] { shutdownSocket(socket); });
+                co_return co_await std::visit(
+                    [&](auto& stream) {
+                        return fetchStream(stream, *connection, source.pool->authority(), source.target,
+                                           options.decodeContent, writer, probe);
+                    },
+                    connection->stream);
+            };
+            auto result = asio::co_spawn(ioContext, fetch(), asio::use_future);
+            success = awaitSpawned(ioContext, shared, result);
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << "Stream exception: " << e.what() << std::endl;
+        }
+
+        // A length the server announced has to arrive in full, unless it was the length of the encoded body
+        if (success && remote.size > 0 && !writer.decoding() && writer.size() != remote.size)
+        {
+            std::cerr << "Stream ended after " << writer.size() << " of " << remote.size << " bytes" << std::endl;
+            success = false;
+        }
+        success = success && sink.close();
+        size = writer.size();
+        probe.finish(success);
+        if (!success)
+        {
+            std::cerr << "Stream attempt " << attempt << " failed" << std::endl;
+            probe.retry();
+        }
+    }
+    telemetry.end();
+    mirrors.finish(sourceIndex, size, std::chrono::steady_clock::now() - started, success);
+
+    if (!success)
+    {
+        std::cerr << "Download failed: the stream could not be retrieved" << std::endl;
+        return false;
+    }
+
+    std::cerr << "Streamed " << size << " bytes over one connection" << std::endl;
+    // The stream cannot be fetched again block by block, so the finished file is read back once instead
+    DownloadVerifier verifier(options, size);
+    return verifier.start(outputFile, nullptr, {}) && verifier.finish(true);
+}
+
+BoostDownloader::BoostDownloader(const std::string& url, DownloadRuntime* runtime)
+    : url(url), runtime(runtime), ioContext(runtime ? runtime->context() : privateContext),
+      mirrors(std::make_unique<MirrorSet>(std::vector{url}))
+{
+    sources.push_back(makeSource(url));
+}
+
+BoostDownloader::~BoostDownloader() {}
+
+void BoostDownloader::setOptions(const DownloadOptions& value)
+{
+    Downloader::setOptions(value);
+    // Nothing is connected yet, so the pools can be looked up again with the new TLS settings and mirrors
+    std::vector<std::string> urls{url};
+    urls.insert(urls.end(), options.mirrors.begin(), options.mirrors.end());
+    sources.clear();
+    for (const auto& sourceUrl : urls)
+        sources.push_back(makeSource(sourceUrl));
+    mirrors = std::make_unique<MirrorSet>(std::move(urls));
 }
 
 size_t BoostDownloader::getFileSize()
 {
-    return getFileSizeByBoost(host, target, PORT, 3);
+    firstResponse.reset();
+    if (lookUpCache(url))
+        return remote.size;
+
+    // A cached copy to revalidate takes the conditional probe, which a range cannot stand in for
+    const RemoteFileInfo* known = cached ? &cached->remote : nullptr;
+    if (options.fastStart && sources.size() == 1 && !known)
+    {
+        RemoteFileInfo info;
+        // Sized like a unit, so that a chunk size of 0 still asks for a range, and no larger than the reorder window
+        // in case the output is a pipe
+        const uint64_t size = std::clamp(options.chunkSize, RangeScheduler::MIN_UNIT_SIZE,
+                                         std::max(options.reorderWindow, RangeScheduler::MIN_UNIT_SIZE));
+        firstResponse =
+            startFirstRange(ioContext, runtime, *sources.front().pool, sources.front().target, size, info);
+        if (firstResponse)
+        {
+            remote = mirrors->agree({info});
+            return remote.size;
+        }
+        std::cerr << "The first range gave no file size, probing it instead" << std::endl;
+    }
+
+    std::vector<RemoteFileInfo> probes;
+    for (auto& source : sources)
+        probes.push_back(probeFileByBoost(ioContext, runtime, *source.pool, source.target, 3, known));
+    remote = mirrors->agree(probes);
+    return remote.size;
 }
 
 bool BoostDownloader::downloadFile(const std::string& outputFile, int parallelTasks, uint64_t fileSize)
 {
-    std::cout << "Downloading file via Boost coroutines..." << std::endl;
-    return downloadFileByBoost(host, target, PORT, outputFile, parallelTasks, fileSize, 3);
+    if (remote.notModified)
+    {
+        if (placeCached(outputFile))
+            return true;
+        fileSize = getFileSize();
+    }
+
+    const bool success = fetchFile(outputFile, parallelTasks, fileSize);
+    if (success)
+        storeInCache(url, outputFile);
+    return success;
+}
+
+bool BoostDownloader::fetchFile(const std::string& outputFile, int parallelTasks, uint64_t fileSize)
+{
+    if (remote.singleStream() && !firstResponse)
+    {
+        std::cerr << "Streaming file via Boost over one connection..." << std::endl;
+        return streamFileByBoost(ioContext, runtime, sources, *mirrors, outputFile, remote, options, metrics, 3);
+    }
+
+    // A shared io_context is run by the runtime's threads
+    int ioThreads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    if (runtime)
+    {
+        ioThreads = 0;
+        std::cerr << "Downloading file via Boost coroutines on the shared event loop..." << std::endl;
+    }
+    else
+    {
+        std::cerr << "Downloading file via Boost coroutines on " << ioThreads << " thread(s)..." << std::endl;
+    }
+    RemoteFileInfo file = remote;
+    file.size = fileSize;
+    // The response of a fast start only fits the size it reported
+    auto first = std::move(firstResponse);
+    if (first && fileSize != remote.size)
+        first.reset();
+
+    // Shared pools count for every download that used them, so only what this one added is reported: connections
+    // opened and reused, full and resumed TLS handshakes
+    auto countConnections = [this] {
+        std::array<uint64_t, 4> counts{};
+        for (const auto& source : sources)
+        {
+            counts[0] += source.pool->connectionsOpened();
+            counts[1] += source.pool->connectionsReused();
+            counts[2] += source.pool->fullHandshakes();
+            counts[3] += source.pool->resumedHandshakes();
+        }
+        return counts;
+    };
+    const auto before = countConnections();
+    bool success = downloadFileByBoost(ioContext, sources, *mirrors, outputFile, parallelTasks, file, options, metrics,
+                                       ioThreads, 3, first.get());
+    const auto after = countConnections();
+    const uint64_t opened = after[0] - before[0];
+    const uint64_t reused = after[1] - before[1];
+    const uint64_t fullHandshakes = after[2] - before[2];
+    const uint64_t resumedHandshakes = after[3] - before[3];
+
+    bool secure = false;
+    for (const auto& source : sources)
+        secure = secure || source.pool->secure();
+    const double reuseRatio = opened + reused ? static_cast<double>(reused) / (opened + reused) : 0.0;
+    std::cerr << "Connections opened: " << opened << ", reused: " << reused << ", reuse ratio: " << reuseRatio * 100.0
+              << "%" << std::endl;
+    if (secure)
+    {
+        std::cerr << "TLS handshakes: " << fullHandshakes << " full, " << resumedHandshakes << " resumed"
+                  << std::endl;
+    }
+    return success;
 }
 
-void BoostDownloader::parseUrl(const std::string& url, std::string& host, std::string& target)
+BoostSource BoostDownloader::makeSource(const std::string& sourceUrl)
 {
+    bool secure = false;
+    std::string host;
+    std::string port;
+    BoostSource source;
+
     std::regex urlRegex(URL_REGEX, std::regex::icase);
     std::smatch match;
-    if (std::regex_match(url, match, urlRegex))
+    if (std::regex_match(sourceUrl, match, urlRegex))
     {
-        host = match[1].str();
-        target = match[2].matched ? match[2].str() : "/";
+        secure = match[1].matched && match[1].str().size() == 5; // "https", in any case
+        host = match[2].str();
+        port = match[3].matched ? match[3].str() : secure ? "443" : "80";
+        source.target = match[4].matched ? match[4].str() : "/";
     }
     else
     {
-        std::cerr << "Invalid URL format: " << url << "\n";
+        std::cerr << "Invalid URL format: " << sourceUrl << "\n";
     }
+
+    if (runtime)
+        source.pool = runtime->pool(host, port, secure, options.caFile);
+    else
+        source.pool = std::make_shared<ConnectionPool>(ioContext, host, port, secure, options.caFile);
+    return source;
 }
@@ -0,0 +1,28 @@
+#include <include/BufferPool.h>
+
+BufferPool::BufferPool(size_t bufferSize) : size(bufferSize)
+{
+}
+
+BufferPool::Lease BufferPool::acquire()
+{
+    {
+        std::lock_guard lock(mutex);
+        if (!free.empty())
+        {
+            auto buffer = std::move(free.back());
+            free.pop_back();
+            return Lease(*this, std::move(buffer));
+        }
+    }
+
+    allocated.fetch_add(1, std::memory_order_relaxed);
+    // Left uninitialized: every byte is written by a read before anyone looks at it
+    return Lease(*this, std::unique_ptr<char[]>(new char[size]));
+}
+
+void BufferPool::release(std::unique_ptr<char[]> buffer)
+{
+    std::lock_guard lock(mutex);
+    free.push_back(std::move(buffer));
+}
@@ -0,0 +1,38 @@
+#include <include/Cancellation.h>
+
+Cancellation::Scope::Scope(Cancellation* cancellation, std::function<void()> stop) : cancellation(cancellation)
+{
+    if (cancellation)
+        id = cancellation->add(std::move(stop));
+}
+
+Cancellation::Scope::~Scope()
+{
+    if (cancellation)
+        cancellation->remove(id);
+}
+
+void Cancellation::cancel()
+{
+    std::lock_guard lock(mutex);
+    if (flag.exchange(true))
+        return;
+    for (auto& [id, stop] : stops)
+        stop();
+}
+
+uint64_t Cancellation::add(std::function<void()> stop)
+{
+    std::lock_guard lock(mutex);
+    if (flag)
+        stop();
+    const uint64_t id = nextId++;
+    stops.emplace(id, std::move(stop));
+    return id;
+}
+
+void Cancellation::remove(uint64_t id)
+{
+    std::lock_guard lock(mutex);
+    stops.erase(id);
+}
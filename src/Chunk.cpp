@@ -1,9 +1,11 @@
 #include <include/Chunk.h>
+#include <include/DownloadVerifier.h>
 
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
 
-std::vector<Chunk> createChunks(int parallelTasks, uint64_t fileSize)
+std::vector<Chunk> createChunks(int parallelTasks, uint64_t fileSize, FileSink& sink)
 {
     std::vector<Chunk> chunks(parallelTasks);
     uint64_t chunkSize = fileSize / parallelTasks;
@@ -12,28 +14,160 @@ std::vector<Chunk> createChunks(int parallelTasks, uint64_t fileSize)
     {
         chunks[i].start = i * chunkSize;
         chunks[i].end = (i == parallelTasks - 1) ? (fileSize - 1) : (chunks[i].start + chunkSize - 1);
-        chunks[i].data.reserve(chunks[i].end - chunks[i].start + 1);
+        chunks[i].sink = &sink;
     }
 
     return chunks;
 }
 
-bool writeFile(const std::string& outputFile, const std::vector<Chunk>& chunks, uint64_t fileSize)
+// Claims the bytes of a response piece at `position` that nobody has written yet. Returns their count and where
+// they go; `skip` is the part of the piece the other copy of a hedged chunk already wrote. Call under writeMutex.
+static bool claimChunkData(Chunk& chunk, uint64_t position, size_t size, uint64_t& writeOffset, size_t& skip,
+                           size_t& count)
 {
-    std::ofstream out(outputFile, std::ios::binary);
-    if (!out)
+    std::lock_guard lock(chunk.mutex);
+    writeOffset = chunk.start + chunk.claimed;
+    // Only when the other copy failed a write and gave its claim back, leaving a gap before this piece
+    if (position > writeOffset)
+        return false;
+
+    const uint64_t available = chunk.end + 1 - writeOffset;
+    skip = static_cast<size_t>(std::min<uint64_t>(size, writeOffset - position));
+    count = static_cast<size_t>(std::min<uint64_t>(size - skip, available));
+    chunk.claimed += count;
+    return true;
+}
+
+bool appendChunkData(Chunk& chunk, const char* data, size_t size)
+{
+    uint64_t position = chunk.offset();
+    return appendChunkData(chunk, position, data, size);
+}
+
+bool appendChunkData(Chunk& chunk, uint64_t& position, const char* data, size_t size)
+{
+    std::lock_guard writer(chunk.writeMutex);
+    uint64_t writeOffset;
+    size_t skip;
+    size_t count;
+    if (!claimChunkData(chunk, position, size, writeOffset, skip, count))
+        return false;
+    position += size;
+
+    if (count == 0)
+        return true;
+
+    if (!chunk.sink->write(writeOffset, data + skip, count))
+    {
+        std::lock_guard lock(chunk.mutex);
+        chunk.claimed = chunk.received;
+        return false;
+    }
+
+    if (chunk.verifier)
+        chunk.verifier->append(chunk, data + skip, count);
+    chunk.received += count;
+    return true;
+}
+
+#ifdef __linux__
+bool spliceChunkData(Chunk& chunk, uint64_t& position, SplicePipe& pipe, size_t size)
+{
+    std::lock_guard writer(chunk.writeMutex);
+    uint64_t writeOffset;
+    size_t skip;
+    size_t count;
+    if (!claimChunkData(chunk, position, size, writeOffset, skip, count))
+        return false;
+    position += size;
+
+    // The pipe has to be empty for the next fill, so bytes that are not written here are read out and dropped
+    if (skip > 0 && !pipe.discard(skip))
+        return false;
+    if (count > 0 && !chunk.sink->writeFromPipe(writeOffset, pipe.source(), count))
+    {
+        std::lock_guard lock(chunk.mutex);
+        chunk.claimed = chunk.received;
+        return false;
+    }
+    if (skip + count < size && !pipe.discard(size - skip - count))
+        return false;
+
+    chunk.received += count;
+    return true;
+}
+#endif
+
+int addStopper(Chunk& chunk, std::function<void()> stop)
+{
+    std::lock_guard lock(chunk.mutex);
+    for (size_t slot = 0; slot < chunk.stoppers.size(); ++slot)
+    {
+        if (!chunk.stoppers[slot])
+        {
+            chunk.stoppers[slot] = std::move(stop);
+            return static_cast<int>(slot);
+        }
+    }
+    return -1;
+}
+
+void removeStopper(Chunk& chunk, int slot)
+{
+    if (slot < 0)
+        return;
+    std::lock_guard lock(chunk.mutex);
+    chunk.stoppers[slot] = nullptr;
+}
+
+void stopFetches(Chunk& chunk)
+{
+    std::lock_guard lock(chunk.mutex);
+    for (auto& stop : chunk.stoppers)
     {
-        std::cout << "Failed to open output file: " << outputFile << std::endl;
+        if (stop)
+            stop();
+    }
+}
+
+bool splitChunk(Chunk& chunk, Chunk& tail, uint64_t minSize)
+{
+    std::lock_guard lock(chunk.mutex);
+
+    const uint64_t from = chunk.start + chunk.claimed;
+    const uint64_t end = chunk.end;
+    if (end < from || end + 1 - from < 2 * minSize)
         return false;
+
+    const uint64_t splitAt = from + (end + 1 - from) / 2;
+    tail.start = splitAt;
+    tail.end = end;
+    tail.sink = chunk.sink;
+    tail.verifier = chunk.verifier;
+    chunk.end = splitAt - 1;
+    return true;
+}
+
+bool finishFile(FileSink& sink, uint64_t fileSize)
+{
+    // A pipe has no size to look at afterwards; what counts is how much of the file went out of it
+    if (OrderedOutput* output = sink.ordered())
+    {
+        const bool closed = output->close();
+        const uint64_t emitted = output->emitted();
+        sink.close();
+        if (emitted != fileSize)
+            std::cerr << "Emitted " << emitted << " of " << fileSize << " bytes to " << sink.path() << std::endl;
+        return closed && emitted == fileSize;
     }
 
-    for (const auto& chunk : chunks)
+    if (!sink.close())
     {
-        out.write(chunk.data.data(), chunk.data.size());
+        std::cerr << "Failed to close output file: " << sink.path() << std::endl;
+        return false;
     }
-    out.close();
 
-    return checkDownloadedFileSize(outputFile, fileSize);
+    return checkDownloadedFileSize(sink.path(), fileSize);
 }
 
 bool checkDownloadedFileSize(const std::string& filePath, uint64_t expectedFileSize)
@@ -41,7 +175,7 @@ bool checkDownloadedFileSize(const std::string& filePath, uint64_t expectedFileS
     try
     {
         const auto actualFileSize = std::filesystem::file_size(filePath);
-        std::cout << "File size is correct: actual=" << actualFileSize << ", expected=" << expectedFileSize << '\n';
+        std::cerr << "File size is correct: actual=" << actualFileSize << ", expected=" << expectedFileSize << '\n';
         return expectedFileSize == actualFileSize;
     }
     catch (const std::filesystem::filesystem_error& e)
@@ -0,0 +1,101 @@
+#include <include/ConcurrencyController.h>
+
+#include <algorithm>
+#include <iostream>
+
+static constexpr int INITIAL_CONNECTIONS = 2;
+// A level has to beat the previous one by this much to be kept
+static constexpr double MIN_GAIN = 0.05;
+// Failures in a sample that halve the limit: a real share of the ranges, and more than a stray one
+static constexpr double MAX_FAILURE_SHARE = 0.2;
+static constexpr uint64_t MIN_FAILURES = 2;
+// Samples spent at a settled level before probing one connection more
+static constexpr int HOLD_SAMPLES = 6;
+
+ConcurrencyController::ConcurrencyController(int maxConnections, bool adaptive)
+    : maxLimit(std::max(maxConnections, 1)), isAdaptive(adaptive),
+      current(adaptive ? std::min(INITIAL_CONNECTIONS, maxLimit) : maxLimit),
+      lastSample(std::chrono::steady_clock::now())
+{
+}
+
+bool ConcurrencyController::update(uint64_t bytes, uint64_t ranges, uint64_t failures)
+{
+    const auto now = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(now - lastSample).count();
+    const double rate = seconds > 0 ? (bytes - lastBytes) / seconds : 0.0;
+    const uint64_t newFailures = failures - lastFailures;
+    const uint64_t attempts = ranges - lastRanges + newFailures;
+    const bool failed = newFailures > 0;
+    const bool overloaded = newFailures >= MIN_FAILURES && newFailures >= MAX_FAILURE_SHARE * attempts;
+    lastSample = now;
+    lastBytes = bytes;
+    lastRanges = ranges;
+    lastFailures = failures;
+
+    if (!isAdaptive)
+        return false;
+
+    const int limit = current.load(std::memory_order_relaxed);
+    int next = limit;
+    if (overloaded)
+    {
+        // Multiplicative decrease: the server or the path is pushing back
+        next = std::max(1, limit / 2);
+        phase = Phase::Holding;
+        holding = HOLD_SAMPLES;
+        baselineLimit = next;
+        baselineRate = 0.0;
+    }
+    else if (settling > 0)
+    {
+        // New connections are still handshaking and ramping up, so this sample says little
+        --settling;
+        return false;
+    }
+    else if (phase == Phase::Holding)
+    {
+        baselineLimit = limit;
+        baselineRate = rate;
+        if (--holding <= 0 && limit < maxLimit && !failed)
+        {
+            next = limit + 1;
+            phase = Phase::Probing;
+        }
+    }
+    else if (failed)
+    {
+        // A stray failure: stop growing, but keep the level
+        baselineLimit = limit;
+        baselineRate = rate;
+        phase = Phase::Holding;
+        holding = HOLD_SAMPLES;
+    }
+    else if (rate > baselineRate * (1.0 + MIN_GAIN))
+    {
+        baselineLimit = limit;
+        baselineRate = rate;
+        next = std::min(maxLimit, phase == Phase::SlowStart ? limit * 2 : limit + 1);
+        if (next == limit)
+        {
+            phase = Phase::Holding;
+            holding = HOLD_SAMPLES;
+        }
+    }
+    else
+    {
+        // More connections did not pay off: go back to the last good level and stay there for a while
+        next = std::max(1, baselineLimit);
+        phase = Phase::Holding;
+        holding = HOLD_SAMPLES;
+    }
+
+    if (next == limit)
+        return false;
+
+    current.store(next, std::memory_order_relaxed);
+    settling = 1;
+    std::cerr << "Concurrency " << limit << " -> " << next << " (" << rate / 1024.0 / 1024.0 << " MiB/s"
+              << (overloaded ? ", ranges failing" : "") << ")" << std::endl;
+    return true;
+}
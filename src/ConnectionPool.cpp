@@ -0,0 +1,194 @@
+#include <include/ConnectionPool.h>
+
+#include <boost/asio/ssl/host_name_verification.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <openssl/err.h>
+
+#include <iostream>
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+using tcp = asio::ip::tcp;
+using asio::awaitable;
+using asio::use_awaitable;
+using Clock = std::chrono::steady_clock;
+using std::chrono::microseconds;
+
+// Same bundle the curl engine verifies against; the system store is the fallback
+static const auto CA_BUNDLE = "./../file_downloader/external/curl/cacert.pem";
+
+// Slot for the owning pool in SSL_CTX ex_data; asio keeps its verify callback in the app data slot and deletes it
+static int poolIndex()
+{
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+beast::tcp_stream& Connection::tcp()
+{
+    return std::visit([](auto& layer) -> beast::tcp_stream& { return beast::get_lowest_layer(layer); }, stream);
+}
+
+bool Connection::isOpen()
+{
+    return tcp().socket().is_open();
+}
+
+ConnectionPool::ConnectionPool(asio::io_context& ioContext, std::string host, std::string port, bool secure,
+                               const std::string& caFile, size_t maxIdle)
+    : ioContext(ioContext), hostName(std::move(host)), portName(std::move(port)), maxIdle(maxIdle)
+{
+    hostHeader = portName == (secure ? "443" : "80") ? hostName : hostName + ":" + portName;
+    if (!secure)
+        return;
+
+    tlsContext = std::make_unique<asio::ssl::context>(asio::ssl::context::tls_client);
+    tlsContext->set_verify_mode(asio::ssl::verify_peer);
+    boost::system::error_code error;
+    if (!caFile.empty())
+    {
+        tlsContext->load_verify_file(caFile, error);
+        if (error)
+            std::cerr << "Cannot load CA file " << caFile << ": " << error.message() << std::endl;
+    }
+    else
+    {
+        tlsContext->load_verify_file(CA_BUNDLE, error);
+        if (error)
+            tlsContext->set_default_verify_paths();
+    }
+
+    // Sessions are kept by the pool rather than OpenSSL's internal cache, which clients never consult
+    SSL_CTX* native = tlsContext->native_handle();
+    SSL_CTX_set_ex_data(native, poolIndex(), this);
+    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(native, onNewSession);
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    if (tlsSession)
+        SSL_SESSION_free(tlsSession);
+}
+
+void ConnectionPool::resolve()
+{
+    std::lock_guard lock(mutex);
+    if (endpoints)
+        return;
+
+    const auto started = Clock::now();
+    tcp::resolver resolver(ioContext);
+    endpoints = resolver.resolve(hostName, portName);
+    resolveDuration = std::chrono::duration_cast<microseconds>(Clock::now() - started);
+}
+
+awaitable<tcp::resolver::results_type> ConnectionPool::resolveAsync()
+{
+    {
+        std::lock_guard lock(mutex);
+        if (endpoints)
+            co_return *endpoints;
+    }
+
+    const auto started = Clock::now();
+    tcp::resolver resolver(ioContext);
+    auto results = co_await resolver.async_resolve(hostName, portName, use_awaitable);
+
+    // Another coroutine may have finished resolving while this one was suspended
+    std::lock_guard lock(mutex);
+    if (!endpoints)
+    {
+        endpoints = std::move(results);
+        resolveDuration = std::chrono::duration_cast<microseconds>(Clock::now() - started);
+    }
+    co_return *endpoints;
+}
+
+std::unique_ptr<Connection> ConnectionPool::takeIdle()
+{
+    std::lock_guard lock(mutex);
+    if (idle.empty())
+        return nullptr;
+
+    auto connection = std::move(idle.back());
+    idle.pop_back();
+    connection->reused = true;
+    ++reused;
+    return connection;
+}
+
+awaitable<std::unique_ptr<Connection>> ConnectionPool::acquire()
+{
+    if (auto connection = takeIdle())
+        co_return connection;
+    co_return co_await connect();
+}
+
+awaitable<std::unique_ptr<Connection>> ConnectionPool::connect()
+{
+    const auto resolved = co_await resolveAsync();
+
+    auto connection = tlsContext ? std::make_unique<Connection>(ioContext, *tlsContext)
+                                 : std::make_unique<Connection>(ioContext);
+    const auto started = Clock::now();
+    co_await connection->tcp().async_connect(resolved, use_awaitable);
+    const auto connected = Clock::now();
+    connection->connectTime = std::chrono::duration_cast<microseconds>(connected - started);
+    if (auto* tls = std::get_if<TlsStream>(&connection->stream))
+    {
+        co_await handshake(*tls);
+        connection->tlsTime = std::chrono::duration_cast<microseconds>(Clock::now() - connected);
+    }
+    ++opened;
+    co_return connection;
+}
+
+awaitable<void> ConnectionPool::handshake(TlsStream& stream)
+{
+    SSL* ssl = stream.native_handle();
+    // SNI, without which many virtual hosts present the wrong certificate
+    if (!SSL_set_tlsext_host_name(ssl, hostName.c_str()))
+        throw boost::system::system_error(static_cast<int>(ERR_get_error()), asio::error::get_ssl_category());
+    stream.set_verify_callback(asio::ssl::host_name_verification(hostName));
+
+    {
+        std::lock_guard lock(mutex);
+        if (tlsSession)
+            SSL_set_session(ssl, tlsSession);
+    }
+
+    co_await stream.async_handshake(asio::ssl::stream_base::client, use_awaitable);
+    if (SSL_session_reused(ssl))
+        ++resumedTls;
+    else
+        ++fullTls;
+}
+
+int ConnectionPool::onNewSession(SSL* ssl, SSL_SESSION* session)
+{
+    auto* pool = static_cast<ConnectionPool*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), poolIndex()));
+
+    std::lock_guard lock(pool->mutex);
+    if (pool->tlsSession)
+        SSL_SESSION_free(pool->tlsSession);
+    pool->tlsSession = session;
+    return 1; // the pool now owns the reference
+}
+
+void ConnectionPool::release(std::unique_ptr<Connection> connection)
+{
+    if (!connection || !connection->isOpen())
+        return;
+
+    std::lock_guard lock(mutex);
+    if (idle.size() < maxIdle)
+        idle.push_back(std::move(connection));
+}
+
+double ConnectionPool::reuseRatio() const
+{
+    const auto total = opened + reused;
+    return total ? static_cast<double>(reused) / total : 0.0;
+}
@@ -0,0 +1,138 @@
+#include <include/Crc32c.h>
+
+#include <array>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+// Reflected Castagnoli polynomial
+static constexpr uint32_t POLYNOMIAL = 0x82F63B78;
+
+// Slicing-by-8 tables for CPUs without a CRC32 instruction
+static const std::array<std::array<uint32_t, 256>, 8> TABLES = [] {
+    std::array<std::array<uint32_t, 256>, 8> tables{};
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = crc & 1 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+        tables[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        for (size_t t = 1; t < tables.size(); ++t)
+            tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+    }
+    return tables;
+}();
+
+static uint32_t crc32cTable(uint32_t crc, const unsigned char* data, size_t size)
+{
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        word ^= crc; // little-endian only, as is every target of this project
+        crc = TABLES[7][word & 0xFF] ^ TABLES[6][(word >> 8) & 0xFF] ^ TABLES[5][(word >> 16) & 0xFF] ^
+              TABLES[4][(word >> 24) & 0xFF] ^ TABLES[3][(word >> 32) & 0xFF] ^ TABLES[2][(word >> 40) & 0xFF] ^
+              TABLES[1][(word >> 48) & 0xFF] ^ TABLES[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = (crc >> 8) ^ TABLES[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2"))) static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data,
+                                                                 size_t size)
+{
+    uint64_t crc64 = crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+static const bool HAS_HARDWARE_CRC = [] {
+    __builtin_cpu_init(); // this may run before libgcc's own constructor
+    return __builtin_cpu_supports("sse4.2") != 0;
+}();
+#elif defined(CRC32C_ARM)
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size)
+{
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = __crc32cb(crc, *data++);
+    return crc;
+}
+
+static constexpr bool HAS_HARDWARE_CRC = true;
+#endif
+
+uint32_t crc32c(const void* data, size_t size, uint32_t crc)
+{
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    if (HAS_HARDWARE_CRC)
+        return ~crc32cHardware(crc, bytes, size);
+#endif
+    return ~crc32cTable(crc, bytes, size);
+}
+
+// a * b modulo the polynomial, both in the reflected bit order of the CRC
+static uint32_t multiplyModP(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t mask = 1u << 31; mask; mask >>= 1)
+    {
+        if (a & mask)
+            product ^= b;
+        b = b & 1 ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+// X_POWERS[k] is x^(2^k) modulo the polynomial, enough for any 64-bit byte count
+static const std::array<uint32_t, 67> X_POWERS = [] {
+    std::array<uint32_t, 67> powers{};
+    powers[0] = 1u << 30; // x^1
+    for (size_t k = 1; k < powers.size(); ++k)
+        powers[k] = multiplyModP(powers[k - 1], powers[k - 1]);
+    return powers;
+}();
+
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lengthB)
+{
+    // Appending lengthB bytes multiplies a's CRC by x^(8 * lengthB)
+    uint32_t shift = 1u << 31; // x^0
+    for (size_t k = 3; lengthB; lengthB >>= 1, ++k)
+    {
+        if (lengthB & 1)
+            shift = multiplyModP(X_POWERS[k], shift);
+    }
+    return multiplyModP(shift, crcA) ^ crcB;
+}
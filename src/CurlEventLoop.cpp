@@ -0,0 +1,189 @@
+#include "include/CurlEventLoop.h"
+
+#include <variant>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace asio = boost::asio;
+
+struct CurlEventLoop::Socket
+{
+    using Stream = asio::generic::stream_protocol::socket;
+    // QUIC connections run over UDP
+    using Datagram = asio::generic::datagram_protocol::socket;
+    using Handle = std::variant<Stream, Datagram>;
+
+    Socket(asio::io_context& ioContext, bool stream)
+        : handle(stream ? Handle(std::in_place_type<Stream>, ioContext)
+                        : Handle(std::in_place_type<Datagram>, ioContext))
+    {
+    }
+
+    Handle handle;
+    curl_socket_t fd = CURL_SOCKET_BAD;
+    // CURL_POLL_IN / CURL_POLL_OUT as last requested by curl
+    int wanted = 0;
+    // An async_wait is outstanding in that direction
+    bool reading = false;
+    bool writing = false;
+    bool closed = false;
+};
+
+CurlEventLoop::CurlEventLoop(asio::io_context& context)
+    : ioContext(context), executor(asio::make_strand(context)), timer(executor)
+{
+    multiHandle = curl_multi_init();
+    curl_multi_setopt(multiHandle, CURLMOPT_SOCKETFUNCTION, socketCallback);
+    curl_multi_setopt(multiHandle, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multiHandle, CURLMOPT_TIMERFUNCTION, timerCallback);
+    curl_multi_setopt(multiHandle, CURLMOPT_TIMERDATA, this);
+}
+
+CurlEventLoop::~CurlEventLoop()
+{
+    curl_multi_cleanup(multiHandle);
+    sockets.clear();
+}
+
+void CurlEventLoop::attach(CURL* easy)
+{
+    curl_easy_setopt(easy, CURLOPT_OPENSOCKETFUNCTION, openSocket);
+    curl_easy_setopt(easy, CURLOPT_OPENSOCKETDATA, this);
+    curl_easy_setopt(easy, CURLOPT_CLOSESOCKETFUNCTION, closeSocket);
+    curl_easy_setopt(easy, CURLOPT_CLOSESOCKETDATA, this);
+}
+
+curl_socket_t CurlEventLoop::openSocket(void* clientp, curlsocktype purpose, curl_sockaddr* address)
+{
+    auto* loop = static_cast<CurlEventLoop*>(clientp);
+    if (purpose != CURLSOCKTYPE_IPCXN)
+        return CURL_SOCKET_BAD;
+
+    auto socket = std::make_shared<Socket>(loop->ioContext, address->socktype == SOCK_STREAM);
+    boost::system::error_code error;
+    std::visit(
+        [&](auto& handle) {
+            using Protocol = typename std::decay_t<decltype(handle)>::protocol_type;
+            handle.open(Protocol(address->family, address->protocol), error);
+            if (!error)
+                socket->fd = handle.native_handle();
+        },
+        socket->handle);
+    if (error)
+        return CURL_SOCKET_BAD;
+
+    loop->sockets[socket->fd] = socket;
+    return socket->fd;
+}
+
+int CurlEventLoop::closeSocket(void* clientp, curl_socket_t fd)
+{
+    auto* loop = static_cast<CurlEventLoop*>(clientp);
+    const auto found = loop->sockets.find(fd);
+    if (found == loop->sockets.end())
+    {
+        // Opened before the handle was attached
+#ifdef _WIN32
+        return closesocket(fd);
+#else
+        return close(fd);
+#endif
+    }
+
+    auto socket = found->second;
+    loop->sockets.erase(found);
+    socket->closed = true;
+    boost::system::error_code error;
+    std::visit([&](auto& handle) { handle.close(error); }, socket->handle);
+    return error ? 1 : 0;
+}
+
+int CurlEventLoop::socketCallback(CURL*, curl_socket_t fd, int what, void* userp, void*)
+{
+    auto* loop = static_cast<CurlEventLoop*>(userp);
+    const auto found = loop->sockets.find(fd);
+    if (found == loop->sockets.end())
+        return 0;
+
+    auto& socket = found->second;
+    socket->wanted = what == CURL_POLL_REMOVE ? 0 : what & CURL_POLL_INOUT;
+
+    // A wait curl no longer cares about would keep the io_context busy; the cancelled handlers re-arm what is left
+    if ((socket->reading && !(socket->wanted & CURL_POLL_IN)) || (socket->writing && !(socket->wanted & CURL_POLL_OUT)))
+    {
+        boost::system::error_code error;
+        std::visit([&](auto& handle) { handle.cancel(error); }, socket->handle);
+    }
+
+    loop->watch(socket);
+    return 0;
+}
+
+int CurlEventLoop::timerCallback(CURLM*, long timeoutMs, void* userp)
+{
+    auto* loop = static_cast<CurlEventLoop*>(userp);
+    if (timeoutMs < 0)
+    {
+        loop->timer.cancel();
+        return 0;
+    }
+
+    // curl may not be re-entered from its own callback, so even a zero timeout goes through the io_context
+    loop->timer.expires_after(std::chrono::milliseconds(timeoutMs));
+    loop->timer.async_wait(asio::bind_executor(loop->executor, [loop](const boost::system::error_code& error) {
+        if (!error)
+            loop->socketAction(CURL_SOCKET_TIMEOUT, 0);
+    }));
+    return 0;
+}
+
+void CurlEventLoop::watch(const std::shared_ptr<Socket>& socket)
+{
+    const auto wait = [this, &socket](bool inbound) {
+        const auto type = inbound ? asio::socket_base::wait_read : asio::socket_base::wait_write;
+        auto handler = asio::bind_executor(executor, [this, socket, inbound](const boost::system::error_code& error) {
+            onReady(socket, inbound, error);
+        });
+        std::visit([&](auto& handle) { handle.async_wait(type, std::move(handler)); }, socket->handle);
+    };
+
+    if ((socket->wanted & CURL_POLL_IN) && !socket->reading)
+    {
+        socket->reading = true;
+        wait(true);
+    }
+    if ((socket->wanted & CURL_POLL_OUT) && !socket->writing)
+    {
+        socket->writing = true;
+        wait(false);
+    }
+}
+
+void CurlEventLoop::onReady(const std::shared_ptr<Socket>& socket, bool inbound, const boost::system::error_code& error)
+{
+    (inbound ? socket->reading : socket->writing) = false;
+    if (socket->closed)
+        return;
+
+    const int direction = inbound ? CURL_POLL_IN : CURL_POLL_OUT;
+    if (error != asio::error::operation_aborted && (socket->wanted & direction))
+    {
+        const int eventMask = error ? CURL_CSELECT_ERR : inbound ? CURL_CSELECT_IN : CURL_CSELECT_OUT;
+        socketAction(socket->fd, eventMask);
+    }
+
+    // The action may have closed the socket or changed what curl waits for
+    if (!socket->closed)
+        watch(socket);
+}
+
+void CurlEventLoop::socketAction(curl_socket_t fd, int eventMask)
+{
+    curl_multi_socket_action(multiHandle, fd, eventMask, &stillRunning);
+    if (activityHandler)
+        activityHandler();
+}
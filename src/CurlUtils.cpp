@@ -1,159 +1,931 @@
 #include "include/CurlUtils.h"
+#include "include/ConcurrencyController.h"
+#include "include/CurlEventLoop.h"
+#include "include/DeltaManifest.h"
+#include "include/DownloadVerifier.h"
+#include "include/RangeJournal.h"
+#include "include/RangeScheduler.h"
+#include "include/StreamWriter.h"
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <utility>
 
 static const auto CURL_CERT = "./../file_downloader/external/curl/cacert.pem";
+static constexpr int MAX_RETRIES = 3;
+// The head of the file a fast start holds in memory until the download is set up; the whole of a small file, and
+// enough of a large one that the other ranges are not held up long
+static constexpr uint64_t FIRST_RANGE_LIMIT = 1024 * 1024;
+static constexpr std::chrono::milliseconds WINDOW_POLL_INTERVAL{5};
 
 size_t curlWriteCallback(void* ptr, size_t objSize, size_t n, void* userData)
 {
-    auto* chunk = static_cast<Chunk*>(userData);
+    auto* transfer = static_cast<CurlTransfer*>(userData);
+    auto* chunk = transfer->chunk;
+
+    // The tail of this range was handed to another connection; stop the transfer
+    if (chunk->complete())
+        return 0;
 
     size_t totalSize = objSize * n;
-    chunk->data.insert(chunk->data.end(), (char*)ptr, (char*)ptr + totalSize);
+    if (!appendChunkData(*chunk, static_cast<const char*>(ptr), totalSize))
+        return 0; // aborts the transfer with CURLE_WRITE_ERROR
 
+    transfer->probe.onData(totalSize);
     return totalSize;
 }
 
-uint64_t getFileSizeByCurl(const std::string& url)
+size_t curlHeaderCallback(char* buffer, size_t objSize, size_t n, void* userData)
+{
+    auto* transfer = static_cast<CurlTransfer*>(userData);
+    size_t totalSize = objSize * n;
+
+    // With If-Range the server answers 200 with the whole file when the validator no longer matches. Without it a 200
+    // is the whole file too, which only lines up with a range at the start of the file
+    const std::string_view line(buffer, totalSize);
+    if (line.rfind("HTTP/", 0) == 0)
+    {
+        const auto space = line.find(' ');
+        if (space != std::string_view::npos && line.substr(space + 1, 3) == "200")
+        {
+            if (transfer->conditional)
+            {
+                transfer->remoteChanged = true;
+                return 0;
+            }
+            if (transfer->chunk && transfer->chunk->offset() != 0)
+            {
+                std::cerr << "Server ignored the range of chunk " << transfer->chunk->start << "-"
+                          << transfer->chunk->end << " and sent the whole file" << std::endl;
+                return 0;
+            }
+        }
+    }
+
+    return totalSize;
+}
+
+void configureProbeHandle(CURL* curl, const std::string& url)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
+    curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_CAINFO, CURL_CERT);
+}
+
+RemoteFileInfo probeResult(CURL* curl)
+{
+    RemoteFileInfo info;
+
+    curl_off_t fileSize = -1;
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &fileSize);
+    info.size = fileSize > 0 ? static_cast<uint64_t>(fileSize) : 0;
+    info.unknownSize = fileSize < 0;
+
+    curl_header* header = nullptr;
+    // Servers that take ranges without saying so are common, so only an explicit refusal counts
+    if (curl_easy_header(curl, "Accept-Ranges", 0, CURLH_HEADER, -1, &header) == CURLHE_OK)
+        info.acceptsRanges = !curl_strequal(header->value, "none");
+    if (curl_easy_header(curl, "ETag", 0, CURLH_HEADER, -1, &header) == CURLHE_OK)
+        info.etag = header->value;
+    if (curl_easy_header(curl, "Last-Modified", 0, CURLH_HEADER, -1, &header) == CURLHE_OK)
+        info.lastModified = header->value;
+
+    return info;
+}
+
+RemoteFileInfo probeFileByCurl(const std::string& url, const std::string& caFile, const RemoteFileInfo* cached,
+                               CURLSH* share)
 {
     CURL* curl = curl_easy_init();
-    double fileSize = 0;
+    RemoteFileInfo info;
 
     if (curl)
     {
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-        curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
-        curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_CAINFO, CURL_CERT);
+        configureProbeHandle(curl, url);
+        configureCaFile(curl, caFile);
+        configureShare(curl, share);
+
+        // Asks whether the copy in the download cache is still current
+        curl_slist* headers = nullptr;
+        if (cached && !cached->etag.empty())
+            headers = curl_slist_append(headers, ("If-None-Match: " + cached->etag).c_str());
+        if (cached && !cached->lastModified.empty())
+            headers = curl_slist_append(headers, ("If-Modified-Since: " + cached->lastModified).c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
         CURLcode res = curl_easy_perform(curl);
-        if (res == CURLE_OK)
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        if (res == CURLE_OK && cached && status == 304)
         {
-            curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &fileSize);
+            info = *cached;
+            info.notModified = true;
+        }
+        else if (res == CURLE_OK)
+        {
+            info = probeResult(curl);
         }
         curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
+    }
+    return info;
+}
+
+// Keeps the head of the file a fast start receives, up to the length it asked for
+static size_t firstRangeWriteCallback(void* ptr, size_t objSize, size_t n, void* userData)
+{
+    auto* first = static_cast<FirstRange*>(userData);
+    const size_t totalSize = objSize * n;
+    if (first->bytes.size() + totalSize > first->limit)
+        return 0; // a server that ignored the Range sends more than was asked for
+    first->bytes.append(static_cast<const char*>(ptr), totalSize);
+    return totalSize;
+}
+
+RemoteFileInfo fetchFirstRange(const std::string& url, const std::string& caFile, FirstRange& first,
+                               CURLSH* share)
+{
+    first.bytes.clear();
+    first.wholeFile = false;
+    CURL* curl = curl_easy_init();
+    if (!curl)
+        return {};
+
+    const std::string range = "0-" + std::to_string(first.limit - 1);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_CAINFO, CURL_CERT);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, firstRangeWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &first);
+    configureCaFile(curl, caFile);
+    configureShare(curl, share);
+
+    const CURLcode result = curl_easy_perform(curl);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+    RemoteFileInfo info;
+    curl_header* header = nullptr;
+    if (status == 206 && result == CURLE_OK &&
+        curl_easy_header(curl, "Content-Range", 0, CURLH_HEADER, -1, &header) == CURLHE_OK)
+    {
+        // "bytes 0-<last>/<size>"; a server that does not know the size answers "*" and gets probed instead
+        const std::string_view value(header->value);
+        const auto slash = value.rfind('/');
+        if (value.rfind("bytes 0-", 0) == 0 && slash != std::string_view::npos)
+            info.size = std::strtoull(header->value + slash + 1, nullptr, 10);
+        if (first.bytes.empty() || first.bytes.size() > info.size)
+            info.size = 0;
+    }
+    else if (status == 200 && (result == CURLE_OK || result == CURLE_WRITE_ERROR))
+    {
+        // The server ignored the Range: the head of the file only counts if it is the whole file
+        curl_off_t length = -1;
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        info.size = length > 0 ? static_cast<uint64_t>(length) : 0;
+        first.wholeFile = true;
+        if (first.bytes.size() != info.size)
+            first.bytes.clear();
+    }
+
+    if (info.size > 0)
+    {
+        if (curl_easy_header(curl, "ETag", 0, CURLH_HEADER, -1, &header) == CURLHE_OK)
+            info.etag = header->value;
+        if (curl_easy_header(curl, "Last-Modified", 0, CURLH_HEADER, -1, &header) == CURLHE_OK)
+            info.lastModified = header->value;
+    }
+    else
+    {
+        first.bytes.clear();
+        first.wholeFile = false;
     }
-    return fileSize;
+    curl_easy_cleanup(curl);
+    return info;
 }
 
-CURL* createEasyHandle(const std::string& url, Chunk& chunk)
+void setChunkRange(CurlTransfer& transfer, Chunk& chunk)
 {
-    CURL* easy = curl_easy_init();
+    transfer.chunk = &chunk;
+    transfer.probe.start();
+
+    std::string range = std::to_string(chunk.offset()) + "-" + std::to_string(chunk.end);
+    curl_easy_setopt(transfer.easy, CURLOPT_RANGE, range.c_str());
+}
+
+void configureCaFile(CURL* easy, const std::string& caFile)
+{
+    if (!caFile.empty())
+        curl_easy_setopt(easy, CURLOPT_CAINFO, caFile.c_str());
+}
+
+void configureShare(CURL* easy, CURLSH* share)
+{
+    if (share)
+        curl_easy_setopt(easy, CURLOPT_SHARE, share);
+}
+
+static int cancelCallback(void* userData, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    return isCancelled(static_cast<const Cancellation*>(userData)) ? 1 : 0;
+}
+
+void configureCancellation(CURL* easy, const Cancellation* cancellation)
+{
+    if (!cancellation)
+        return;
+    curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, cancelCallback);
+    curl_easy_setopt(easy, CURLOPT_XFERINFODATA, const_cast<Cancellation*>(cancellation));
+    curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
+}
+
+void configureRangeHandle(CurlTransfer& transfer, const std::string& url, Chunk& chunk, curl_slist* headers)
+{
+    CURL* easy = transfer.easy;
+    transfer.conditional = headers != nullptr;
+    transfer.remoteChanged = false;
     curl_easy_setopt(easy, CURLOPT_CAINFO, CURL_CERT);
     curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
     curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, curlWriteCallback);
-    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &chunk);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, curlHeaderCallback);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, &transfer);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, &transfer);
+    if (headers)
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+    setChunkRange(transfer, chunk);
+}
+
+// Points a handle at another source of the file, with that source's If-Range header
+static void setTransferSource(CurlTransfer& transfer, size_t source, const std::string& url, curl_slist* headers)
+{
+    transfer.source = source;
+    transfer.conditional = headers != nullptr;
+    curl_easy_setopt(transfer.easy, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(transfer.easy, CURLOPT_HTTPHEADER, headers);
+}
 
-    std::string range = std::to_string(chunk.start) + "-" + std::to_string(chunk.end);
-    curl_easy_setopt(easy, CURLOPT_RANGE, range.c_str());
+bool createEasyHandle(const std::string& url, CurlTransfer& transfer, Chunk& chunk, curl_slist* headers,
+                      const std::string& caFile, CURLSH* share, const Cancellation* cancellation)
+{
+    transfer.easy = curl_easy_init();
+    if (!transfer.easy)
+        return false;
 
-    return easy;
+    configureRangeHandle(transfer, url, chunk, headers);
+    configureCaFile(transfer.easy, caFile);
+    configureShare(transfer.easy, share);
+    configureCancellation(transfer.easy, cancellation);
+    return true;
 }
 
-bool downloadFileByRange(const std::string& url, Chunk& chunk)
+bool transferSucceeded(CURLcode, const Chunk& chunk)
 {
-    CURL* curl = createEasyHandle(url, chunk);
-    if (!curl)
+    // A complete chunk is done whatever curl says: a write error means its tail was stolen and the transfer was cut
+    // short on purpose, any other error came after the last byte the chunk still needed
+    return chunk.complete();
+}
+
+static std::chrono::microseconds transferTime(CURL* easy, CURLINFO info)
+{
+    curl_off_t time = 0;
+    curl_easy_getinfo(easy, info, &time);
+    return std::chrono::microseconds(time);
+}
+
+void recordTransfer(CurlTransfer& transfer, bool completed)
+{
+    // curl's times all count from the start of the transfer
+    RangeSample& sample = transfer.probe.sample;
+    sample.firstByte = transferTime(transfer.easy, CURLINFO_STARTTRANSFER_TIME_T);
+    sample.duration = transferTime(transfer.easy, CURLINFO_TOTAL_TIME_T);
+
+    long connects = 0;
+    curl_easy_getinfo(transfer.easy, CURLINFO_NUM_CONNECTS, &connects);
+    if (connects > 0)
+    {
+        const auto resolved = transferTime(transfer.easy, CURLINFO_NAMELOOKUP_TIME_T);
+        const auto connected = transferTime(transfer.easy, CURLINFO_CONNECT_TIME_T);
+        const auto handshaken = transferTime(transfer.easy, CURLINFO_APPCONNECT_TIME_T);
+        sample.dns = resolved;
+        sample.connect = connected - resolved;
+        if (handshaken > connected)
+            sample.tls = handshaken - connected;
+    }
+    transfer.probe.finish(completed);
+}
+
+HttpVersion supportedHttpVersion(HttpVersion requested)
+{
+    const auto features = curl_version_info(CURLVERSION_NOW)->features;
+    if (requested == HttpVersion::Http3 && !(features & CURL_VERSION_HTTP3))
+    {
+        std::cerr << "libcurl was built without HTTP/3, using HTTP/2 instead" << std::endl;
+        requested = HttpVersion::Http2;
+    }
+    if (requested == HttpVersion::Http2 && !(features & CURL_VERSION_HTTP2))
+    {
+        std::cerr << "libcurl was built without HTTP/2, using HTTP/1.1 instead" << std::endl;
+        requested = HttpVersion::Http1;
+    }
+    return requested;
+}
+
+void configureHttpVersion(CURL* easy, HttpVersion version)
+{
+    switch (version)
+    {
+    case HttpVersion::Http1:
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        break;
+    case HttpVersion::Http2:
+        // Plain http:// URLs stay on HTTP/1.1; h2c upgrades cannot be multiplexed until they complete
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        break;
+    case HttpVersion::Http3:
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_3);
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        break;
+    }
+}
+
+void configureMultiplexing(CURLM* multi, const DownloadOptions& options, int streams)
+{
+    if (options.httpVersion == HttpVersion::Http1)
+        return;
+
+    // curl opens another connection only once the existing ones carry their share of the streams
+    const int connections = std::max(1, options.multiplexConnections);
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(connections));
+    const long streamsPerConnection = (streams + connections - 1) / connections;
+    curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, streamsPerConnection);
+}
+
+bool downloadFileByRange(const std::string& url, Chunk& chunk, const std::string& caFile, CURLSH* share,
+                         const Cancellation* cancellation, Telemetry& telemetry, int connection)
+{
+    CurlTransfer transfer;
+    transfer.probe.attach(&telemetry, connection);
+    if (!createEasyHandle(url, transfer, chunk, nullptr, caFile, share, cancellation))
         return false;
 
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
+    CURLcode res = curl_easy_perform(transfer.easy);
+    const bool success = res == CURLE_OK && chunk.complete();
+    recordTransfer(transfer, success);
+    curl_easy_cleanup(transfer.easy);
 
-    return res == CURLE_OK;
+    return success;
 }
 
-bool downloadFileByCreatingThreads(const std::string& url, const std::string& outputFile, int parallelTasks,
-                                   uint64_t fileSize)
+bool downloadFileByCreatingThreads(MirrorSet& mirrors, const std::string& outputFile, int parallelTasks,
+                                   uint64_t fileSize, const std::string& caFile, CURLSH* share,
+                                   const Cancellation* cancellation, Telemetry& telemetry)
 {
-    auto chunks = createChunks(parallelTasks, fileSize);
+    FileSink sink;
+    if (!sink.open(outputFile, fileSize))
+        return false;
+
+    auto chunks = createChunks(parallelTasks, fileSize, sink);
     std::vector<std::thread> threads;
+    std::atomic<bool> success = true;
+    telemetry.begin(static_cast<int>(chunks.size()));
 
-    for (auto& chunk : chunks)
+    for (size_t i = 0; i < chunks.size(); ++i)
     {
-        threads.emplace_back([&url, &chunk]() {
-            if (!downloadFileByRange(url, chunk))
+        threads.emplace_back([&mirrors, &chunk = chunks[i], &success, &caFile, share, cancellation, &telemetry, i]() {
+            // With mirrors a failed chunk carries on from another source, where it left off
+            const int attempts = mirrors.size() > 1 ? MAX_RETRIES : 1;
+            for (int attempt = 0; attempt < attempts && !isCancelled(cancellation); ++attempt)
             {
-                std::cerr << "Chunk download failed: " << chunk.start << "-" << chunk.end << std::endl;
+                const size_t source = mirrors.pick(chunk.failedSource);
+                const auto started = std::chrono::steady_clock::now();
+                const uint64_t receivedBefore = chunk.received;
+                const bool downloaded = downloadFileByRange(mirrors.url(source), chunk, caFile, share, cancellation,
+                                                            telemetry, static_cast<int>(i));
+                mirrors.finish(source, chunk.received - receivedBefore, std::chrono::steady_clock::now() - started,
+                               downloaded);
+                if (downloaded)
+                    return;
+                chunk.failedSource = static_cast<int>(source);
             }
+            if (!isCancelled(cancellation))
+                std::cerr << "Chunk download failed: " << chunk.start << "-" << chunk.end << std::endl;
+            success = false;
         });
     }
 
     for (auto& t : threads)
         if (t.joinable())
             t.join();
+    telemetry.end();
 
-    return writeFile(outputFile, std::move(chunks), fileSize);
+    return success && finishFile(sink, fileSize);
 }
 
-bool performMultiDownload(CURLM* multiHandle)
+// Settles finished transfers with the scheduler and the sources, and parks their handles in `idle`, most recent
+// last
+void processFinishedTransfers(CURLM* multiHandle, RangeScheduler& scheduler, MirrorSet& mirrors, bool& remoteChanged,
+                              std::vector<CurlTransfer*>& idle)
 {
-    int stillRunning = 0;
-    curl_multi_perform(multiHandle, &stillRunning);
-
-    while (stillRunning)
+    int queued = 0;
+    while (CURLMsg* message = curl_multi_info_read(multiHandle, &queued))
     {
-        int numFds = 0;
-        CURLMcode code = curl_multi_poll(multiHandle, nullptr, 0, 1000, &numFds);
-        if (code != CURLM_OK)
+        if (message->msg != CURLMSG_DONE)
+            continue;
+
+        CURL* easy = message->easy_handle;
+        const CURLcode result = message->data.result;
+        CurlTransfer* transfer = nullptr;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, &transfer);
+        curl_multi_remove_handle(multiHandle, easy);
+
+        Chunk* chunk = transfer->chunk;
+        // A mirror whose copy changed is dropped and the range goes to the others; the download only fails once no
+        // source is left
+        if (transfer->remoteChanged && !mirrors.disable(transfer->source))
         {
-            std::cerr << "curl_multi_poll failed: " << curl_multi_strerror(code) << std::endl;
+            remoteChanged = true;
+            scheduler.abort();
+            continue;
+        }
+        transfer->remoteChanged = false;
+
+        const bool succeeded = transferSucceeded(result, *chunk);
+        recordTransfer(*transfer, succeeded);
+        mirrors.finish(transfer->source, transfer->probe.sample.bytes, transfer->probe.sample.duration, succeeded);
+        if (succeeded)
+        {
+            scheduler.complete(*chunk);
+        }
+        else
+        {
+            if (!scheduler.failed())
+            {
+                std::cerr << "Chunk [" << chunk->start << "-" << chunk->end << "] failed (attempt "
+                          << chunk->attempts + 1 << "): " << curl_easy_strerror(result) << std::endl;
+            }
+            chunk->failedSource = static_cast<int>(transfer->source);
+            transfer->probe.retry();
+            scheduler.fail(*chunk);
+        }
+        idle.push_back(transfer);
+    }
+}
+
+bool downloadFileByMultiCURL(boost::asio::io_context& ioContext, MirrorSet& mirrors, const std::string& outputFile,
+                             int parallelTasks, const RemoteFileInfo& remote, const DownloadOptions& options,
+                             CURLSH* share, Telemetry& telemetry, const FirstRange& first)
+{
+    // A server that ignored the Range of a fast start cannot fill gaps either: the file starts over as one range,
+    // whose 200 answer starts at the right offset, and a failure cannot be retried from the middle
+    uint64_t unitSize = RangeScheduler::chooseUnitSize(remote.size, parallelTasks, options.chunkSize);
+    int maxRetries = MAX_RETRIES;
+    if (first.wholeFile)
+    {
+        std::cerr << "The server ignores Range requests, downloading over a single connection" << std::endl;
+        parallelTasks = 1;
+        unitSize = remote.size;
+        maxRetries = 1;
+    }
+
+    FileSink sink;
+    RangeJournal journal(outputFile);
+    auto missing = journal.open(sink, remote, options.resume && !first.wholeFile, options.reorderWindow,
+                                options.outputConsumer);
+    if (!missing)
+        return false;
+    if (!options.seedFile.empty() && !first.wholeFile && !sink.ordered() &&
+        !seedDownload(options, remote.size, sink, journal, *missing))
+    {
+        return false;
+    }
+    if (sink.ordered() && !first.wholeFile)
+    {
+        unitSize = RangeScheduler::chooseUnitSize(remote.size, parallelTasks, options.chunkSize,
+                                                  sink.ordered()->window());
+    }
+
+    // The head of the file a fast start already has is written as a unit of its own, while it is still missing
+    std::vector<ByteRange> ranges = *missing;
+    std::optional<ByteRange> firstRange;
+    if (!first.bytes.empty() && !ranges.empty() && ranges.front().start == 0)
+    {
+        firstRange = ByteRange{0, std::min<uint64_t>(first.bytes.size() - 1, ranges.front().end)};
+        if (firstRange->end == ranges.front().end)
+            ranges.erase(ranges.begin());
+        else
+            ranges.front().start = firstRange->end + 1;
+    }
+
+    RangeScheduler scheduler(ranges, unitSize, sink, maxRetries);
+    Chunk* adopted = firstRange ? scheduler.adopt(*firstRange) : nullptr;
+    // No new units once cancelled; the transfers abort on their own, see configureCancellation()
+    Cancellation::Scope cancelScope(options.cancellation, [&scheduler] { scheduler.abort(); });
+    DownloadVerifier verifier(options, remote.size);
+    if (sink.ordered())
+        verifier.attach(*sink.ordered());
+    if (!verifier.start(sink.path(), &scheduler, *missing))
+        return false;
+    if (adopted)
+    {
+        if (!appendChunkData(*adopted, first.bytes.data(), adopted->size()))
             return false;
+        scheduler.complete(*adopted);
+    }
+    journal.startFlushing(scheduler);
+
+    // Every source is checked against its own validator, mirrors need not agree on Last-Modified. The 200 of a
+    // server that ignores Range is expected, not a sign of a changed file
+    std::vector<curl_slist*> headers(mirrors.size(), nullptr);
+    for (size_t i = 0; i < mirrors.size() && !first.wholeFile; ++i)
+    {
+        if (const auto validator = mirrors.remote(i).validator(); !validator.empty())
+            headers[i] = curl_slist_append(nullptr, ("If-Range: " + validator).c_str());
+    }
+
+    CurlEventLoop eventLoop(ioContext);
+    CURLM* multiHandle = eventLoop.multi();
+    configureMultiplexing(multiHandle, options, parallelTasks);
+    std::vector<CurlTransfer> transfers(parallelTasks);
+    telemetry.begin(parallelTasks);
+    ConcurrencyController controller(parallelTasks, options.adaptive);
+    if (controller.adaptive())
+        telemetry.recordConcurrency(controller.limit());
+
+    std::vector<CurlTransfer*> idle;
+    for (size_t i = transfers.size(); i-- > 0;)
+    {
+        transfers[i].probe.attach(&telemetry, static_cast<int>(i));
+        idle.push_back(&transfers[i]);
+    }
+
+    // Hands out units until the controller's limit of transfers runs. A finished handle keeps its connection
+    // alive, so the one parked last is reused first. Units waiting for the reorder window of an ordered output are
+    // tried again after a moment; the timer also keeps the io_context running meanwhile.
+    boost::asio::steady_timer windowTimer(eventLoop.strand());
+    std::function<void()> startTransfers = [&]() {
+        while (transfers.size() - idle.size() < static_cast<size_t>(controller.limit()) && !idle.empty())
+        {
+            Chunk* chunk = scheduler.next();
+            if (!chunk)
+            {
+                if (scheduler.waitingForWindow())
+                {
+                    windowTimer.expires_after(WINDOW_POLL_INTERVAL);
+                    windowTimer.async_wait([&](const boost::system::error_code& error) {
+                        if (!error)
+                            startTransfers();
+                    });
+                }
+                break;
+            }
+
+            CurlTransfer& transfer = *idle.back();
+            const size_t source = mirrors.pick(chunk->failedSource);
+            if (transfer.easy)
+            {
+                if (transfer.source != source)
+                    setTransferSource(transfer, source, mirrors.url(source), headers[source]);
+                setChunkRange(transfer, *chunk);
+            }
+            else
+            {
+                if (!createEasyHandle(mirrors.url(source), transfer, *chunk, headers[source], options.caFile, share,
+                                      options.cancellation))
+                {
+                    mirrors.finish(source, 0, {}, false);
+                    break;
+                }
+                transfer.source = source;
+                configureHttpVersion(transfer.easy, options.httpVersion);
+                eventLoop.attach(transfer.easy);
+            }
+            idle.pop_back();
+            curl_multi_add_handle(multiHandle, transfer.easy);
         }
-        curl_multi_perform(multiHandle, &stillRunning);
+    };
+    startTransfers();
+
+    bool remoteChanged = false;
+    boost::asio::steady_timer ticker(eventLoop.strand());
+    eventLoop.onActivity([&]() {
+        processFinishedTransfers(multiHandle, scheduler, mirrors, remoteChanged, idle);
+        if (!remoteChanged)
+        {
+            startTransfers();
+            // Nothing left to run: stop sampling so the io_context can run dry
+            if (idle.size() == transfers.size())
+                ticker.cancel();
+            return;
+        }
+
+        // Without transfers curl drops its sockets and timer, and the io_context runs out of work
+        ticker.cancel();
+        windowTimer.cancel();
+        for (auto& transfer : transfers)
+            if (transfer.easy)
+                curl_multi_remove_handle(multiHandle, transfer.easy);
+    });
+
+    // Samples the goodput on the loop's strand; handles above a lowered limit are parked as they finish
+    std::function<void()> sampleConcurrency = [&]() {
+        ticker.expires_after(ConcurrencyController::SAMPLE_INTERVAL);
+        ticker.async_wait([&](const boost::system::error_code& error) {
+            if (error || remoteChanged || idle.size() == transfers.size())
+                return;
+            if (controller.update(telemetry.totalBytes(), telemetry.totalRanges(), telemetry.totalRetries()))
+            {
+                telemetry.recordConcurrency(controller.limit());
+                startTransfers();
+            }
+            sampleConcurrency();
+        });
+    };
+    if (controller.adaptive())
+        sampleConcurrency();
+
+    ioContext.restart();
+    ioContext.run();
+    telemetry.end();
+    const bool success = !remoteChanged && scheduler.finished();
+
+    for (auto& transfer : transfers)
+    {
+        if (!transfer.easy)
+            continue;
+
+        curl_multi_remove_handle(multiHandle, transfer.easy);
+        curl_easy_cleanup(transfer.easy);
     }
+    for (auto* sourceHeaders : headers)
+        curl_slist_free_all(sourceHeaders);
 
-    return true;
+    if (remoteChanged)
+    {
+        std::cerr << "Download failed: the remote file changed while downloading, progress discarded" << std::endl;
+        journal.discard();
+        return false;
+    }
+
+    journal.finish(success);
+    if (!success)
+    {
+        if (isCancelled(options.cancellation))
+            std::cerr << "Download cancelled, its progress is kept for a resume" << std::endl;
+        else
+            std::cerr << "Download failed: some chunks could not be retrieved" << std::endl;
+        return false;
+    }
+
+    std::cerr << "Downloaded " << scheduler.unitCount() << " ranges, " << scheduler.stealCount()
+              << " of them stolen from slower connections" << std::endl;
+    mirrors.printSummary();
+    // An ordered output emits the last verified blocks and the bytes its digest is taken from on closing
+    return verifier.finish(finishFile(sink, remote.size));
 }
 
-bool downloadFileByMultiCURL(const std::string& url, const std::string& outputFile, int parallelTasks,
-                             uint64_t fileSize)
+// The one transfer of a streamed download
+struct StreamTransfer
 {
-    auto chunks = createChunks(parallelTasks, fileSize);
+    CurlTransfer transfer;
+    StreamWriter* writer = nullptr;
+    bool decode = false;
+    bool started = false;
+};
 
-    CURLM* multiHandle = curl_multi_init();
-    std::vector<CURL*> easyHandles;
+static size_t streamWriteCallback(void* ptr, size_t objSize, size_t n, void* userData)
+{
+    auto* stream = static_cast<StreamTransfer*>(userData);
+    const size_t totalSize = objSize * n;
+    if (!stream->started)
+    {
+        // The headers are all in by the first body bytes
+        stream->started = true;
+        stream->transfer.probe.onResponse();
+        curl_header* header = nullptr;
+        const bool encoded =
+            curl_easy_header(stream->transfer.easy, "Content-Encoding", 0, CURLH_HEADER, -1, &header) == CURLHE_OK;
+        if (stream->decode && !stream->writer->setEncoding(encoded ? header->value : ""))
+            return 0;
+    }
+
+    if (!stream->writer->append(static_cast<const char*>(ptr), totalSize))
+        return 0;
+    stream->transfer.probe.onData(totalSize);
+    return totalSize;
+}
 
-    for (auto& chunk : chunks)
+// One blocking GET for the whole file, for servers that send no length or take no Range requests
+bool streamFileByCurl(MirrorSet& mirrors, const std::string& outputFile, const RemoteFileInfo& remote,
+                      const DownloadOptions& options, CURLSH* share, Telemetry& telemetry)
+{
+    if (options.inOrder(outputFile) && DownloadVerifier(options, remote.size).enabled())
     {
-        CURL* easy = createEasyHandle(url, chunk);
-        easyHandles.push_back(easy);
-        curl_multi_add_handle(multiHandle, easy);
+        std::cerr << "A streamed file is checked by reading it back, which a pipe does not allow" << std::endl;
+        return false;
     }
 
-    bool success = performMultiDownload(multiHandle);
+    const size_t source = mirrors.pick();
+    telemetry.begin(1);
+    StreamTransfer stream;
+    stream.transfer.probe.attach(&telemetry, 0);
+    stream.decode = options.decodeContent;
+    curl_slist* headers = nullptr;
+    if (options.decodeContent)
+    {
+        const std::string acceptEncoding = std::string("Accept-Encoding: ") + StreamWriter::acceptedEncodings();
+        headers = curl_slist_append(nullptr, acceptEncoding.c_str());
+    }
 
-    for (CURL* easy : easyHandles)
+    bool success = false;
+    uint64_t size = 0;
+    const auto started = std::chrono::steady_clock::now();
+    // Without ranges there is nothing to resume from, a broken stream starts over. A pipe stays open across the
+    // attempts and skips what it already emitted
+    FileSink sink;
+    const bool pipe = options.inOrder(outputFile);
+    const int attempts =
+        pipe && !sink.openOrdered(outputFile, options.reorderWindow, options.outputConsumer) ? 0 : MAX_RETRIES;
+    for (int attempt = 1; attempt <= attempts && !success && !isCancelled(options.cancellation); ++attempt)
     {
-        curl_multi_remove_handle(multiHandle, easy);
+        if (!pipe && !sink.open(outputFile, remote.size))
+            break;
+        StreamWriter writer(sink, remote.size);
+        stream.writer = &writer;
+        stream.started = false;
+
+        CURL* easy = stream.transfer.easy = curl_easy_init();
+        if (!easy)
+            break;
+        curl_easy_setopt(easy, CURLOPT_URL, mirrors.url(source).c_str());
+        curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(easy, CURLOPT_CAINFO, CURL_CERT);
+        // curl would only decode with CURLOPT_ACCEPT_ENCODING; the writer does it so both engines behave the same
+        curl_easy_setopt(easy, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, streamWriteCallback);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, &stream);
+        configureCaFile(easy, options.caFile);
+        configureShare(easy, share);
+        configureCancellation(easy, options.cancellation);
+
+        stream.transfer.probe.start();
+        const CURLcode result = curl_easy_perform(easy);
+        success = result == CURLE_OK && writer.finish();
+        if (result != CURLE_OK)
+            std::cerr << "Stream request failed: " << curl_easy_strerror(result) << std::endl;
+
+        // A length the server announced has to arrive in full, unless it was the length of the encoded body
+        if (success && remote.size > 0 && !writer.decoding() && writer.size() != remote.size)
+        {
+            std::cerr << "Stream ended after " << writer.size() << " of " << remote.size << " bytes" << std::endl;
+            success = false;
+        }
+        success = success && sink.close();
+        size = writer.size();
+        recordTransfer(stream.transfer, success);
         curl_easy_cleanup(easy);
+        if (!success)
+        {
+            std::cerr << "Stream attempt " << attempt << " failed" << std::endl;
+            stream.transfer.probe.retry();
+        }
+    }
+    curl_slist_free_all(headers);
+    telemetry.end();
+    mirrors.finish(source, size, std::chrono::steady_clock::now() - started, success);
+
+    if (!success)
+    {
+        std::cerr << "Download failed: the stream could not be retrieved" << std::endl;
+        return false;
     }
-    curl_multi_cleanup(multiHandle);
 
-    return success && writeFile(outputFile, std::move(chunks), fileSize);
+    std::cerr << "Streamed " << size << " bytes over one connection" << std::endl;
+    // The stream cannot be fetched again block by block, so the finished file is read back once instead
+    DownloadVerifier verifier(options, size);
+    return verifier.start(outputFile, nullptr, {}) && verifier.finish(true);
 }
 
 CurlDownloader::~CurlDownloader()
 {
-    curl_global_cleanup();
+    // Only the reference setUp() took; other downloads in the process may still be using curl
+    if (globalInit)
+        curl_global_cleanup();
 }
 
 void CurlDownloader::setUp()
 {
-    curl_global_init(CURL_GLOBAL_ALL);
+    if (!globalInit)
+        globalInit = curl_global_init(CURL_GLOBAL_ALL) == CURLE_OK;
+}
+
+void CurlDownloader::setOptions(const DownloadOptions& value)
+{
+    Downloader::setOptions(value);
+    std::vector<std::string> urls{url};
+    urls.insert(urls.end(), options.mirrors.begin(), options.mirrors.end());
+    mirrors = std::make_unique<MirrorSet>(std::move(urls));
 }
 
 size_t CurlDownloader::getFileSize()
 {
-    return getFileSizeByCurl(url);
+    firstRange = {};
+    if (lookUpCache(url))
+        return remote.size;
+
+    // A cached copy to revalidate takes the conditional probe, which a range cannot stand in for
+    const RemoteFileInfo* known = cached ? &cached->remote : nullptr;
+    if (options.fastStart && !threadPerChunk && mirrors->size() == 1 && !known)
+    {
+        firstRange.limit = std::clamp(options.chunkSize, RangeScheduler::MIN_UNIT_SIZE, FIRST_RANGE_LIMIT);
+        if (const auto info = fetchFirstRange(url, options.caFile, firstRange, share); info.size > 0)
+        {
+            remote = mirrors->agree({info});
+            return remote.size;
+        }
+        std::cerr << "The first range gave no file size, probing it instead" << std::endl;
+    }
+
+    std::vector<RemoteFileInfo> probes;
+    for (size_t i = 0; i < mirrors->size(); ++i)
+        probes.push_back(probeFileByCurl(mirrors->url(i), options.caFile, known, share));
+    remote = mirrors->agree(probes);
+    return remote.size;
 }
 
 bool CurlDownloader::downloadFile(const std::string& outputFile, int parallelTasks, uint64_t fileSize)
 {
-    // Multithreaded approach
-    // std::cout << "Downloading file via threads creation..." << std::endl;
-    // return downloadFileByCreatingThreads(url, outputFile, parallelTasks, fileSize);
+    if (remote.notModified)
+    {
+        if (placeCached(outputFile))
+            return true;
+        fileSize = getFileSize();
+    }
+
+    const bool success = fetchFile(outputFile, parallelTasks, fileSize);
+    if (success)
+        storeInCache(url, outputFile);
+    return success;
+}
+
+bool CurlDownloader::fetchFile(const std::string& outputFile, int parallelTasks, uint64_t fileSize)
+{
+    if (remote.singleStream() && !firstRange.wholeFile)
+    {
+        std::cerr << "Streaming file via CURL over one connection..." << std::endl;
+        return streamFileByCurl(*mirrors, outputFile, remote, options, share, metrics);
+    }
+
+    if (threadPerChunk)
+    {
+        std::cerr << "Downloading file via threads creation..." << std::endl;
+        const bool downloaded =
+            downloadFileByCreatingThreads(*mirrors, outputFile, parallelTasks, fileSize, options.caFile, share,
+                                          options.cancellation, metrics);
+        mirrors->printSummary();
+        if (!downloaded)
+            return false;
+
+        // These chunks cannot be fetched again block by block, so the finished file is read back once instead
+        DownloadVerifier verifier(options, fileSize);
+        return verifier.start(outputFile, nullptr, {}) && verifier.finish(true);
+    }
 
-    // Multi CURL approach
-    std::cout << "Downloading file via multi CURL creation..." << std::endl;
-    return downloadFileByMultiCURL(url, outputFile, parallelTasks, fileSize);
+    std::cerr << "Downloading file via multi CURL on the event loop..." << std::endl;
+    RemoteFileInfo file = remote;
+    file.size = fileSize;
+
+    DownloadOptions transferOptions = options;
+    transferOptions.httpVersion = supportedHttpVersion(options.httpVersion);
+    bool allSecure = true;
+    for (size_t i = 0; i < mirrors->size(); ++i)
+        allSecure = allSecure && mirrors->url(i).rfind("https://", 0) == 0;
+    if (transferOptions.httpVersion != HttpVersion::Http1 && !allSecure)
+    {
+        // Capping a plain HTTP/1.1 host at a few connections would only serialize the ranges
+        std::cerr << "HTTP/2 and HTTP/3 need an https:// URL, using HTTP/1.1" << std::endl;
+        transferOptions.httpVersion = HttpVersion::Http1;
+    }
+    // What a fast start received only fits the size it reported
+    FirstRange first = std::exchange(firstRange, {});
+    if (fileSize != remote.size)
+        first = {};
+    return downloadFileByMultiCURL(ioContext, *mirrors, outputFile, parallelTasks, file, transferOptions, share,
+                                   metrics, first);
 }
@@ -0,0 +1,279 @@
+#include <include/DeltaManifest.h>
+#include <include/DownloadVerifier.h>
+#include <include/RangeJournal.h>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+
+static constexpr auto DELTA_HEADER = "file_downloader-delta 1";
+// Seed bytes read at a time; the window of one block rolls through them
+static constexpr size_t SEED_BUFFER_SIZE = 8 * 1024 * 1024;
+// Bits of the table that rules out most weak checksums before the hash map is asked, small enough for the L2 cache
+static constexpr int FILTER_BITS = 20;
+
+static uint32_t filterSlot(uint32_t weak)
+{
+    return (weak * 0x9E3779B1u) >> (32 - FILTER_BITS);
+}
+
+uint32_t rollingChecksum(const char* data, size_t size)
+{
+    // Plain sums over the block, a loop the compiler vectorizes
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        a += bytes[i];
+        b += static_cast<uint32_t>(size - i) * bytes[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+static DeltaManifest::Strong strongChecksum(const char* data, size_t size)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    EVP_Digest(data, size, digest, &length, EVP_sha256(), nullptr);
+    DeltaManifest::Strong strong;
+    std::memcpy(strong.data(), digest, strong.size());
+    return strong;
+}
+
+std::optional<DeltaManifest> DeltaManifest::load(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Cannot open delta manifest " << path << std::endl;
+        return std::nullopt;
+    }
+
+    DeltaManifest manifest;
+    std::string line;
+    std::string keyword;
+    if (!std::getline(in, line) || line != DELTA_HEADER ||
+        !std::getline(in, line) || !(std::istringstream(line) >> keyword >> manifest.size) || keyword != "size" ||
+        !std::getline(in, line) || !(std::istringstream(line) >> keyword >> manifest.block) ||
+        keyword != "block-size" || manifest.block == 0)
+    {
+        std::cerr << "Delta manifest " << path << " does not start with its header, size and block-size lines"
+                  << std::endl;
+        return std::nullopt;
+    }
+
+    while (std::getline(in, line))
+    {
+        if (line.empty())
+            continue;
+        std::istringstream fields(line);
+        std::string weakHex;
+        std::string strongHex;
+        Strong strong;
+        bool valid = (fields >> weakHex >> strongHex) && weakHex.size() == 8 && strongHex.size() == 2 * STRONG_SIZE;
+        for (size_t i = 0; valid && i < STRONG_SIZE; ++i)
+        {
+            unsigned int byte = 0;
+            valid = std::sscanf(strongHex.c_str() + 2 * i, "%2x", &byte) == 1;
+            strong[i] = static_cast<unsigned char>(byte);
+        }
+        unsigned int weakValue = 0;
+        valid = valid && std::sscanf(weakHex.c_str(), "%8x", &weakValue) == 1;
+        if (!valid)
+        {
+            std::cerr << "Invalid block in " << path << ": " << line << std::endl;
+            return std::nullopt;
+        }
+        manifest.weak.push_back(weakValue);
+        manifest.strong.push_back(strong);
+    }
+
+    const uint64_t blockCount = (manifest.size + manifest.block - 1) / manifest.block;
+    if (manifest.weak.size() != blockCount)
+    {
+        std::cerr << "Delta manifest " << path << " lists " << manifest.weak.size() << " blocks, the file has "
+                  << blockCount << std::endl;
+        return std::nullopt;
+    }
+    return manifest;
+}
+
+std::optional<DeltaManifest> DeltaManifest::generate(const std::string& file, uint64_t blockSize)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in || blockSize == 0)
+    {
+        std::cerr << "Cannot read " << file << std::endl;
+        return std::nullopt;
+    }
+
+    DeltaManifest manifest;
+    manifest.block = blockSize;
+    std::vector<char> buffer(blockSize);
+    while (in.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || in.gcount() > 0)
+    {
+        const auto length = static_cast<size_t>(in.gcount());
+        manifest.weak.push_back(rollingChecksum(buffer.data(), length));
+        manifest.strong.push_back(strongChecksum(buffer.data(), length));
+        manifest.size += length;
+    }
+    return manifest;
+}
+
+bool DeltaManifest::save(const std::string& path) const
+{
+    std::ofstream out(path);
+    out << DELTA_HEADER << '\n' << "size " << size << '\n' << "block-size " << block << '\n';
+    for (size_t i = 0; i < weak.size(); ++i)
+    {
+        char weakHex[9];
+        std::snprintf(weakHex, sizeof(weakHex), "%08x", weak[i]);
+        out << weakHex << ' ' << toHex(strong[i].data(), strong[i].size()) << '\n';
+    }
+    out.flush();
+    if (!out)
+    {
+        std::cerr << "Cannot write delta manifest " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::vector<ByteRange> DeltaManifest::copyFromSeed(const std::string& seedPath, FileSink& sink,
+                                                   const std::vector<ByteRange>& missing) const
+{
+    // Blocks of full length that are wanted, by weak checksum
+    std::unordered_map<uint32_t, std::vector<size_t>> wanted;
+    std::vector<uint64_t> filter((size_t{1} << FILTER_BITS) / 64);
+    size_t wantedCount = 0;
+    for (const auto& range : missing)
+    {
+        for (uint64_t index = (range.start + block - 1) / block; (index + 1) * block <= range.end + 1; ++index)
+        {
+            wanted[weak[index]].push_back(static_cast<size_t>(index));
+            const uint32_t slot = filterSlot(weak[index]);
+            filter[slot / 64] |= uint64_t{1} << (slot % 64);
+            ++wantedCount;
+        }
+    }
+
+    std::vector<ByteRange> copied;
+    std::ifstream seed(seedPath, std::ios::binary);
+    if (!seed)
+    {
+        std::cerr << "Cannot open seed file " << seedPath << std::endl;
+        return copied;
+    }
+
+    // The window [begin, begin + block) rolls through the buffer, which is refilled once it holds no more than a
+    // block past the window's start
+    std::vector<char> buffer(std::max<size_t>(SEED_BUFFER_SIZE, 2 * block));
+    size_t begin = 0;
+    size_t end = 0;
+    bool atEnd = false;
+    auto fill = [&] {
+        std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+        seed.read(buffer.data() + end, static_cast<std::streamsize>(buffer.size() - end));
+        end += static_cast<size_t>(seed.gcount());
+        atEnd = seed.gcount() == 0 || !seed;
+    };
+
+    uint32_t a = 0;
+    uint32_t b = 0;
+    bool fresh = true;
+    while (copied.size() < wantedCount)
+    {
+        if (end - begin <= block && !atEnd)
+            fill();
+        if (end - begin < block)
+            break;
+
+        const char* window = buffer.data() + begin;
+        if (fresh)
+        {
+            const uint32_t initial = rollingChecksum(window, block);
+            a = initial & 0xFFFF;
+            b = initial >> 16;
+            fresh = false;
+        }
+
+        bool matched = false;
+        const uint32_t checksum = (a & 0xFFFF) | (b << 16);
+        const uint32_t slot = filterSlot(checksum);
+        const auto candidates =
+            filter[slot / 64] & (uint64_t{1} << (slot % 64)) ? wanted.find(checksum) : wanted.end();
+        if (candidates != wanted.end())
+        {
+            // The same content may be wanted at several places, e.g. blocks of zeros
+            const Strong confirmed = strongChecksum(window, block);
+            auto& indices = candidates->second;
+            for (auto index = indices.begin(); index != indices.end();)
+            {
+                if (strong[*index] != confirmed)
+                {
+                    ++index;
+                    continue;
+                }
+                if (!sink.write(*index * block, window, block))
+                    return copied;
+                copied.push_back({*index * block, (*index + 1) * block - 1});
+                index = indices.erase(index);
+                matched = true;
+            }
+        }
+
+        if (matched)
+        {
+            begin += block;
+            fresh = true;
+            continue;
+        }
+        if (end - begin == block)
+            break;
+
+        // Drop the window's first byte, take in the one after it
+        const auto out = static_cast<unsigned char>(window[0]);
+        const auto in = static_cast<unsigned char>(window[block]);
+        a += in - out;
+        b += a - static_cast<uint32_t>(block) * out;
+        ++begin;
+    }
+    return copied;
+}
+
+bool seedDownload(const DownloadOptions& options, uint64_t fileSize, FileSink& sink, RangeJournal& journal,
+                  std::vector<ByteRange>& missing)
+{
+    const auto manifest = DeltaManifest::load(options.deltaManifest);
+    if (!manifest)
+        return false;
+    if (manifest->fileSize() != fileSize)
+    {
+        std::cerr << "The delta manifest describes a file of " << manifest->fileSize() << " bytes, the server has "
+                  << fileSize << std::endl;
+        return false;
+    }
+
+    const auto copied = manifest->copyFromSeed(options.seedFile, sink, missing);
+    // What was neither present before nor copied now
+    auto present = missingRanges(mergeRanges(missing), fileSize);
+    present.insert(present.end(), copied.begin(), copied.end());
+    missing = missingRanges(mergeRanges(std::move(present)), fileSize);
+    journal.recordPresent(copied);
+
+    uint64_t fetched = 0;
+    for (const auto& range : missing)
+        fetched += range.end - range.start + 1;
+    std::cerr << "Copied " << copied.size() << " blocks (" << copied.size() * manifest->blockSize()
+              << " bytes) from the seed " << options.seedFile << ", fetching " << fetched << " bytes in "
+              << missing.size() << " ranges" << std::endl;
+    return true;
+}
@@ -0,0 +1,429 @@
+#include <include/DownloadCache.h>
+#include <include/DownloadVerifier.h>
+#include <include/FileSink.h>
+
+#include <openssl/evp.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+static constexpr auto CACHE_HEADER = "file_downloader-cache 1";
+static constexpr auto ENTRY_SUFFIX = ".entry";
+static constexpr auto DATA_SUFFIX = ".data";
+static constexpr auto TEMP_SUFFIX = ".tmp";
+static constexpr auto LOCK_FILE = "lock";
+// Temporary files this old were left behind by a process that died while storing
+static constexpr auto STALE_TEMP_AGE = std::chrono::hours(1);
+static constexpr size_t PIPE_BUFFER_SIZE = 1024 * 1024;
+
+// Advisory lock on the cache's lock file, held until destroyed: shared while reading entries, exclusive while
+// changing them. Only processes that take it are kept out, which is every process of this program
+class CacheLock
+{
+  public:
+    CacheLock(const std::string& path, bool exclusive)
+    {
+#ifdef _WIN32
+        handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                             OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        OVERLAPPED overlapped{};
+        locked = handle != INVALID_HANDLE_VALUE &&
+                 LockFileEx(handle, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, MAXDWORD, MAXDWORD, &overlapped);
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        while (fd >= 0 && !locked)
+        {
+            locked = ::flock(fd, exclusive ? LOCK_EX : LOCK_SH) == 0;
+            if (!locked && errno != EINTR)
+                break;
+        }
+#endif
+        if (!locked)
+            std::cerr << "Cannot lock the download cache at " << path << std::endl;
+    }
+
+    ~CacheLock()
+    {
+        // Closing the file releases the lock
+#ifdef _WIN32
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle);
+#else
+        if (fd >= 0)
+            ::close(fd);
+#endif
+    }
+
+    CacheLock(const CacheLock&) = delete;
+    CacheLock& operator=(const CacheLock&) = delete;
+
+    bool locked = false;
+
+  private:
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+};
+
+static std::string sha256Hex(const std::string& text)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    EVP_Digest(text.data(), text.size(), digest, &length, EVP_sha256(), nullptr);
+    return toHex(digest, length);
+}
+
+// Name for a file that is renamed into place once complete, unique across processes
+static std::string tempPath(const std::string& path)
+{
+    static thread_local std::mt19937_64 generator{std::random_device{}()};
+    std::ostringstream name;
+    name << path << '.' << std::hex << generator() << TEMP_SUFFIX;
+    return name.str();
+}
+
+// Makes `to` a reflink of `from` where the file system can share blocks between files, else a copy. Never a hard
+// link: the output and the cache entry would be one file, and editing the output would change the cached copy.
+// Returns which one it made, nullptr if neither worked
+static const char* cloneFile(const std::string& from, const std::string& to)
+{
+#ifdef __linux__
+    const int source = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source >= 0)
+    {
+        const int target = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        bool cloned = false;
+        if (target >= 0)
+        {
+            cloned = ::ioctl(target, FICLONE, source) == 0;
+            ::close(target);
+            if (!cloned)
+                ::unlink(to.c_str());
+        }
+        ::close(source);
+        if (cloned)
+            return "reflink";
+    }
+#elif defined(__APPLE__)
+    if (::clonefile(from.c_str(), to.c_str(), 0) == 0)
+        return "reflink";
+#endif
+
+    std::error_code errorCode;
+    std::filesystem::copy_file(from, to, errorCode);
+    if (!errorCode)
+        return "copy";
+
+    std::cerr << "Cannot copy " << from << " to " << to << ": " << errorCode.message() << std::endl;
+    return nullptr;
+}
+
+static bool writeToPipe(const std::string& from, const std::string& to, const OrderedOutput::Consumer& consumer)
+{
+    std::ifstream in(from, std::ios::binary);
+    FileSink sink;
+    if (!in || !sink.openOrdered(to, PIPE_BUFFER_SIZE, consumer))
+        return false;
+
+    std::vector<char> buffer(PIPE_BUFFER_SIZE);
+    uint64_t offset = 0;
+    while (in.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || in.gcount() > 0)
+    {
+        const auto size = static_cast<size_t>(in.gcount());
+        if (!sink.write(offset, buffer.data(), size))
+            return false;
+        offset += size;
+    }
+    return sink.close();
+}
+
+DownloadCache::DownloadCache(std::string directory, uint64_t maxBytes)
+    : directory(std::move(directory)), maxBytes(maxBytes)
+{
+    std::error_code errorCode;
+    std::filesystem::create_directories(this->directory, errorCode);
+    if (errorCode)
+        std::cerr << "Cannot create the download cache " << this->directory << ": " << errorCode.message() << std::endl;
+}
+
+std::string DownloadCache::entryPath(const std::string& url) const
+{
+    return (std::filesystem::path(directory) / sha256Hex(url)).string() + ENTRY_SUFFIX;
+}
+
+std::optional<DownloadCache::Entry> DownloadCache::find(const std::string& url, const std::string& sha256) const
+{
+    CacheLock lock((std::filesystem::path(directory) / LOCK_FILE).string(), false);
+    if (!lock.locked)
+        return std::nullopt;
+
+    auto entry = load(entryPath(url));
+    if (sha256.empty() || (entry && entry->sha256 == sha256))
+        return entry;
+
+    // The same content may have been fetched from another URL
+    std::error_code errorCode;
+    for (const auto& file : std::filesystem::directory_iterator(directory, errorCode))
+    {
+        if (file.path().extension() != ENTRY_SUFFIX)
+            continue;
+        auto other = load(file.path().string());
+        if (other && other->sha256 == sha256)
+            return other;
+    }
+    return entry;
+}
+
+std::optional<DownloadCache::Entry> DownloadCache::load(const std::string& path) const
+{
+    std::ifstream in(path);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != CACHE_HEADER)
+        return std::nullopt;
+
+    Entry entry;
+    while (std::getline(in, line))
+    {
+        const auto space = line.find(' ');
+        const std::string key = line.substr(0, space);
+        const std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+
+        if (key == "url")
+        {
+            entry.url = value;
+        }
+        else if (key == "size")
+        {
+            // A damaged record is no record; the file is downloaded again
+            std::istringstream field(value);
+            if (!(field >> entry.remote.size))
+                return std::nullopt;
+        }
+        else if (key == "etag")
+        {
+            entry.remote.etag = value;
+        }
+        else if (key == "last-modified")
+        {
+            entry.remote.lastModified = value;
+        }
+        else if (key == "sha256")
+        {
+            entry.sha256 = value;
+        }
+    }
+
+    // The record is only worth something next to the whole file it describes
+    std::filesystem::path data(path);
+    data.replace_extension(DATA_SUFFIX);
+    std::error_code errorCode;
+    if (std::filesystem::file_size(data, errorCode) != entry.remote.size || errorCode)
+        return std::nullopt;
+    entry.dataPath = data.string();
+    return entry;
+}
+
+bool DownloadCache::place(const Entry& entry, const std::string& outputFile,
+                          const OrderedOutput::Consumer& consumer) const
+{
+    CacheLock lock((std::filesystem::path(directory) / LOCK_FILE).string(), false);
+    if (!lock.locked)
+        return false;
+
+    // Another process may have replaced or evicted the entry since find(); only the one that was checked goes out
+    const auto current = load(entryPath(entry.url));
+    if (!current || current->dataPath != entry.dataPath || current->remote.size != entry.remote.size ||
+        current->remote.etag != entry.remote.etag || current->remote.lastModified != entry.remote.lastModified ||
+        current->sha256 != entry.sha256)
+    {
+        std::cerr << "The cached copy changed since it was looked up, not placing it" << std::endl;
+        return false;
+    }
+
+    const char* method = "stream";
+    std::error_code errorCode;
+    if (consumer || FileSink::isPipe(outputFile))
+    {
+        if (!writeToPipe(entry.dataPath, outputFile, consumer))
+        {
+            std::cerr << "Cannot write the cached file to " << outputFile << std::endl;
+            return false;
+        }
+    }
+    else
+    {
+        // Built next to the output and renamed over it, so a failure leaves the old output alone
+        const std::string temp = tempPath(outputFile);
+        method = cloneFile(entry.dataPath, temp);
+        if (!method)
+            return false;
+
+        std::filesystem::rename(temp, outputFile, errorCode);
+        if (errorCode)
+        {
+            std::cerr << "Cannot place the cached file at " << outputFile << ": " << errorCode.message()
+                      << std::endl;
+            std::filesystem::remove(temp, errorCode);
+            return false;
+        }
+    }
+
+    // The record's modification time is the entry's last use
+    std::filesystem::last_write_time(entryPath(entry.url), std::filesystem::file_time_type::clock::now(), errorCode);
+    std::cerr << "Placed the cached file as a " << method << std::endl;
+    return true;
+}
+
+bool DownloadCache::store(const std::string& url, const RemoteFileInfo& remote, const std::string& sha256,
+                          const std::string& file)
+{
+    if (remote.size > maxBytes)
+    {
+        std::cerr << "The file is larger than the download cache, not caching it" << std::endl;
+        return false;
+    }
+
+    std::filesystem::path data(entryPath(url));
+    const std::string record = data.string();
+    data.replace_extension(DATA_SUFFIX);
+
+    // Both files are written under temporary names first; only the renames need the exclusive lock
+    const std::string tempData = tempPath(data.string());
+    if (!cloneFile(file, tempData))
+        return false;
+
+    const std::string tempRecord = tempPath(record);
+    {
+        std::ofstream out(tempRecord);
+        out << CACHE_HEADER << '\n';
+        out << "url " << url << '\n';
+        out << "size " << remote.size << '\n';
+        out << "etag " << remote.etag << '\n';
+        out << "last-modified " << remote.lastModified << '\n';
+        out << "sha256 " << sha256 << '\n';
+    }
+
+    std::error_code errorCode;
+    {
+        CacheLock lock((std::filesystem::path(directory) / LOCK_FILE).string(), true);
+        if (lock.locked)
+        {
+            // Without its record the old data is an orphan that eviction cleans up, should a rename fail
+            std::filesystem::remove(record, errorCode);
+            std::filesystem::rename(tempData, data, errorCode);
+            if (!errorCode)
+                std::filesystem::rename(tempRecord, record, errorCode);
+            if (!errorCode)
+                evict();
+        }
+        else
+        {
+            errorCode = std::make_error_code(std::errc::resource_unavailable_try_again);
+        }
+    }
+
+    if (errorCode)
+    {
+        std::cerr << "Cannot store the file in the download cache: " << errorCode.message() << std::endl;
+        std::filesystem::remove(tempData, errorCode);
+        std::filesystem::remove(tempRecord, errorCode);
+        return false;
+    }
+    std::cerr << "Stored the file in the download cache " << directory << std::endl;
+    return true;
+}
+
+void DownloadCache::remove(const Entry& entry)
+{
+    CacheLock lock((std::filesystem::path(directory) / LOCK_FILE).string(), true);
+    if (!lock.locked)
+        return;
+
+    std::error_code errorCode;
+    std::filesystem::remove(entryPath(entry.url), errorCode);
+    std::filesystem::remove(entry.dataPath, errorCode);
+}
+
+// Runs under the exclusive lock
+void DownloadCache::evict() const
+{
+    struct Item
+    {
+        std::filesystem::file_time_type used;
+        uint64_t size;
+        std::filesystem::path data;
+    };
+
+    std::vector<Item> items;
+    uint64_t total = 0;
+    const auto now = std::filesystem::file_time_type::clock::now();
+    std::error_code errorCode;
+    for (const auto& file : std::filesystem::directory_iterator(directory, errorCode))
+    {
+        const auto& path = file.path();
+        std::error_code ignored;
+        if (path.extension() == TEMP_SUFFIX)
+        {
+            if (now - file.last_write_time(ignored) > STALE_TEMP_AGE && !ignored)
+                std::filesystem::remove(path, ignored);
+            continue;
+        }
+        if (path.extension() != DATA_SUFFIX)
+            continue;
+
+        auto record = path;
+        record.replace_extension(ENTRY_SUFFIX);
+        const auto used = std::filesystem::last_write_time(record, ignored);
+        if (ignored)
+        {
+            // Data whose record never landed or is already gone
+            std::filesystem::remove(path, ignored);
+            continue;
+        }
+        const uint64_t size = file.file_size(ignored);
+        items.push_back({used, size, path});
+        total += size;
+    }
+
+    std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.used < b.used; });
+    size_t evicted = 0;
+    for (const auto& item : items)
+    {
+        if (total <= maxBytes)
+            break;
+        auto record = item.data;
+        record.replace_extension(ENTRY_SUFFIX);
+        std::filesystem::remove(record, errorCode);
+        std::filesystem::remove(item.data, errorCode);
+        total -= item.size;
+        ++evicted;
+    }
+
+    if (evicted > 0)
+    {
+        std::cerr << "Evicted " << evicted << " least recently used file(s) from the download cache" << std::endl;
+    }
+}
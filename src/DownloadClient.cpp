@@ -0,0 +1,257 @@
+#include <include/DownloadClient.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <optional>
+#include <sstream>
+
+// Progress callbacks come at most this often, whatever a request asks for
+static constexpr std::chrono::milliseconds MIN_PROGRESS_INTERVAL{50};
+
+struct DownloadJob
+{
+    DownloadRequest request;
+    Cancellation cancellation;
+    std::promise<DownloadResult> promise;
+    std::shared_future<DownloadResult> result;
+    // Size of the file once the probe found it
+    std::atomic<uint64_t> fileSize = 0;
+
+    // Guards the downloader, which handles and the progress thread read while the download runs, and what it had
+    // received when it was done
+    std::mutex mutex;
+    std::shared_ptr<Downloader> downloader;
+    DownloadProgress last;
+
+    // Held for a whole progress callback, so that none comes once the download is over
+    std::mutex reportMutex;
+    bool over = false;
+    // Guarded by the client's mutex
+    std::chrono::steady_clock::time_point nextReport;
+
+    DownloadProgress progress(bool withStatus)
+    {
+        std::lock_guard lock(mutex);
+        if (!downloader)
+            return last;
+
+        Telemetry& telemetry = downloader->telemetry();
+        DownloadProgress progress;
+        progress.receivedBytes = telemetry.totalBytes();
+        progress.totalBytes = fileSize;
+        progress.connections = telemetry.concurrency();
+        if (withStatus)
+            progress.status = telemetry.statusLine();
+        return progress;
+    }
+};
+
+std::shared_future<DownloadResult> DownloadHandle::result() const
+{
+    return job->result;
+}
+
+void DownloadHandle::cancel()
+{
+    job->cancellation.cancel();
+}
+
+DownloadProgress DownloadHandle::progress() const
+{
+    return job->progress(false);
+}
+
+DownloadClient::DownloadClient(ClientOptions options) : options(options), runtime(options.ioThreads)
+{
+    for (int i = 0; i < std::max(options.maxConcurrentDownloads, 1); ++i)
+        workers.emplace_back(&DownloadClient::workLoop, this);
+    reporter = std::thread(&DownloadClient::progressLoop, this);
+}
+
+DownloadClient::~DownloadClient()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+        for (const auto& job : queue)
+            job->cancellation.cancel();
+        for (const auto& job : running)
+            job->cancellation.cancel();
+    }
+    wakeWorker.notify_all();
+    wakeReporter.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+    reporter.join();
+}
+
+DownloadHandle DownloadClient::submit(DownloadRequest request)
+{
+    auto job = std::make_shared<DownloadJob>();
+    job->request = std::move(request);
+    job->result = job->promise.get_future().share();
+    {
+        std::lock_guard lock(mutex);
+        queue.push_back(job);
+    }
+    wakeWorker.notify_one();
+    return DownloadHandle(job);
+}
+
+DownloadResult DownloadClient::download(DownloadRequest request)
+{
+    return submit(std::move(request)).result().get();
+}
+
+void DownloadClient::workLoop()
+{
+    for (;;)
+    {
+        std::shared_ptr<DownloadJob> job;
+        {
+            std::unique_lock lock(mutex);
+            // Once stopping, the jobs left are cancelled and only need their results
+            wakeWorker.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            job = std::move(queue.front());
+            queue.pop_front();
+            job->nextReport =
+                std::chrono::steady_clock::now() + std::max(job->request.progressInterval, MIN_PROGRESS_INTERVAL);
+            running.push_back(job);
+        }
+        wakeReporter.notify_one();
+
+        DownloadResult result;
+        try
+        {
+            result = run(*job);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Download of " << job->request.url << " failed: " << e.what() << std::endl;
+        }
+
+        {
+            std::lock_guard lock(mutex);
+            running.erase(std::find(running.begin(), running.end(), job));
+        }
+        {
+            std::lock_guard lock(job->reportMutex);
+            job->over = true;
+        }
+        if (job->request.onComplete)
+            job->request.onComplete(result);
+        job->promise.set_value(std::move(result));
+    }
+}
+
+void DownloadClient::progressLoop()
+{
+    std::unique_lock lock(mutex);
+    while (!stopping)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        std::optional<std::chrono::steady_clock::time_point> wakeAt;
+        std::vector<std::shared_ptr<DownloadJob>> due;
+        for (const auto& job : running)
+        {
+            if (!job->request.onProgress)
+                continue;
+            if (job->nextReport <= now)
+            {
+                due.push_back(job);
+                job->nextReport = now + std::max(job->request.progressInterval, MIN_PROGRESS_INTERVAL);
+            }
+            wakeAt = wakeAt ? std::min(*wakeAt, job->nextReport) : job->nextReport;
+        }
+
+        lock.unlock();
+        for (const auto& job : due)
+        {
+            std::lock_guard report(job->reportMutex);
+            if (!job->over)
+                job->request.onProgress(job->progress(true));
+        }
+        lock.lock();
+
+        // A download that starts wakes the thread to work its first report in
+        if (wakeAt)
+            wakeReporter.wait_until(lock, *wakeAt);
+        else if (!stopping)
+            wakeReporter.wait(lock);
+    }
+}
+
+// The probe and the download, the way the command line runs them
+static bool fetch(Downloader& downloader, DownloadJob& job)
+{
+    const DownloadRequest& request = job.request;
+    const uint64_t fileSize = downloader.getFileSize();
+    const RemoteFileInfo& remote = downloader.remoteFile();
+    if (job.cancellation.cancelled())
+        return false;
+    if (fileSize == 0 && !remote.singleStream() && !remote.notModified)
+    {
+        std::cerr << "Could not determine the size of " << request.url << std::endl;
+        return false;
+    }
+    job.fileSize = fileSize;
+
+    if (remote.unknownSize)
+    {
+        std::cerr << "File size: unknown" << std::endl;
+    }
+    else
+    {
+        std::cerr << "File size: " << fileSize << " bytes / " << (fileSize / 1024.0 / 1024.0) << " MB"
+                  << std::endl;
+    }
+    if (remote.singleStream())
+    {
+        std::cerr << "The server cannot serve ranges of this file, it is streamed over one connection" << std::endl;
+        if (!request.options.seedFile.empty())
+            std::cerr << "Without ranges the seed is of no use, the whole file is downloaded" << std::endl;
+    }
+    return downloader.downloadFile(request.outputFile, request.parallelTasks, fileSize);
+}
+
+DownloadResult DownloadClient::run(DownloadJob& job)
+{
+    DownloadResult result;
+    const DownloadRequest& request = job.request;
+    if (job.cancellation.cancelled())
+    {
+        result.cancelled = true;
+        return result;
+    }
+
+    DownloadOptions downloadOptions = request.options;
+    downloadOptions.cancellation = &job.cancellation;
+    const Engine engine = engineFor(request.engine, downloadOptions, request.outputFile);
+    // Writes into an ordered output wait for its reader to free window space, which on the shared event loop would
+    // hold up every other download; those run the Boost engine on an event loop of their own
+    const bool ownLoop = engine == Engine::Boost && downloadOptions.inOrder(request.outputFile);
+    std::shared_ptr<Downloader> downloader = createDownloader(engine, request.url, ownLoop ? nullptr : &runtime);
+    downloader->setUp();
+    downloader->setOptions(downloadOptions);
+    {
+        std::lock_guard lock(job.mutex);
+        job.downloader = downloader;
+    }
+
+    result.success = fetch(*downloader, job);
+    result.cancelled = !result.success && job.cancellation.cancelled();
+    result.remote = downloader->remoteFile();
+    std::ostringstream telemetry;
+    downloader->telemetry().writeJson(telemetry);
+    result.telemetry = telemetry.str();
+
+    // The downloader goes here, on a thread of the client, while the runtime it used is still there
+    const DownloadProgress last = job.progress(false);
+    std::lock_guard lock(job.mutex);
+    job.last = last;
+    job.downloader.reset();
+    return result;
+}
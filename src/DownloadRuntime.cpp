@@ -0,0 +1,56 @@
+#include <include/DownloadRuntime.h>
+
+#include <algorithm>
+
+DownloadRuntime::DownloadRuntime(int ioThreads) : work(boost::asio::make_work_guard(ioContext))
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+    share = curl_share_init();
+    if (share)
+    {
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockShare);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    const int count = ioThreads > 0 ? ioThreads : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    for (int i = 0; i < count; ++i)
+        threads.emplace_back([this] { ioContext.run(); });
+}
+
+DownloadRuntime::~DownloadRuntime()
+{
+    work.reset();
+    ioContext.stop();
+    for (auto& thread : threads)
+        thread.join();
+
+    // Idle connections close with their pools, while the io_context is still there
+    pools.clear();
+    if (share)
+        curl_share_cleanup(share);
+    curl_global_cleanup();
+}
+
+std::shared_ptr<ConnectionPool> DownloadRuntime::pool(const std::string& host, const std::string& port, bool secure,
+                                                      const std::string& caFile)
+{
+    const std::string key = (secure ? "https://" : "http://") + host + ":" + port + " " + caFile;
+    std::lock_guard lock(poolsMutex);
+    auto& pool = pools[key];
+    if (!pool)
+        pool = std::make_shared<ConnectionPool>(ioContext, host, port, secure, caFile);
+    return pool;
+}
+
+void DownloadRuntime::lockShare(CURL*, curl_lock_data data, curl_lock_access, void* userData)
+{
+    static_cast<DownloadRuntime*>(userData)->shareLocks[data].lock();
+}
+
+void DownloadRuntime::unlockShare(CURL*, curl_lock_data data, void* userData)
+{
+    static_cast<DownloadRuntime*>(userData)->shareLocks[data].unlock();
+}
@@ -0,0 +1,390 @@
+#include <include/Crc32c.h>
+#include <include/DownloadVerifier.h>
+#include <include/OrderedOutput.h>
+#include <include/RangeJournal.h>
+#include <include/RangeScheduler.h>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static constexpr int MAX_REFETCHES = 3;
+static constexpr size_t READ_BUFFER_SIZE = 1024 * 1024;
+// Blocks an ordered output holds back until they pass their check must fit into its reorder window twice over: one
+// being completed while the one before it waits to go out
+static constexpr uint64_t MIN_WINDOW_BLOCKS = 2;
+
+std::string toHex(const unsigned char* data, size_t size)
+{
+    static constexpr char DIGITS[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(size * 2);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hex += DIGITS[data[i] >> 4];
+        hex += DIGITS[data[i] & 0xF];
+    }
+    return hex;
+}
+
+static bool isHex(const std::string& text)
+{
+    return std::all_of(text.begin(), text.end(), [](unsigned char c) { return std::isxdigit(c); });
+}
+
+static std::string crcHex(uint32_t crc)
+{
+    char hex[9];
+    std::snprintf(hex, sizeof(hex), "%08x", crc);
+    return hex;
+}
+
+DownloadVerifier::DownloadVerifier(const DownloadOptions& options, uint64_t fileSize)
+    : fileSize(fileSize), manifestPath(options.blockChecksums)
+{
+    expectedSha256 = options.sha256;
+    std::transform(expectedSha256.begin(), expectedSha256.end(), expectedSha256.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (!expectedSha256.empty() && (expectedSha256.size() != 64 || !isHex(expectedSha256)))
+        invalidOptions = "SHA-256 must be 64 hex digits";
+    if (!options.crc32c.empty() && (options.crc32c.size() > 8 || !isHex(options.crc32c)))
+        invalidOptions = "CRC32C must be at most 8 hex digits";
+    else if (!options.crc32c.empty())
+        expectedCrc = static_cast<uint32_t>(std::stoul(options.crc32c, nullptr, 16));
+
+    active = !expectedSha256.empty() || expectedCrc || !manifestPath.empty() || !invalidOptions.empty();
+}
+
+DownloadVerifier::~DownloadVerifier()
+{
+    EVP_MD_CTX_free(emittedContext);
+    if (!hasher.joinable())
+        return;
+
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    progress.notify_all();
+    hasher.join();
+}
+
+bool DownloadVerifier::start(const std::string& path, RangeScheduler* rangeScheduler,
+                             const std::vector<ByteRange>& missing)
+{
+    if (!active)
+        return true;
+    if (!invalidOptions.empty())
+    {
+        std::cerr << invalidOptions << std::endl;
+        return false;
+    }
+
+    filePath = path;
+    scheduler = rangeScheduler;
+    if (!manifestPath.empty() && !loadManifest(manifestPath))
+        return false;
+
+    blocks.assign(static_cast<size_t>((fileSize + blockSize - 1) / blockSize), Block{});
+    if (scheduler)
+        scheduler->setVerifier(this);
+
+    if (output && !expectedBlocks.empty())
+    {
+        if (output->window() < MIN_WINDOW_BLOCKS * std::max(blockSize, DEFAULT_BLOCK_SIZE))
+        {
+            std::cerr << "The reorder window must hold at least " << MIN_WINDOW_BLOCKS
+                      << " blocks of the checksum manifest" << std::endl;
+            return false;
+        }
+        output->hold();
+    }
+    if (output && !expectedSha256.empty())
+    {
+        emittedContext = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(emittedContext, EVP_sha256(), nullptr);
+        output->onEmit([this](const char* data, size_t size) { hashEmitted(data, size); });
+    }
+    else if (!expectedSha256.empty())
+    {
+        hasher = std::thread(&DownloadVerifier::hashLoop, this);
+    }
+
+    return seedFromDisk(missing);
+}
+
+void DownloadVerifier::attach(OrderedOutput& orderedOutput)
+{
+    output = &orderedOutput;
+}
+
+bool DownloadVerifier::loadManifest(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Cannot open block checksum manifest " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    std::string keyword;
+    if (!std::getline(in, line) || !(std::istringstream(line) >> keyword >> blockSize) || keyword != "block-size" ||
+        blockSize == 0)
+    {
+        std::cerr << "Block checksum manifest " << path << " does not start with a block-size line" << std::endl;
+        return false;
+    }
+
+    while (std::getline(in, line))
+    {
+        if (line.empty())
+            continue;
+        try
+        {
+            expectedBlocks.push_back(static_cast<uint32_t>(std::stoul(line, nullptr, 16)));
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Invalid checksum in " << path << ": " << line << std::endl;
+            return false;
+        }
+    }
+
+    const uint64_t blockCount = (fileSize + blockSize - 1) / blockSize;
+    if (expectedBlocks.size() != blockCount)
+    {
+        std::cerr << "Block checksum manifest " << path << " lists " << expectedBlocks.size()
+                  << " blocks, the file has " << blockCount << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool DownloadVerifier::seedFromDisk(const std::vector<ByteRange>& missing)
+{
+    const auto present = missingRanges(mergeRanges(missing), fileSize);
+    if (present.empty())
+        return true;
+
+    std::ifstream in(filePath, std::ios::binary);
+    std::vector<char> buffer(READ_BUFFER_SIZE);
+    for (const auto& range : present)
+    {
+        in.seekg(static_cast<std::streamoff>(range.start));
+        for (uint64_t offset = range.start; offset <= range.end;)
+        {
+            // Pieces never cross a block boundary
+            const uint64_t pieceStart = offset;
+            const uint64_t pieceEnd = std::min((offset / blockSize + 1) * blockSize, range.end + 1);
+            uint32_t crc = 0;
+            while (offset < pieceEnd)
+            {
+                const auto size = static_cast<size_t>(std::min<uint64_t>(buffer.size(), pieceEnd - offset));
+                if (!in.read(buffer.data(), static_cast<std::streamsize>(size)))
+                {
+                    std::cerr << "Cannot read back " << filePath << " at offset " << offset << std::endl;
+                    return false;
+                }
+                crc = crc32c(buffer.data(), size, crc);
+                offset += size;
+            }
+            addPiece(pieceStart, pieceEnd - pieceStart, crc);
+        }
+    }
+
+    std::lock_guard lock(mutex);
+    return !failed;
+}
+
+void DownloadVerifier::append(Chunk& chunk, const char* data, size_t size)
+{
+    uint64_t offset = chunk.start + chunk.received;
+    while (size > 0)
+    {
+        const uint64_t blockEnd = (offset / blockSize + 1) * blockSize;
+        const auto step = static_cast<size_t>(std::min<uint64_t>(size, blockEnd - offset));
+        chunk.pieceCrc = crc32c(data, step, chunk.pieceCrc);
+        offset += step;
+        data += step;
+        size -= step;
+
+        // The piece ends at a block boundary or where the chunk ends, whichever comes first
+        if (offset == blockEnd || offset == chunk.end + 1)
+        {
+            const uint64_t pieceStart = std::max(chunk.start, blockEnd - blockSize);
+            addPiece(pieceStart, offset - pieceStart, chunk.pieceCrc);
+            chunk.pieceCrc = 0;
+        }
+    }
+}
+
+uint64_t DownloadVerifier::blockLength(size_t block) const
+{
+    return std::min(blockSize, fileSize - block * blockSize);
+}
+
+void DownloadVerifier::addPiece(uint64_t start, uint64_t length, uint32_t crc)
+{
+    const size_t index = static_cast<size_t>(start / blockSize);
+    std::optional<ByteRange> refetch;
+    bool giveUp = false;
+    uint64_t verified;
+    {
+        std::lock_guard lock(mutex);
+        Block& block = blocks[index];
+        block.pieces.push_back({start, length, crc});
+        block.covered += length;
+        if (block.covered < blockLength(index))
+            return;
+
+        std::sort(block.pieces.begin(), block.pieces.end(),
+                  [](const Piece& a, const Piece& b) { return a.start < b.start; });
+        uint32_t blockCrc = block.pieces.front().crc;
+        for (size_t i = 1; i < block.pieces.size(); ++i)
+            blockCrc = crc32cCombine(blockCrc, block.pieces[i].crc, block.pieces[i].length);
+        block.pieces.clear();
+        block.covered = 0;
+
+        if (!expectedBlocks.empty() && blockCrc != expectedBlocks[index])
+        {
+            ++corruptBlocks;
+            if (scheduler && ++block.refetches <= MAX_REFETCHES)
+                refetch = ByteRange{index * blockSize, index * blockSize + blockLength(index) - 1};
+            else
+                giveUp = failed = true;
+        }
+        else
+        {
+            block.crc = blockCrc;
+            block.done = true;
+
+            size_t next = static_cast<size_t>(verifiedPrefix / blockSize);
+            while (next < blocks.size() && blocks[next].done)
+                ++next;
+            verifiedPrefix = std::min(next * blockSize, fileSize);
+        }
+        verified = verifiedPrefix;
+    }
+
+    if (refetch)
+    {
+        std::cerr << "Block " << index << " failed its CRC32C check, fetching it again" << std::endl;
+        scheduler->refetch(*refetch);
+    }
+    else if (giveUp)
+    {
+        std::cerr << "Block " << index << " failed its CRC32C check, giving up" << std::endl;
+        if (scheduler)
+            scheduler->abort();
+    }
+    if (output)
+        output->release(verified);
+    progress.notify_all();
+}
+
+void DownloadVerifier::hashLoop()
+{
+    EVP_MD_CTX* context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+
+    std::ifstream in(filePath, std::ios::binary);
+    std::vector<char> buffer(READ_BUFFER_SIZE);
+    uint64_t hashed = 0;
+    while (hashed < fileSize)
+    {
+        uint64_t until;
+        {
+            std::unique_lock lock(mutex);
+            progress.wait(lock, [&] { return verifiedPrefix > hashed || stopping; });
+            until = verifiedPrefix;
+        }
+        if (until <= hashed)
+            break; // stopped
+
+        // The verified bytes were written through another descriptor and are read back from the page cache
+        in.seekg(static_cast<std::streamoff>(hashed));
+        while (hashed < until)
+        {
+            const auto size = static_cast<size_t>(std::min<uint64_t>(buffer.size(), until - hashed));
+            if (!in.read(buffer.data(), static_cast<std::streamsize>(size)))
+                break;
+            EVP_DigestUpdate(context, buffer.data(), size);
+            hashed += size;
+        }
+        if (hashed < until)
+            break; // read error
+    }
+
+    if (hashed == fileSize)
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        EVP_DigestFinal_ex(context, digest, &length);
+        sha256 = toHex(digest, length);
+    }
+    EVP_MD_CTX_free(context);
+}
+
+// Runs on the output's emitting thread, which is done once the output is closed
+void DownloadVerifier::hashEmitted(const char* data, size_t size)
+{
+    EVP_DigestUpdate(emittedContext, data, size);
+    emittedBytes += size;
+}
+
+bool DownloadVerifier::finish(bool downloaded)
+{
+    if (!active)
+        return downloaded;
+
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    progress.notify_all();
+    if (hasher.joinable())
+        hasher.join();
+    if (!downloaded)
+        return false;
+
+    bool ok = !failed && verifiedPrefix == fileSize;
+    if (corruptBlocks > 0)
+        std::cerr << corruptBlocks << " corrupt block(s) detected" << (ok ? " and fetched again" : "") << std::endl;
+
+    uint32_t fileCrc = 0;
+    for (size_t i = 0; i < blocks.size(); ++i)
+        fileCrc = i == 0 ? blocks[i].crc : crc32cCombine(fileCrc, blocks[i].crc, blockLength(i));
+    if (ok && expectedCrc)
+    {
+        const bool match = fileCrc == *expectedCrc;
+        std::cerr << "CRC32C " << (match ? "verified: " : "mismatch: ") << crcHex(fileCrc)
+                  << (match ? "" : ", expected " + crcHex(*expectedCrc)) << std::endl;
+        ok = ok && match;
+    }
+    else if (ok && !expectedBlocks.empty())
+    {
+        std::cerr << "All " << blocks.size() << " blocks verified, CRC32C " << crcHex(fileCrc) << std::endl;
+    }
+
+    if (emittedContext && emittedBytes == fileSize)
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        EVP_DigestFinal_ex(emittedContext, digest, &length);
+        sha256 = toHex(digest, length);
+    }
+    if (ok && !expectedSha256.empty())
+    {
+        const bool match = sha256 == expectedSha256;
+        std::cerr << "SHA-256 " << (match ? "verified: " : "mismatch: ") << sha256
+                  << (match ? "" : ", expected " + expectedSha256) << std::endl;
+        ok = ok && match;
+    }
+    return ok;
+}
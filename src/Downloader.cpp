@@ -0,0 +1,154 @@
+#include <include/BoostUtils.h>
+#include <include/CurlUtils.h>
+#include <include/DownloadRuntime.h>
+#include <include/DownloadVerifier.h>
+#include <include/Downloader.h>
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <iostream>
+
+static std::string lowerCase(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return text;
+}
+
+void Downloader::setOptions(const DownloadOptions& value)
+{
+    options = value;
+    cache.reset();
+    if (!options.cacheDir.empty())
+        cache = std::make_unique<DownloadCache>(options.cacheDir, options.cacheLimit);
+}
+
+bool Downloader::lookUpCache(const std::string& url)
+{
+    cached.reset();
+    if (!cache)
+        return false;
+
+    const std::string sha256 = lowerCase(options.sha256);
+    cached = cache->find(url, sha256);
+    if (!cached)
+        return false;
+
+    if (!sha256.empty() && cached->sha256 == sha256)
+    {
+        std::cerr << "The download cache holds a copy with the expected SHA-256, no request needed" << std::endl;
+        remote = cached->remote;
+        remote.notModified = true;
+        return true;
+    }
+    // Nothing to ask the server with; such entries only serve lookups by digest
+    if (cached->remote.etag.empty() && cached->remote.lastModified.empty())
+        cached.reset();
+    return false;
+}
+
+bool Downloader::placeCached(const std::string& outputFile)
+{
+    std::cerr << "The cached copy is current, placing it from " << cache->path() << std::endl;
+    // A pipe cannot be read back, it only gets the cached copy once that passed the checks
+    const bool pipe = options.inOrder(outputFile);
+    if (!pipe && !cache->place(*cached, outputFile))
+        return false;
+
+    // The entry was verified against its digest when it was stored, the other checks run on the placed file
+    DownloadOptions checks = options;
+    if (lowerCase(options.sha256) == cached->sha256)
+        checks.sha256.clear();
+    DownloadVerifier verifier(checks, cached->remote.size);
+    if (verifier.start(pipe ? cached->dataPath : outputFile, nullptr, {}) && verifier.finish(true))
+        return !pipe || cache->place(*cached, outputFile, options.outputConsumer);
+
+    std::cerr << "The cached copy failed its check, dropping it from the cache" << std::endl;
+    cache->remove(*cached);
+    cached.reset();
+    return false;
+}
+
+void Downloader::storeInCache(const std::string& url, const std::string& outputFile)
+{
+    // What went into a pipe is gone
+    if (!cache || options.inOrder(outputFile))
+        return;
+
+    RemoteFileInfo stored = remote;
+    // A streamed file's length is only known now
+    std::error_code errorCode;
+    stored.size = std::filesystem::file_size(outputFile, errorCode);
+    if (errorCode)
+        return;
+
+    // A digest the download was checked against also finds the file under other URLs
+    const std::string sha256 = lowerCase(options.sha256);
+    if (stored.etag.empty() && stored.lastModified.empty() && sha256.empty())
+    {
+        std::cerr << "The server sends neither ETag nor Last-Modified, not caching the file" << std::endl;
+        return;
+    }
+    cache->store(url, stored, sha256, outputFile);
+}
+
+std::optional<Engine> parseEngine(const std::string& name)
+{
+    if (name == "boost")
+        return Engine::Boost;
+    if (name == "curl" || name == "curl-multi")
+        return Engine::CurlMulti;
+    if (name == "curl-threads")
+        return Engine::CurlThreads;
+    return std::nullopt;
+}
+
+const char* engineName(Engine engine)
+{
+    switch (engine)
+    {
+    case Engine::Boost:
+        return "boost";
+    case Engine::CurlMulti:
+        return "curl-multi";
+    case Engine::CurlThreads:
+        return "curl-threads";
+    }
+    return "?";
+}
+
+Engine engineFor(Engine requested, const DownloadOptions& options, const std::string& outputFile)
+{
+    if (options.httpVersion != HttpVersion::Http1 && requested != Engine::CurlMulti)
+    {
+        std::cerr << "HTTP/2 and HTTP/3 need the curl engine, using it instead of " << engineName(requested)
+                  << std::endl;
+        return Engine::CurlMulti;
+    }
+    // A thread per chunk cuts the file into as many pieces as there are threads, far more than a window holds, and
+    // fetches all of them
+    if (requested == Engine::CurlThreads && (options.inOrder(outputFile) || !options.seedFile.empty()))
+    {
+        std::cerr << "Output in order and delta downloads need the boost or curl engine, using boost instead of "
+                     "curl-threads"
+                  << std::endl;
+        return Engine::Boost;
+    }
+    return requested;
+}
+
+std::unique_ptr<Downloader> createDownloader(Engine engine, const std::string& url, DownloadRuntime* runtime)
+{
+    CURLSH* share = runtime ? runtime->curlShare() : nullptr;
+    switch (engine)
+    {
+    case Engine::Boost:
+        return std::make_unique<BoostDownloader>(url, runtime);
+    case Engine::CurlMulti:
+        return std::make_unique<CurlDownloader>(url, false, share);
+    case Engine::CurlThreads:
+        return std::make_unique<CurlDownloader>(url, true, share);
+    }
+    return nullptr;
+}
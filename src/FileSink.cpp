@@ -0,0 +1,294 @@
+#include <include/FileSink.h>
+
+#include <filesystem>
+#include <iostream>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+FileSink::~FileSink()
+{
+    close();
+}
+
+bool FileSink::isPipe(const std::string& path)
+{
+    if (path == "-")
+        return true;
+#ifdef _WIN32
+    return path.rfind("\\\\.\\pipe\\", 0) == 0;
+#else
+    std::error_code errorCode;
+    return std::filesystem::is_fifo(path, errorCode);
+#endif
+}
+
+bool FileSink::openOrdered(const std::string& path, uint64_t window, const OrderedOutput::Consumer& consumer)
+{
+    close();
+    filePath = path;
+    if (consumer)
+    {
+        orderedOutput = std::make_unique<OrderedOutput>(consumer, window);
+        return true;
+    }
+
+    std::FILE* file = stdout;
+    if (path == "-")
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    else
+    {
+        // Opening a named pipe waits until a reader opens it too
+        file = std::fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            std::cerr << "Failed to open output pipe: " << path << std::endl;
+            return false;
+        }
+    }
+    // The emitter writes whole ranges, a buffer of its own would only add a copy
+    std::setvbuf(file, nullptr, _IONBF, 0);
+    orderedOutput = std::make_unique<OrderedOutput>(file, window);
+    return true;
+}
+
+#ifdef _WIN32
+
+bool FileSink::open(const std::string& path, uint64_t fileSize, bool truncate)
+{
+    close();
+    filePath = path;
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                              truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Failed to open output file: " << path << std::endl;
+        return false;
+    }
+    handle = file;
+
+    return preallocate(fileSize);
+}
+
+bool FileSink::preallocate(uint64_t fileSize)
+{
+    if (orderedOutput)
+        return true;
+    LARGE_INTEGER size;
+    size.QuadPart = static_cast<LONGLONG>(fileSize);
+    if (!SetFilePointerEx(handle, size, nullptr, FILE_BEGIN) || !SetEndOfFile(handle))
+    {
+        std::cerr << "Failed to preallocate " << fileSize << " bytes for " << filePath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool FileSink::resize(uint64_t fileSize)
+{
+    return preallocate(fileSize);
+}
+
+bool FileSink::write(uint64_t offset, const char* data, size_t size)
+{
+    if (orderedOutput)
+        return orderedOutput->write(offset, data, size);
+    while (size > 0)
+    {
+        OVERLAPPED overlapped{};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        DWORD written = 0;
+        DWORD toWrite = size > MAXDWORD ? MAXDWORD : static_cast<DWORD>(size);
+        if (!WriteFile(handle, data, toWrite, &written, &overlapped))
+        {
+            std::cerr << "Write to " << filePath << " failed at offset " << offset << std::endl;
+            return false;
+        }
+        offset += written;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool FileSink::sync()
+{
+    if (orderedOutput)
+        return true;
+    return FlushFileBuffers(handle);
+}
+
+bool FileSink::close()
+{
+    if (orderedOutput)
+    {
+        const bool ok = orderedOutput->close();
+        orderedOutput.reset();
+        return ok;
+    }
+    if (!handle)
+        return true;
+
+    bool ok = CloseHandle(handle);
+    handle = nullptr;
+    return ok;
+}
+
+bool FileSink::isOpen() const
+{
+    return handle != nullptr || orderedOutput;
+}
+
+#else
+
+bool FileSink::open(const std::string& path, uint64_t fileSize, bool truncate)
+{
+    close();
+    filePath = path;
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open output file: " << path << " (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+
+    return preallocate(fileSize);
+}
+
+bool FileSink::preallocate(uint64_t fileSize)
+{
+    if (orderedOutput || fileSize == 0)
+        return true;
+
+#ifdef __linux__
+    // Reserve real blocks so a full disk is reported now rather than halfway through the download
+    const int error = posix_fallocate(fd, 0, static_cast<off_t>(fileSize));
+    if (error == 0)
+        return true;
+    if (error != EOPNOTSUPP && error != EINVAL)
+    {
+        std::cerr << "Failed to preallocate " << fileSize << " bytes for " << filePath << " (" << std::strerror(error)
+                  << ")" << std::endl;
+        return false;
+    }
+#endif
+
+    // Filesystems without fallocate support still get the final size, just sparse
+    if (ftruncate(fd, static_cast<off_t>(fileSize)) != 0)
+    {
+        std::cerr << "Failed to preallocate " << fileSize << " bytes for " << filePath << " ("
+                  << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool FileSink::resize(uint64_t fileSize)
+{
+    if (orderedOutput)
+        return true;
+    if (ftruncate(fd, static_cast<off_t>(fileSize)) != 0)
+    {
+        std::cerr << "Failed to resize " << filePath << " to " << fileSize << " bytes (" << std::strerror(errno) << ")"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool FileSink::write(uint64_t offset, const char* data, size_t size)
+{
+    if (orderedOutput)
+        return orderedOutput->write(offset, data, size);
+    while (size > 0)
+    {
+        ssize_t written = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            std::cerr << "Write to " << filePath << " failed at offset " << offset << " ("
+                      << std::strerror(errno) << ")" << std::endl;
+            return false;
+        }
+        offset += written;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+#ifdef __linux__
+bool FileSink::writeFromPipe(uint64_t offset, int pipe, size_t size)
+{
+    while (size > 0)
+    {
+        auto position = static_cast<loff_t>(offset);
+        ssize_t written = splice(pipe, nullptr, fd, &position, size, SPLICE_F_MOVE);
+        if (written <= 0)
+        {
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            std::cerr << "Splice to " << filePath << " failed at offset " << offset << " ("
+                      << std::strerror(written < 0 ? errno : EIO) << ")" << std::endl;
+            return false;
+        }
+        offset += written;
+        size -= written;
+    }
+    return true;
+}
+#endif
+
+bool FileSink::sync()
+{
+    if (orderedOutput)
+        return true;
+#ifdef __linux__
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+bool FileSink::close()
+{
+    if (orderedOutput)
+    {
+        const bool ok = orderedOutput->close();
+        orderedOutput.reset();
+        return ok;
+    }
+    if (fd < 0)
+        return true;
+
+    bool ok = ::close(fd) == 0;
+    fd = -1;
+    return ok;
+}
+
+bool FileSink::isOpen() const
+{
+    return fd >= 0 || orderedOutput;
+}
+
+#endif
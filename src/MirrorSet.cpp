@@ -0,0 +1,173 @@
+#include <include/MirrorSet.h>
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+
+// Weight of the newest range in a source's rate
+static constexpr double RATE_SMOOTHING = 0.3;
+// Ranges shorter than this say more about latency than about bandwidth
+static constexpr double MIN_RATE_SECONDS = 0.01;
+// Failed ranges in a row that drop a source
+static constexpr int MAX_CONSECUTIVE_FAILURES = 3;
+
+MirrorSet::MirrorSet(std::vector<std::string> urls)
+{
+    for (auto& url : urls)
+        sources.emplace_back().url = std::move(url);
+}
+
+RemoteFileInfo MirrorSet::agree(const std::vector<RemoteFileInfo>& probes)
+{
+    std::lock_guard lock(mutex);
+    RemoteFileInfo reference;
+    // First source that answered without a length; it streams the file when no source knows the size
+    std::optional<size_t> streaming;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        const RemoteFileInfo& probe = i < probes.size() ? probes[i] : RemoteFileInfo{};
+        sources[i].remote = probe;
+        if (probe.size == 0)
+        {
+            if (probe.unknownSize && !streaming)
+                streaming = i;
+            // Also drops the source when it was the only one; the caller then gives up anyway
+            sources[i].enabled = false;
+            if (sources.size() > 1)
+                std::cerr << "Source " << sources[i].url << " did not report the file size, skipping it" << std::endl;
+            continue;
+        }
+
+        if (reference.size == 0)
+        {
+            reference = probe;
+            continue;
+        }
+
+        if (probe.size != reference.size)
+        {
+            sources[i].enabled = false;
+            std::cerr << "Source " << sources[i].url << " reports " << probe.size << " bytes instead of "
+                      << reference.size << ", skipping it" << std::endl;
+        }
+        else if (!probe.etag.empty() && !reference.etag.empty() && probe.etag != reference.etag)
+        {
+            sources[i].enabled = false;
+            std::cerr << "Source " << sources[i].url << " has ETag " << probe.etag << " instead of " << reference.etag
+                      << ", skipping it" << std::endl;
+        }
+    }
+
+    if (reference.size == 0 && streaming)
+    {
+        sources[*streaming].enabled = true;
+        reference = sources[*streaming].remote;
+    }
+    return reference;
+}
+
+// Sources without a measured range yet are taken to be as fast as the best one, so each gets tried
+static double assumedRate(double rate, double bestRate)
+{
+    return rate > 0.0 ? rate : std::max(bestRate, 1.0);
+}
+
+double MirrorSet::bestRate() const
+{
+    double best = 0.0;
+    for (const auto& source : sources)
+        best = std::max(best, source.rate);
+    return best;
+}
+
+size_t MirrorSet::pick(int avoid)
+{
+    std::lock_guard lock(mutex);
+    const double best = bestRate();
+    const auto enabled = std::count_if(sources.begin(), sources.end(), [](const Source& s) { return s.enabled; });
+
+    size_t chosen = 0;
+    double chosenShare = -1.0;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        const Source& source = sources[i];
+        if (!source.enabled || (static_cast<int>(i) == avoid && enabled > 1))
+            continue;
+
+        const double share = assumedRate(source.rate, best) / (source.active + 1);
+        if (share > chosenShare)
+        {
+            chosen = i;
+            chosenShare = share;
+        }
+    }
+
+    if (!sources.empty())
+        ++sources[chosen].active;
+    return chosen;
+}
+
+void MirrorSet::finish(size_t source, uint64_t bytes, std::chrono::steady_clock::duration elapsed, bool succeeded)
+{
+    std::lock_guard lock(mutex);
+    Source& entry = sources[source];
+    --entry.active;
+    entry.bytes += bytes;
+
+    if (!succeeded)
+    {
+        // A failing source loses half its weight at once, so the retry likely goes elsewhere
+        entry.rate = assumedRate(entry.rate, bestRate()) / 2;
+        ++entry.failures;
+        if (++entry.consecutiveFailures >= MAX_CONSECUTIVE_FAILURES)
+            disableLocked(source, "keeps failing");
+        return;
+    }
+
+    entry.consecutiveFailures = 0;
+    ++entry.ranges;
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    if (seconds < MIN_RATE_SECONDS)
+        return;
+
+    const double rate = bytes / seconds;
+    entry.rate = entry.rate == 0.0 ? rate : RATE_SMOOTHING * rate + (1.0 - RATE_SMOOTHING) * entry.rate;
+}
+
+bool MirrorSet::disable(size_t source)
+{
+    std::lock_guard lock(mutex);
+    return disableLocked(source, "changed its copy of the file");
+}
+
+bool MirrorSet::disableLocked(size_t source, const char* reason)
+{
+    if (!sources[source].enabled)
+        return true;
+
+    const auto enabled = std::count_if(sources.begin(), sources.end(), [](const Source& s) { return s.enabled; });
+    if (enabled <= 1)
+        return false;
+
+    sources[source].enabled = false;
+    std::cerr << "Source " << sources[source].url << " " << reason << ", dropping it" << std::endl;
+    return true;
+}
+
+void MirrorSet::printSummary() const
+{
+    std::lock_guard lock(mutex);
+    if (sources.size() < 2)
+        return;
+
+    for (const auto& source : sources)
+    {
+        std::cerr << "Source " << source.url << ": " << source.ranges << " ranges, " << source.bytes / 1024.0 / 1024.0
+                  << " MiB, " << source.rate / 1024.0 / 1024.0 << " MiB/s per range";
+        if (source.failures > 0)
+            std::cerr << ", " << source.failures << " failed";
+        if (!source.enabled)
+            std::cerr << ", dropped";
+        std::cerr << std::endl;
+    }
+}
@@ -0,0 +1,174 @@
+#include <include/OrderedOutput.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+OrderedOutput::OrderedOutput(std::FILE* file, uint64_t window) : file(file), ring(window)
+{
+    emitter = std::thread(&OrderedOutput::emitLoop, this);
+}
+
+OrderedOutput::OrderedOutput(Consumer consumer, uint64_t window) : consumer(std::move(consumer)), ring(window)
+{
+    emitter = std::thread(&OrderedOutput::emitLoop, this);
+}
+
+OrderedOutput::~OrderedOutput()
+{
+    close();
+}
+
+bool OrderedOutput::write(uint64_t offset, const char* data, size_t size)
+{
+    uint64_t end = offset + size;
+    {
+        std::unique_lock lock(mutex);
+        // Bytes already emitted were written before, e.g. by a duplicate request
+        if (end <= emittedBytes)
+            return true;
+        if (offset < emittedBytes)
+        {
+            data += emittedBytes - offset;
+            offset = emittedBytes;
+        }
+        spaceFreed.wait(lock, [&] { return end <= emittedBytes + ring.size() || failed || closing; });
+        if (failed || closing)
+            return false;
+        // The emitter may have passed part of the range while this write waited
+        if (offset < emittedBytes)
+        {
+            data += emittedBytes - offset;
+            offset = emittedBytes;
+        }
+    }
+
+    // Ranges of the window belong to one writer each until they are emitted, so the copy needs no lock
+    const uint64_t start = offset % ring.size();
+    const uint64_t first = std::min<uint64_t>(end - offset, ring.size() - start);
+    std::memcpy(ring.data() + start, data, first);
+    std::memcpy(ring.data(), data + first, end - offset - first);
+
+    std::lock_guard lock(mutex);
+    if (offset <= ready)
+    {
+        ready = std::max(ready, end);
+        // Join the written ranges the new one reached
+        for (auto next = written.begin(); next != written.end() && next->first <= ready;)
+        {
+            ready = std::max(ready, next->second);
+            next = written.erase(next);
+        }
+        wakeEmitter.notify_one();
+    }
+    else
+    {
+        auto& known = written[offset];
+        known = std::max(known, end);
+    }
+    return true;
+}
+
+void OrderedOutput::hold()
+{
+    std::lock_guard lock(mutex);
+    held = true;
+}
+
+void OrderedOutput::release(uint64_t upTo)
+{
+    std::lock_guard lock(mutex);
+    if (upTo > released)
+    {
+        released = upTo;
+        wakeEmitter.notify_one();
+    }
+}
+
+void OrderedOutput::onEmit(std::function<void(const char*, size_t)> observer)
+{
+    std::lock_guard lock(mutex);
+    this->observer = std::move(observer);
+}
+
+bool OrderedOutput::close()
+{
+    {
+        std::lock_guard lock(mutex);
+        closing = true;
+        wakeEmitter.notify_one();
+        spaceFreed.notify_all();
+    }
+    if (emitter.joinable())
+        emitter.join();
+
+    if (file)
+    {
+        if (std::fflush(file) != 0)
+            failed = true;
+        if (file != stdout && std::fclose(file) != 0)
+            failed = true;
+        file = nullptr;
+    }
+    return !failed;
+}
+
+uint64_t OrderedOutput::horizon() const
+{
+    std::lock_guard lock(mutex);
+    return emittedBytes + ring.size();
+}
+
+uint64_t OrderedOutput::emitted() const
+{
+    std::lock_guard lock(mutex);
+    return emittedBytes;
+}
+
+uint64_t OrderedOutput::limitLocked() const
+{
+    return held ? std::min(ready, released) : ready;
+}
+
+void OrderedOutput::emitLoop()
+{
+    std::unique_lock lock(mutex);
+    for (;;)
+    {
+        // Once closing, whatever is ready still goes out before the loop ends
+        wakeEmitter.wait(lock, [&] { return limitLocked() > emittedBytes || closing; });
+        const uint64_t from = emittedBytes;
+        const uint64_t to = limitLocked();
+        if (to <= from)
+            break;
+        lock.unlock();
+
+        // At most two pieces, where the range wraps around the end of the ring
+        bool written = true;
+        for (uint64_t offset = from; offset < to && written;)
+        {
+            const uint64_t start = offset % ring.size();
+            const size_t size = std::min<uint64_t>(to - offset, ring.size() - start);
+            if (observer)
+                observer(ring.data() + start, size);
+            written = consumer ? consumer(ring.data() + start, size)
+                               : std::fwrite(ring.data() + start, 1, size, file) == size;
+            offset += size;
+        }
+        written = written && (consumer || std::fflush(file) == 0);
+
+        lock.lock();
+        if (!written)
+        {
+            if (consumer)
+                std::cerr << "The output consumer refused the data" << std::endl;
+            else
+                std::cerr << "Cannot write to the output: " << std::strerror(errno) << std::endl;
+            failed = true;
+            spaceFreed.notify_all();
+            break;
+        }
+        emittedBytes = to;
+        spaceFreed.notify_all();
+    }
+}
@@ -0,0 +1,256 @@
+#include <include/RangeJournal.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static constexpr auto JOURNAL_SUFFIX = ".journal";
+static constexpr auto JOURNAL_HEADER = "file_downloader-journal 1";
+
+std::vector<ByteRange> mergeRanges(std::vector<ByteRange> ranges)
+{
+    std::sort(ranges.begin(), ranges.end(), [](const ByteRange& a, const ByteRange& b) { return a.start < b.start; });
+
+    std::vector<ByteRange> merged;
+    for (const auto& range : ranges)
+    {
+        if (!merged.empty() && range.start <= merged.back().end + 1)
+            merged.back().end = std::max(merged.back().end, range.end);
+        else
+            merged.push_back(range);
+    }
+    return merged;
+}
+
+std::vector<ByteRange> missingRanges(const std::vector<ByteRange>& ranges, uint64_t fileSize)
+{
+    std::vector<ByteRange> missing;
+    uint64_t next = 0;
+    for (const auto& range : ranges)
+    {
+        if (range.start >= fileSize)
+            break;
+        if (range.start > next)
+            missing.push_back({next, range.start - 1});
+        next = std::max(next, range.end + 1);
+    }
+    if (next < fileSize)
+        missing.push_back({next, fileSize - 1});
+    return missing;
+}
+
+RangeJournal::RangeJournal(const std::string& outputFile)
+    : outputPath(outputFile), journalPath(outputFile + JOURNAL_SUFFIX)
+{
+}
+
+RangeJournal::~RangeJournal()
+{
+    stopFlushing();
+}
+
+std::optional<std::vector<ByteRange>> RangeJournal::open(FileSink& fileSink, const RemoteFileInfo& remoteFile,
+                                                         bool resume, uint64_t reorderWindow,
+                                                         const OrderedOutput::Consumer& consumer)
+{
+    sink = &fileSink;
+    remote = remoteFile;
+    completed.clear();
+
+    pipe = reorderWindow > 0 && (consumer || FileSink::isPipe(outputPath));
+    if (pipe)
+    {
+        if (!sink->openOrdered(outputPath, reorderWindow, consumer))
+            return std::nullopt;
+        return missingRanges({}, remote.size);
+    }
+
+    RemoteFileInfo recorded;
+    std::vector<ByteRange> ranges;
+    if (resume && load(recorded, ranges))
+    {
+        std::error_code errorCode;
+        const bool outputMatches = std::filesystem::file_size(outputPath, errorCode) == remote.size && !errorCode;
+
+        // Without a validator there is no way to tell whether the old bytes still belong to this file
+        if (remote.validator().empty())
+        {
+            std::cerr << "Server sends neither ETag nor Last-Modified, cannot resume safely" << std::endl;
+        }
+        else if (recorded.size != remote.size || recorded.etag != remote.etag ||
+                 recorded.lastModified != remote.lastModified)
+        {
+            std::cerr << "Remote file changed since the interrupted download, starting over" << std::endl;
+        }
+        else if (!outputMatches)
+        {
+            std::cerr << "Partial output " << outputPath << " is missing or truncated, starting over" << std::endl;
+        }
+        else
+        {
+            completed = mergeRanges(std::move(ranges));
+        }
+    }
+
+    if (!sink->open(outputPath, remote.size, completed.empty()))
+        return std::nullopt;
+
+    if (!completed.empty())
+    {
+        std::cerr << "Resuming download: " << resumedBytes() << " of " << remote.size << " bytes already on disk"
+                  << std::endl;
+    }
+    return missingRanges(completed, remote.size);
+}
+
+void RangeJournal::startFlushing(const RangeScheduler& rangeScheduler, std::chrono::milliseconds interval)
+{
+    stopFlushing();
+    if (pipe)
+        return;
+    scheduler = &rangeScheduler;
+    stopping = false;
+
+    flusher = std::thread([this, interval] {
+        std::unique_lock lock(mutex);
+        while (!wakeUp.wait_for(lock, interval, [this] { return stopping; }))
+        {
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+    });
+}
+
+void RangeJournal::finish(bool success)
+{
+    stopFlushing();
+    if (pipe)
+        return;
+
+    if (success)
+    {
+        std::error_code errorCode;
+        std::filesystem::remove(journalPath, errorCode);
+    }
+    else if (flush())
+    {
+        std::cerr << "Progress saved to " << journalPath << ", run again to resume" << std::endl;
+    }
+}
+
+void RangeJournal::discard()
+{
+    stopFlushing();
+    completed.clear();
+    scheduler = nullptr;
+
+    std::error_code errorCode;
+    std::filesystem::remove(journalPath, errorCode);
+}
+
+void RangeJournal::recordPresent(const std::vector<ByteRange>& ranges)
+{
+    completed.insert(completed.end(), ranges.begin(), ranges.end());
+    completed = mergeRanges(std::move(completed));
+}
+
+uint64_t RangeJournal::resumedBytes() const
+{
+    uint64_t bytes = 0;
+    for (const auto& range : completed)
+        bytes += range.end - range.start + 1;
+    return bytes;
+}
+
+void RangeJournal::stopFlushing()
+{
+    if (!flusher.joinable())
+        return;
+
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    flusher.join();
+}
+
+bool RangeJournal::load(RemoteFileInfo& recorded, std::vector<ByteRange>& ranges) const
+{
+    std::ifstream in(journalPath);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != JOURNAL_HEADER)
+        return false;
+
+    while (std::getline(in, line))
+    {
+        const auto space = line.find(' ');
+        const std::string key = line.substr(0, space);
+        const std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+
+        if (key == "size")
+        {
+            // A journal cut short or damaged is no journal; the download starts over
+            std::istringstream field(value);
+            if (!(field >> recorded.size))
+                return false;
+        }
+        else if (key == "etag")
+        {
+            recorded.etag = value;
+        }
+        else if (key == "last-modified")
+        {
+            recorded.lastModified = value;
+        }
+        else if (key == "range")
+        {
+            ByteRange range{};
+            std::istringstream field(value);
+            if (!(field >> range.start >> range.end))
+                return false;
+            if (range.end >= range.start && range.end < recorded.size)
+                ranges.push_back(range);
+        }
+    }
+    return true;
+}
+
+bool RangeJournal::flush()
+{
+    if (!sink || !scheduler)
+        return false;
+
+    auto ranges = scheduler->writtenRanges();
+    ranges.insert(ranges.end(), completed.begin(), completed.end());
+    ranges = mergeRanges(std::move(ranges));
+
+    // The data must be durable before the journal claims it is
+    if (!sink->sync())
+        return false;
+
+    std::ostringstream out;
+    out << JOURNAL_HEADER << '\n';
+    out << "size " << remote.size << '\n';
+    out << "etag " << remote.etag << '\n';
+    out << "last-modified " << remote.lastModified << '\n';
+    for (const auto& range : ranges)
+        out << "range " << range.start << ' ' << range.end << '\n';
+    const std::string text = out.str();
+
+    // Write-and-rename so a crash leaves either the old or the new journal, never a torn one
+    const std::string tempPath = journalPath + ".tmp";
+    FileSink journal;
+    if (!journal.open(tempPath, 0) || !journal.write(0, text.data(), text.size()) || !journal.sync() ||
+        !journal.close())
+    {
+        return false;
+    }
+
+    std::error_code errorCode;
+    std::filesystem::rename(tempPath, journalPath, errorCode);
+    return !errorCode;
+}
@@ -0,0 +1,444 @@
+#include <include/RangeScheduler.h>
+
+#include <algorithm>
+#include <cstddef>
+
+static constexpr uint64_t MIN_STEAL_SIZE = 256 * 1024;
+// A straggler runs at under a quarter of the median finished rate, or has been in flight twice as long as 95% of
+// the finished ranges took. Its rate only counts after a moment, and only against a few finished ranges.
+static constexpr double HEDGE_SLOWDOWN = 4.0;
+static constexpr double HEDGE_LATE_FACTOR = 2.0;
+static constexpr double HEDGE_LATE_PERCENTILE = 0.95;
+static constexpr double MIN_HEDGE_AGE = 0.5;
+static constexpr size_t MIN_HEDGE_SAMPLES = 3;
+// A copy that stalls too is hedged again, up to this many copies of a range at once
+static constexpr int MAX_COPIES = 3;
+// A range that is already overdue, but not hedged, is looked at again after this long
+static constexpr std::chrono::milliseconds MIN_STRAGGLER_RECHECK{10};
+
+// Value below which the given share of the values fall; reorders them
+static double percentile(std::vector<double>& values, double share)
+{
+    const auto nth = values.begin() + static_cast<ptrdiff_t>(share * (values.size() - 1));
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+}
+
+RangeScheduler::RangeScheduler(uint64_t fileSize, uint64_t unitSize, FileSink& sink, int maxRetries)
+    : RangeScheduler(fileSize ? std::vector<ByteRange>{{0, fileSize - 1}} : std::vector<ByteRange>{}, unitSize, sink,
+                     maxRetries)
+{
+}
+
+RangeScheduler::RangeScheduler(const std::vector<ByteRange>& ranges, uint64_t unitSize, FileSink& sink,
+                               int maxRetries)
+    : unitBytes(std::max<uint64_t>(unitSize, 1)), maxRetries(maxRetries), sink(&sink)
+{
+    for (const auto& range : ranges)
+    {
+        for (uint64_t start = range.start; start <= range.end; start += unitBytes)
+        {
+            auto& unit = units.emplace_back();
+            unit.start = start;
+            unit.end = std::min(start + unitBytes - 1, range.end);
+            unit.sink = &sink;
+            pending.push_back(&unit);
+            totalBytes += unit.size();
+
+            if (unit.end == range.end)
+                break;
+        }
+    }
+}
+
+uint64_t RangeScheduler::chooseUnitSize(uint64_t fileSize, int parallelTasks, uint64_t preferredSize,
+                                        uint64_t window)
+{
+    const uint64_t perConnection = (fileSize + parallelTasks - 1) / std::max(parallelTasks, 1);
+    const uint64_t size = std::max(MIN_UNIT_SIZE, std::min(preferredSize, perConnection));
+    if (window == 0)
+        return size;
+    return std::min(size, std::max<uint64_t>(window / std::max(parallelTasks, 1), 1));
+}
+
+Chunk* RangeScheduler::next(bool allowSteal)
+{
+    std::lock_guard lock(mutex);
+    if (hasFailed)
+        return nullptr;
+
+    if (!pending.empty() && fitsWindow(*pending.front()))
+    {
+        Chunk* chunk = pending.front();
+        pending.pop_front();
+        assign(*chunk);
+        return chunk;
+    }
+
+    return allowSteal ? steal() : nullptr;
+}
+
+Chunk* RangeScheduler::hedge(bool extraConnection)
+{
+    std::lock_guard lock(mutex);
+    if (hasFailed || hedgeBudget == 0 || (!extraConnection && !pending.empty() && fitsWindow(*pending.front())))
+        return nullptr;
+
+    Chunk* straggler = findStraggler(std::chrono::steady_clock::now());
+    if (!straggler)
+        return nullptr;
+
+    // The unclaimed upper half goes back to the queue as a unit of its own, and the copy starts where the straggler
+    // is now, so only the part the straggler holds up is fetched twice
+    auto& tail = units.emplace_back();
+    if (splitChunk(*straggler, tail, MIN_STEAL_SIZE))
+    {
+        ++steals;
+        requeue(tail);
+    }
+    else
+    {
+        units.pop_back();
+    }
+
+    hedgedBytes += straggler->remaining();
+    ++hedges;
+    straggler->hedged = true;
+    ++straggler->fetchers;
+    straggler->copiedAt = std::chrono::steady_clock::now();
+    straggler->receivedAtCopy = straggler->received;
+    return straggler;
+}
+
+std::optional<std::chrono::steady_clock::time_point> RangeScheduler::nextStragglerCheck() const
+{
+    std::lock_guard lock(mutex);
+    if (hasFailed || hedgeBudget == 0)
+        return std::nullopt;
+
+    const auto now = std::chrono::steady_clock::now();
+    const bool measured = finishedRates.size() >= MIN_HEDGE_SAMPLES;
+    double medianRate = 0.0;
+    double lateAfter = 0.0;
+    if (measured)
+    {
+        auto rates = finishedRates;
+        auto durations = finishedSeconds;
+        medianRate = percentile(rates, 0.5);
+        lateAfter = HEDGE_LATE_FACTOR * percentile(durations, HEDGE_LATE_PERCENTILE);
+    }
+
+    std::optional<std::chrono::steady_clock::time_point> check;
+    bool hedgedInFlight = false;
+    for (const Chunk* chunk : inFlight)
+    {
+        const uint64_t remaining = chunk->remaining();
+        hedgedInFlight = hedgedInFlight || chunk->hedged;
+        if (chunk->fetchers >= MAX_COPIES || remaining == 0 || hedgedBytes + remaining > hedgeBudget ||
+            !fitsWindow(*chunk))
+        {
+            continue;
+        }
+        if (!measured)
+            return std::chrono::steady_clock::time_point::max();
+
+        // Late once it outlives nearly all finished ranges, slow once its rate drops under the threshold, which
+        // without further bytes happens when its age reaches received / threshold
+        const double received = static_cast<double>(chunk->received - chunk->receivedAtCopy);
+        const double slowAfter = std::max(MIN_HEDGE_AGE, received * HEDGE_SLOWDOWN / std::max(medianRate, 1.0));
+        const auto due = chunk->copiedAt + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                 std::chrono::duration<double>(std::min(lateAfter, slowAfter)));
+        check = check ? std::min(*check, due) : due;
+    }
+    if (check)
+        check = std::max(*check, now + MIN_STRAGGLER_RECHECK);
+    else if (hedgedInFlight)
+        check = std::chrono::steady_clock::time_point::max();
+    return check;
+}
+
+uint64_t RangeScheduler::changeCount() const
+{
+    std::lock_guard lock(mutex);
+    return changes;
+}
+
+void RangeScheduler::setWaker(std::function<void()> value)
+{
+    std::lock_guard lock(mutex);
+    waker = std::move(value);
+}
+
+void RangeScheduler::changed()
+{
+    ++changes;
+    if (waker)
+        waker();
+}
+
+bool RangeScheduler::waitingForWindow() const
+{
+    std::lock_guard lock(mutex);
+    return !hasFailed && sink->ordered() && !pending.empty();
+}
+
+// With nothing else in flight the unit starts at the emit position, so it can go out whatever its size: its writes
+// past the window wait for the consumer
+bool RangeScheduler::fitsWindow(const Chunk& chunk) const
+{
+    const OrderedOutput* output = sink->ordered();
+    return !output || inFlight.empty() || chunk.end < output->horizon();
+}
+
+void RangeScheduler::requeue(Chunk& chunk)
+{
+    if (!sink->ordered())
+    {
+        pending.push_front(&chunk);
+        return;
+    }
+    const auto position = std::find_if(pending.begin(), pending.end(),
+                                       [&chunk](const Chunk* queued) { return queued->start > chunk.start; });
+    pending.insert(position, &chunk);
+}
+
+Chunk* RangeScheduler::findStraggler(std::chrono::steady_clock::time_point now) const
+{
+    if (finishedRates.size() < MIN_HEDGE_SAMPLES)
+        return nullptr;
+
+    auto rates = finishedRates;
+    auto durations = finishedSeconds;
+    const double medianRate = percentile(rates, 0.5);
+    const double lateAfter = HEDGE_LATE_FACTOR * percentile(durations, HEDGE_LATE_PERCENTILE);
+
+    // Of the stragglers the budget still covers, the one expected to finish last
+    Chunk* straggler = nullptr;
+    double stragglerEta = 0.0;
+    for (Chunk* chunk : inFlight)
+    {
+        const uint64_t remaining = chunk->remaining();
+        if (chunk->fetchers >= MAX_COPIES || remaining == 0 || hedgedBytes + remaining > hedgeBudget ||
+            !fitsWindow(*chunk))
+        {
+            continue;
+        }
+
+        // Measured since its latest copy started, so a hedged range only counts as behind once that one is too
+        const double age = std::chrono::duration<double>(now - chunk->copiedAt).count();
+        const double rate = (chunk->received - chunk->receivedAtCopy) / std::max(age, 1e-3);
+        const bool slow = age >= MIN_HEDGE_AGE && rate < medianRate / HEDGE_SLOWDOWN;
+        const bool late = age > lateAfter;
+        if (!slow && !late)
+            continue;
+
+        const double eta = remaining / std::max(rate, 1.0);
+        if (!straggler || eta > stragglerEta)
+        {
+            straggler = chunk;
+            stragglerEta = eta;
+        }
+    }
+    return straggler;
+}
+
+void RangeScheduler::complete(Chunk& chunk)
+{
+    std::lock_guard lock(mutex);
+    --chunk.fetchers;
+    if (chunk.done)
+        return;
+
+    chunk.done = true;
+    inFlight.erase(std::remove(inFlight.begin(), inFlight.end(), &chunk), inFlight.end());
+    ++completed;
+
+    if (hedgeBudget > 0)
+    {
+        const double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - chunk.assignedAt).count();
+        finishedSeconds.push_back(seconds);
+        finishedRates.push_back((chunk.received - chunk.receivedAtAssign) / std::max(seconds, 1e-3));
+    }
+    changed();
+}
+
+bool RangeScheduler::fail(Chunk& chunk)
+{
+    std::lock_guard lock(mutex);
+    // The other copy of a hedged chunk is still at it, or has already finished it
+    if (--chunk.fetchers > 0 || chunk.done)
+        return true;
+
+    inFlight.erase(std::remove(inFlight.begin(), inFlight.end(), &chunk), inFlight.end());
+
+    if (++chunk.attempts >= maxRetries)
+    {
+        hasFailed = true;
+        changed();
+        return false;
+    }
+
+    // Retried before fresh work so a failing range does not end up as the download's tail
+    requeue(chunk);
+    changed();
+    return true;
+}
+
+void RangeScheduler::abort()
+{
+    std::lock_guard lock(mutex);
+    hasFailed = true;
+    changed();
+}
+
+void RangeScheduler::cancel()
+{
+    std::vector<Chunk*> running;
+    {
+        std::lock_guard lock(mutex);
+        hasFailed = true;
+        running = inFlight;
+        changed();
+    }
+    // Units are never freed, so the chunks outlive the lock
+    for (Chunk* chunk : running)
+        stopFetches(*chunk);
+}
+
+void RangeScheduler::setVerifier(DownloadVerifier* value)
+{
+    std::lock_guard lock(mutex);
+    verifier = value;
+    for (auto& unit : units)
+        unit.verifier = value;
+}
+
+void RangeScheduler::enableHedging(double budgetShare)
+{
+    std::lock_guard lock(mutex);
+    hedgeBudget = static_cast<uint64_t>(std::max(budgetShare, 0.0) * totalBytes);
+}
+
+void RangeScheduler::refetch(const ByteRange& range)
+{
+    std::lock_guard lock(mutex);
+    if (hasFailed)
+        return;
+
+    auto& unit = units.emplace_back();
+    unit.start = range.start;
+    unit.end = range.end;
+    unit.sink = sink;
+    unit.verifier = verifier;
+    requeue(unit);
+    changed();
+}
+
+Chunk* RangeScheduler::adopt(const ByteRange& range)
+{
+    std::lock_guard lock(mutex);
+    auto& unit = units.emplace_back();
+    unit.start = range.start;
+    unit.end = range.end;
+    unit.sink = sink;
+    unit.verifier = verifier;
+    totalBytes += unit.size();
+    assign(unit);
+    return &unit;
+}
+
+bool RangeScheduler::finished() const
+{
+    std::lock_guard lock(mutex);
+    return !hasFailed && completed == units.size();
+}
+
+bool RangeScheduler::failed() const
+{
+    std::lock_guard lock(mutex);
+    return hasFailed;
+}
+
+size_t RangeScheduler::unitCount() const
+{
+    std::lock_guard lock(mutex);
+    return units.size();
+}
+
+uint64_t RangeScheduler::stealCount() const
+{
+    std::lock_guard lock(mutex);
+    return steals;
+}
+
+uint64_t RangeScheduler::hedgeCount() const
+{
+    std::lock_guard lock(mutex);
+    return hedges;
+}
+
+std::vector<ByteRange> RangeScheduler::writtenRanges() const
+{
+    std::lock_guard lock(mutex);
+
+    std::vector<ByteRange> ranges;
+    for (const auto& unit : units)
+    {
+        const uint64_t received = unit.received;
+        if (received > 0)
+            ranges.push_back({unit.start, unit.start + received - 1});
+    }
+    return ranges;
+}
+
+Chunk* RangeScheduler::steal()
+{
+    // The victim is the range expected to finish last at its current rate, or for an ordered output the one the
+    // emit position waits for first. The tail ends where the victim does, so into an ordered output only a victim
+    // within the window can give one up; a tail past it would block its connection's writes
+    const bool ordered = sink->ordered();
+    const auto now = std::chrono::steady_clock::now();
+    Chunk* victim = nullptr;
+    double victimEta = 0.0;
+
+    for (Chunk* chunk : inFlight)
+    {
+        const uint64_t remaining = chunk->remaining();
+        if (remaining < 2 * MIN_STEAL_SIZE || !fitsWindow(*chunk))
+            continue;
+
+        const double seconds = std::chrono::duration<double>(now - chunk->assignedAt).count();
+        const double rate = (chunk->received - chunk->receivedAtAssign) / std::max(seconds, 1e-3);
+        const double eta = remaining / std::max(rate, 1.0);
+        if (!victim || (ordered ? chunk->start < victim->start : eta > victimEta))
+        {
+            victim = chunk;
+            victimEta = eta;
+        }
+    }
+
+    if (!victim)
+        return nullptr;
+
+    auto& tail = units.emplace_back();
+    if (!splitChunk(*victim, tail, MIN_STEAL_SIZE))
+    {
+        units.pop_back();
+        return nullptr;
+    }
+
+    ++steals;
+    assign(tail);
+    return &tail;
+}
+
+void RangeScheduler::assign(Chunk& chunk)
+{
+    ++chunk.fetchers;
+    chunk.assignedAt = std::chrono::steady_clock::now();
+    chunk.receivedAtAssign = chunk.received;
+    chunk.copiedAt = chunk.assignedAt;
+    chunk.receivedAtCopy = chunk.received;
+    inFlight.push_back(&chunk);
+}
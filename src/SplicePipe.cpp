@@ -0,0 +1,99 @@
+#include <include/SplicePipe.h>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#ifdef __linux__
+// Large enough that a fill rarely stops before the socket's receive queue is empty; unprivileged processes may go
+// up to /proc/sys/fs/pipe-max-size, 1 MiB by default
+static constexpr int PIPE_SIZE = 1024 * 1024;
+#endif
+
+SplicePipe::~SplicePipe()
+{
+    close();
+}
+
+#ifdef __linux__
+
+bool SplicePipe::open()
+{
+    int ends[2];
+    if (pipe2(ends, O_CLOEXEC) != 0)
+        return false;
+    readEnd = ends[0];
+    writeEnd = ends[1];
+
+    // Keeps the default size when the limit is lower
+    fcntl(writeEnd, F_SETPIPE_SZ, PIPE_SIZE);
+    const int size = fcntl(writeEnd, F_GETPIPE_SZ);
+    if (size <= 0)
+    {
+        close();
+        return false;
+    }
+    pipeSize = static_cast<size_t>(size);
+    return true;
+}
+
+int64_t SplicePipe::fill(int socket, size_t size)
+{
+    for (;;)
+    {
+        const ssize_t moved = splice(socket, nullptr, writeEnd, nullptr, std::min(size, pipeSize),
+                                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved >= 0 || errno != EINTR)
+            return moved;
+    }
+}
+
+bool SplicePipe::discard(size_t size)
+{
+    char scratch[16 * 1024];
+    while (size > 0)
+    {
+        const ssize_t count = read(readEnd, scratch, std::min(size, sizeof(scratch)));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+void SplicePipe::close()
+{
+    if (readEnd >= 0)
+        ::close(readEnd);
+    if (writeEnd >= 0)
+        ::close(writeEnd);
+    readEnd = writeEnd = -1;
+    pipeSize = 0;
+}
+
+#else
+
+bool SplicePipe::open()
+{
+    return false;
+}
+
+int64_t SplicePipe::fill(int, size_t)
+{
+    return -1;
+}
+
+bool SplicePipe::discard(size_t)
+{
+    return false;
+}
+
+void SplicePipe::close() {}
+
+#endif
@@ -0,0 +1,234 @@
+#include <include/StreamWriter.h>
+
+#include <zlib.h>
+#ifdef FILE_DOWNLOADER_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <vector>
+
+// The first step the reservation grows by, and the largest one: steps double with the stream so far
+static constexpr uint64_t MIN_RESERVATION_STEP = 8 * 1024 * 1024;
+static constexpr uint64_t MAX_RESERVATION_STEP = 256 * 1024 * 1024;
+// Decoded bytes pass through this much memory on their way to the file
+static constexpr size_t DECODE_BUFFER_SIZE = 64 * 1024;
+// zlib's largest window, plus 32 to take both the gzip and the zlib header
+static constexpr int ZLIB_AUTO_HEADER = 15 + 32;
+// The largest window without any header, for deflate bodies sent without the zlib wrapper
+static constexpr int RAW_DEFLATE = -15;
+
+// Whether a deflate body starts with a zlib header, which names deflate with a window zlib can take and is a multiple
+// of 31, or is a gzip member sent as deflate; anything else is raw deflate
+static bool hasHeader(const std::string& start)
+{
+    const auto method = static_cast<unsigned char>(start[0]);
+    const auto flags = static_cast<unsigned char>(start[1]);
+    if (method == 0x1F && flags == 0x8B)
+        return true;
+    return (method & 0x0F) == Z_DEFLATED && (method >> 4) <= 7 && ((method << 8) | flags) % 31 == 0;
+}
+
+struct StreamWriter::Decoder
+{
+    enum class Format
+    {
+        Zlib,
+        Zstd
+    };
+
+    explicit Decoder(Format format) : format(format) {}
+    ~Decoder()
+    {
+        if (format == Format::Zlib)
+            inflateEnd(&zlib);
+#ifdef FILE_DOWNLOADER_ZSTD
+        ZSTD_freeDStream(zstd);
+#endif
+    }
+
+    Format format;
+    z_stream zlib{};
+#ifdef FILE_DOWNLOADER_ZSTD
+    ZSTD_DStream* zstd = nullptr;
+#endif
+    // The last frame or gzip member ended; more input starts another one
+    bool ended = false;
+    // A deflate body comes with the zlib wrapper or raw, as many servers send it; its first two bytes tell which, and
+    // are kept here until they are in
+    bool sniffing = false;
+    std::string sniffed;
+    std::vector<char> output = std::vector<char>(DECODE_BUFFER_SIZE);
+};
+
+StreamWriter::StreamWriter(FileSink& sink, uint64_t reserved) : sink(sink), reserved(reserved)
+{
+}
+
+StreamWriter::~StreamWriter() {}
+
+const char* StreamWriter::acceptedEncodings()
+{
+#ifdef FILE_DOWNLOADER_ZSTD
+    return "zstd, gzip, deflate";
+#else
+    return "gzip, deflate";
+#endif
+}
+
+bool StreamWriter::setEncoding(const std::string& contentEncoding)
+{
+    std::string encoding;
+    for (const char c : contentEncoding)
+    {
+        if (!std::isspace(static_cast<unsigned char>(c)))
+            encoding += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+
+    decoder.reset();
+    if (encoding.empty() || encoding == "identity")
+        return true;
+
+    if (encoding == "gzip" || encoding == "x-gzip")
+    {
+        decoder = std::make_unique<Decoder>(Decoder::Format::Zlib);
+        if (inflateInit2(&decoder->zlib, ZLIB_AUTO_HEADER) == Z_OK)
+            return true;
+    }
+    else if (encoding == "deflate")
+    {
+        decoder = std::make_unique<Decoder>(Decoder::Format::Zlib);
+        decoder->sniffing = true;
+        return true;
+    }
+#ifdef FILE_DOWNLOADER_ZSTD
+    else if (encoding == "zstd")
+    {
+        decoder = std::make_unique<Decoder>(Decoder::Format::Zstd);
+        decoder->zstd = ZSTD_createDStream();
+        if (decoder->zstd && !ZSTD_isError(ZSTD_initDStream(decoder->zstd)))
+            return true;
+    }
+#endif
+
+    decoder.reset();
+    std::cerr << "Cannot decode Content-Encoding: " << contentEncoding << std::endl;
+    return false;
+}
+
+bool StreamWriter::append(const char* data, size_t size)
+{
+    if (!decoder)
+        return write(data, size);
+
+    if (decoder->sniffing)
+    {
+        decoder->sniffed.append(data, size);
+        if (decoder->sniffed.size() < 2)
+            return true;
+
+        decoder->sniffing = false;
+        const int windowBits = hasHeader(decoder->sniffed) ? ZLIB_AUTO_HEADER : RAW_DEFLATE;
+        if (inflateInit2(&decoder->zlib, windowBits) != Z_OK)
+        {
+            std::cerr << "Cannot decode Content-Encoding: deflate" << std::endl;
+            return false;
+        }
+        const std::string sniffed = std::move(decoder->sniffed);
+        return inflateData(sniffed.data(), sniffed.size());
+    }
+    if (decoder->format == Decoder::Format::Zlib)
+        return inflateData(data, size);
+
+#ifdef FILE_DOWNLOADER_ZSTD
+    std::vector<char>& output = decoder->output;
+    ZSTD_inBuffer input{data, size, 0};
+    bool full = false;
+    while (input.pos < input.size || full)
+    {
+        ZSTD_outBuffer out{output.data(), output.size(), 0};
+        const size_t result = ZSTD_decompressStream(decoder->zstd, &out, &input);
+        if (ZSTD_isError(result))
+        {
+            std::cerr << "Corrupt compressed stream after " << written << " bytes: " << ZSTD_getErrorName(result)
+                      << std::endl;
+            return false;
+        }
+        decoder->ended = result == 0;
+        full = out.pos == out.size;
+        if (!write(output.data(), out.pos))
+            return false;
+    }
+#endif
+    return true;
+}
+
+bool StreamWriter::inflateData(const char* data, size_t size)
+{
+    std::vector<char>& output = decoder->output;
+    z_stream& zlib = decoder->zlib;
+    zlib.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zlib.avail_in = static_cast<uInt>(size);
+    // Runs until the input is used up and the last call had output space to spare
+    do
+    {
+        // Concatenated gzip members decode to the concatenated content
+        if (decoder->ended)
+        {
+            if (zlib.avail_in == 0)
+                break;
+            inflateReset(&zlib);
+            decoder->ended = false;
+        }
+
+        zlib.next_out = reinterpret_cast<Bytef*>(output.data());
+        zlib.avail_out = static_cast<uInt>(output.size());
+        const int result = inflate(&zlib, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+        {
+            std::cerr << "Corrupt compressed stream after " << written << " bytes: "
+                      << (zlib.msg ? zlib.msg : "inflate failed") << std::endl;
+            return false;
+        }
+        decoder->ended = result == Z_STREAM_END;
+
+        const size_t produced = output.size() - zlib.avail_out;
+        if (!write(output.data(), produced))
+            return false;
+        // No progress is possible until more input arrives
+        if (result == Z_BUF_ERROR)
+            break;
+    } while (zlib.avail_in > 0 || zlib.avail_out == 0);
+    return true;
+}
+
+bool StreamWriter::finish()
+{
+    if (decoder && !decoder->ended)
+    {
+        std::cerr << "Compressed stream ended early, after " << written << " decoded bytes" << std::endl;
+        return false;
+    }
+    return written == reserved || sink.resize(written);
+}
+
+bool StreamWriter::write(const char* data, size_t size)
+{
+    if (size == 0)
+        return true;
+
+    if (written + size > reserved)
+    {
+        const uint64_t step = std::clamp(written, MIN_RESERVATION_STEP, MAX_RESERVATION_STEP);
+        reserved = std::max(written + size, reserved + step);
+        if (!sink.reserve(reserved))
+            return false;
+    }
+
+    if (!sink.write(written, data, size))
+        return false;
+    written += size;
+    return true;
+}
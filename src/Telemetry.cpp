@@ -0,0 +1,296 @@
+#include <include/Telemetry.h>
+
+#include <bit>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::microseconds;
+
+static constexpr double MIB = 1024.0 * 1024.0;
+
+static size_t bucketOf(uint64_t value)
+{
+    return std::min<size_t>(std::bit_width(value), Histogram::BUCKETS - 1);
+}
+
+static uint64_t bucketLimit(size_t bucket)
+{
+    return bucket == 0 ? 0 : bucket >= 63 ? UINT64_MAX : (uint64_t{1} << bucket) - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+    buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    samples.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t current = largest.load(std::memory_order_relaxed);
+    while (value > current && !largest.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+void Histogram::reset()
+{
+    for (auto& bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    samples = 0;
+    sum = 0;
+    largest = 0;
+}
+
+uint64_t Histogram::percentile(double share) const
+{
+    const uint64_t total = count();
+    if (total == 0)
+        return 0;
+
+    const auto wanted = static_cast<uint64_t>(share * total + 0.5);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+        seen += buckets[bucket].load(std::memory_order_relaxed);
+        if (seen >= wanted && seen > 0)
+            return std::min(bucketLimit(bucket), max());
+    }
+    return max();
+}
+
+void Histogram::writeJson(std::ostream& out) const
+{
+    const uint64_t total = count();
+    out << "{\"count\":" << total << ",\"mean\":" << (total ? sum.load(std::memory_order_relaxed) / total : 0)
+        << ",\"p50\":" << percentile(0.50) << ",\"p90\":" << percentile(0.90) << ",\"p99\":" << percentile(0.99)
+        << ",\"max\":" << max() << ",\"buckets\":[";
+
+    // Only the occupied buckets, as [inclusive upper bound, count] pairs
+    bool first = true;
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+        const uint64_t n = buckets[bucket].load(std::memory_order_relaxed);
+        if (n == 0)
+            continue;
+        out << (first ? "" : ",") << "[" << bucketLimit(bucket) << "," << n << "]";
+        first = false;
+    }
+    out << "]}";
+}
+
+void Telemetry::begin(int connections)
+{
+    std::lock_guard lock(mutex);
+    slotCount = std::max(connections, 1);
+    slots = std::make_unique<ConnectionStats[]>(slotCount);
+    for (auto* histogram : {&firstByteUs, &dnsUs, &connectUs, &tlsUs, &rangeUs, &rangeBytes, &rangeKiBPerSecond,
+                            &stallUs})
+        histogram->reset();
+
+    started = Clock::now();
+    ended = {};
+    lastReport = started;
+    lastBytes = 0;
+    activeConnections.store(slotCount, std::memory_order_relaxed);
+    concurrencySteps.clear();
+}
+
+void Telemetry::end()
+{
+    std::lock_guard lock(mutex);
+    ended = Clock::now();
+}
+
+void Telemetry::recordRange(const RangeSample& sample)
+{
+    rangeBytes.record(sample.bytes);
+    rangeUs.record(sample.duration.count());
+    firstByteUs.record(sample.firstByte.count());
+    if (sample.duration.count() > 0)
+        rangeKiBPerSecond.record(sample.bytes * 1000000 / 1024 / sample.duration.count());
+
+    // These only happen on ranges that had to open a connection
+    if (sample.dns.count() > 0)
+        dnsUs.record(sample.dns.count());
+    if (sample.connect.count() > 0)
+        connectUs.record(sample.connect.count());
+    if (sample.tls.count() > 0)
+        tlsUs.record(sample.tls.count());
+}
+
+void Telemetry::recordDns(microseconds time)
+{
+    dnsUs.record(time.count());
+}
+
+void Telemetry::recordStall(int connection, microseconds time)
+{
+    slots[connection].stalls.fetch_add(1, std::memory_order_relaxed);
+    stallUs.record(time.count());
+}
+
+void Telemetry::recordRetry(int connection)
+{
+    slots[connection].retries.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Telemetry::recordConcurrency(int connections)
+{
+    std::lock_guard lock(mutex);
+    activeConnections.store(connections, std::memory_order_relaxed);
+    concurrencySteps.emplace_back(std::chrono::duration<double>(Clock::now() - started).count(), connections);
+}
+
+uint64_t Telemetry::totalBytes() const
+{
+    std::lock_guard lock(mutex);
+    uint64_t total = 0;
+    for (int i = 0; i < slotCount; ++i)
+        total += slots[i].bytes.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t Telemetry::totalRanges() const
+{
+    std::lock_guard lock(mutex);
+    uint64_t total = 0;
+    for (int i = 0; i < slotCount; ++i)
+        total += slots[i].ranges.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t Telemetry::totalRetries() const
+{
+    std::lock_guard lock(mutex);
+    uint64_t total = 0;
+    for (int i = 0; i < slotCount; ++i)
+        total += slots[i].retries.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t Telemetry::totalStalls() const
+{
+    std::lock_guard lock(mutex);
+    uint64_t total = 0;
+    for (int i = 0; i < slotCount; ++i)
+        total += slots[i].stalls.load(std::memory_order_relaxed);
+    return total;
+}
+
+std::string Telemetry::statusLine()
+{
+    const auto now = Clock::now();
+    const uint64_t bytes = totalBytes();
+    const uint64_t retries = totalRetries();
+    const uint64_t stalls = totalStalls();
+
+    std::lock_guard lock(mutex);
+    const double interval = std::chrono::duration<double>(now - lastReport).count();
+    const double rate = interval > 0 ? (bytes - lastBytes) / MIB / interval : 0.0;
+    lastReport = now;
+    lastBytes = bytes;
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << "[stats] " << rate << " MiB/s, " << bytes / MIB << " MiB, "
+         << rangeUs.count() << " ranges, ttfb p50 " << firstByteUs.percentile(0.5) / 1000.0 << " ms, "
+         << retries << " retries, " << stalls << " stalls, " << concurrency() << " connections";
+    return line.str();
+}
+
+void Telemetry::writeJson(std::ostream& out) const
+{
+    const uint64_t bytes = totalBytes();
+    const uint64_t retries = totalRetries();
+    const uint64_t stalls = totalStalls();
+
+    std::lock_guard lock(mutex);
+    const auto finished = ended == Clock::time_point{} ? Clock::now() : ended;
+    const double elapsed = std::chrono::duration<double>(finished - started).count();
+
+    out << "{\"elapsed_s\":" << elapsed << ",\"bytes\":" << bytes
+        << ",\"mib_per_s\":" << (elapsed > 0 ? bytes / MIB / elapsed : 0.0) << ",\"ranges\":" << rangeUs.count()
+        << ",\"retries\":" << retries << ",\"stalls\":" << stalls << ",\"concurrency\":" << concurrency()
+        << ",\"concurrency_steps\":[";
+    // Downloads with a fixed number of connections never record a step
+    if (concurrencySteps.empty())
+        out << "[0," << slotCount << "]";
+    for (size_t i = 0; i < concurrencySteps.size(); ++i)
+        out << (i ? "," : "") << "[" << concurrencySteps[i].first << "," << concurrencySteps[i].second << "]";
+    out << "],\"histograms\":{";
+
+    const std::pair<const char*, const Histogram*> histograms[] = {
+        {"ttfb_us", &firstByteUs}, {"dns_us", &dnsUs},       {"connect_us", &connectUs},
+        {"tls_us", &tlsUs},        {"range_us", &rangeUs},   {"range_bytes", &rangeBytes},
+        {"range_kib_per_s", &rangeKiBPerSecond},             {"stall_us", &stallUs}};
+    for (size_t i = 0; i < std::size(histograms); ++i)
+    {
+        out << (i ? "," : "") << "\"" << histograms[i].first << "\":";
+        histograms[i].second->writeJson(out);
+    }
+
+    out << "},\"connections\":[";
+    for (int i = 0; i < slotCount; ++i)
+    {
+        const auto& slot = slots[i];
+        out << (i ? "," : "") << "{\"bytes\":" << slot.bytes.load(std::memory_order_relaxed)
+            << ",\"ranges\":" << slot.ranges.load(std::memory_order_relaxed)
+            << ",\"retries\":" << slot.retries.load(std::memory_order_relaxed)
+            << ",\"stalls\":" << slot.stalls.load(std::memory_order_relaxed) << "}";
+    }
+    out << "]}\n";
+}
+
+void RangeProbe::attach(Telemetry* owner, int connectionIndex)
+{
+    telemetry = owner;
+    index = connectionIndex;
+    stats = owner ? &owner->connection(connectionIndex) : nullptr;
+}
+
+void RangeProbe::start()
+{
+    sample = {};
+    requested = Clock::now();
+}
+
+void RangeProbe::onResponse()
+{
+    lastData = Clock::now();
+    sample.firstByte = std::chrono::duration_cast<microseconds>(lastData - requested);
+}
+
+void RangeProbe::finish(bool completed)
+{
+    if (!telemetry || !completed)
+        return;
+
+    if (sample.duration.count() == 0)
+        sample.duration = std::chrono::duration_cast<microseconds>(Clock::now() - requested);
+    stats->ranges.fetch_add(1, std::memory_order_relaxed);
+    telemetry->recordRange(sample);
+}
+
+void RangeProbe::retry()
+{
+    if (telemetry)
+        telemetry->recordRetry(index);
+}
+
+StatsReporter::StatsReporter(Telemetry& telemetry, std::chrono::milliseconds interval)
+{
+    thread = std::thread([this, &telemetry, interval]() {
+        std::unique_lock lock(mutex);
+        while (!wakeUp.wait_for(lock, interval, [this] { return stopping; }))
+            std::cerr << telemetry.statusLine() << std::endl;
+    });
+}
+
+StatsReporter::~StatsReporter()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wakeUp.notify_one();
+    thread.join();
+}